@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "defs.h"
+#include "netio.h"
+#include "pdns.h"
+#include "arena.h"
+#include "globals.h"
+
+/* jansson allocates through us.  between arena_begin() and arena_end(),
+ * while the lines of one chunk are parsed and presented, a thread's
+ * allocations are carved from its own arena, and freeing them does
+ * nothing; the next arena_begin() takes it all back at once.  the rest,
+ * and any too large for the arena, come from the heap.  each allocation
+ * is preceded by a header saying which, so that it can be freed by any
+ * thread, and at any time.
+ */
+#define ARENA_ALIGN	16
+#define ARENA_BLOCK	(256 * 1024)
+#define ARENA_LARGE	(ARENA_BLOCK / 4)
+#define FROM_HEAP	0x68656170U
+#define FROM_ARENA	0x6172656eU
+
+/* one block of an arena; its octets follow. */
+struct block {
+	struct block	*next;
+	size_t		size;
+};
+#define BLOCK_HDR	((sizeof(struct block) + ARENA_ALIGN - 1) & \
+			 ~(size_t)(ARENA_ALIGN - 1))
+#define BLOCK_DATA(b)	((char *)(b) + BLOCK_HDR)
+
+/* one thread's arena: its blocks, newest first, with used octets of the
+ * newest in use; and what it has allocated since its counts were last
+ * added to the totals.
+ */
+struct arena {
+	struct block	*blocks;
+	size_t		used, total, chunk;
+	bool		open;
+	u_long		allocs, heap;
+};
+static _Thread_local struct arena arena;
+
+static atomic_ulong total_allocs = 0, total_heap = 0, total_chunks = 0;
+static atomic_size_t total_peak = 0;
+
+static void *arena_malloc(size_t);
+static void block_new(struct arena *, size_t);
+static void arena_flush(struct arena *);
+
+/* arena_init -- have jansson allocate through us.  this must be done
+ * before anything else asks jansson for memory.
+ */
+void
+arena_init(void) {
+	json_set_alloc_funcs(arena_malloc, arena_free);
+}
+
+/* arena_begin -- start on a chunk, taking back all that this thread's
+ * arena gave out for the last one.
+ */
+void
+arena_begin(void) {
+	struct arena *a = &arena;
+
+	/* a chunk which outgrew one block gets one as large as all of
+	 * them, so that the next chunk like it needs only the one.
+	 */
+	if (a->blocks != NULL && a->blocks->next != NULL) {
+		size_t total = a->total;
+
+		arena_release();
+		block_new(a, total);
+	}
+	a->used = 0;
+	a->chunk = 0;
+	a->open = true;
+}
+
+/* arena_end -- finish with a chunk, and add up what it allocated.  what
+ * the arena gave out stays usable until the next arena_begin().
+ */
+void
+arena_end(void) {
+	struct arena *a = &arena;
+	size_t peak = atomic_load(&total_peak);
+
+	a->open = false;
+	arena_flush(a);
+	atomic_fetch_add(&total_chunks, 1);
+	while (a->chunk > peak &&
+	       !atomic_compare_exchange_weak(&total_peak, &peak, a->chunk))
+		continue;
+}
+
+/* arena_release -- free this thread's arena, as a thread must before it
+ * exits.
+ */
+void
+arena_release(void) {
+	struct arena *a = &arena;
+	struct block *b;
+
+	assert(!a->open);
+	arena_flush(a);
+	while ((b = a->blocks) != NULL) {
+		a->blocks = b->next;
+		free(b);
+	}
+	a->used = a->total = 0;
+}
+
+/* arena_fini -- free this thread's arena, and report on them all.
+ */
+void
+arena_fini(void) {
+	struct arena_stats st;
+
+	arena_release();
+	arena_stats(&st);
+	if (st.chunks != 0)
+		DEBUG(1, true, "arena: %lu allocations in %lu chunks,"
+		      " %lu more from the heap, at most %zu octets"
+		      " a chunk\n",
+		      st.allocs, st.chunks, st.heap, st.peak);
+	atomic_store(&total_allocs, 0);
+	atomic_store(&total_heap, 0);
+	atomic_store(&total_chunks, 0);
+	atomic_store(&total_peak, 0);
+}
+
+/* arena_free -- jansson's free, and what must free anything it returns,
+ * such as the text from json_dumps().
+ */
+void
+arena_free(void *ptr) {
+	char *p;
+
+	if (ptr == NULL)
+		return;
+	p = (char *)ptr - ARENA_ALIGN;
+	if (*(uint32_t *)(void *)p == FROM_HEAP)
+		free(p);
+	else
+		assert(*(uint32_t *)(void *)p == FROM_ARENA);
+}
+
+/* arena_stats -- what jansson has allocated so far, in all threads, as
+ * far as their counts have been added up.  this thread's always are.
+ */
+void
+arena_stats(struct arena_stats *st) {
+	arena_flush(&arena);
+	st->allocs = atomic_load(&total_allocs);
+	st->heap = atomic_load(&total_heap);
+	st->chunks = atomic_load(&total_chunks);
+	st->peak = atomic_load(&total_peak);
+}
+
+/* arena_malloc -- jansson's malloc.
+ */
+static void *
+arena_malloc(size_t size) {
+	struct arena *a = &arena;
+	char *p;
+
+	if (a->open && size <= ARENA_LARGE) {
+		size_t need = ARENA_ALIGN +
+			((size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1));
+
+		if (a->blocks == NULL || a->used + need > a->blocks->size)
+			block_new(a, a->total > ARENA_BLOCK
+				  ? a->total : ARENA_BLOCK);
+		p = BLOCK_DATA(a->blocks) + a->used;
+		a->used += need;
+		a->chunk += need;
+		a->allocs++;
+		*(uint32_t *)(void *)p = FROM_ARENA;
+		return p + ARENA_ALIGN;
+	}
+	p = malloc(ARENA_ALIGN + size);
+	if (p == NULL)
+		return NULL;
+	a->heap++;
+	*(uint32_t *)(void *)p = FROM_HEAP;
+	return p + ARENA_ALIGN;
+}
+
+/* block_new -- give an arena a new block of at least size octets, to be
+ * used from its start.
+ */
+static void
+block_new(struct arena *a, size_t size) {
+	struct block *b = malloc(BLOCK_HDR + size);
+
+	if (b == NULL)
+		my_panic(true, "malloc");
+	b->next = a->blocks;
+	b->size = size;
+	a->blocks = b;
+	a->total += size;
+	a->used = 0;
+}
+
+/* arena_flush -- add what an arena has allocated to the totals.
+ */
+static void
+arena_flush(struct arena *a) {
+	if (a->allocs != 0)
+		atomic_fetch_add(&total_allocs, a->allocs);
+	if (a->heap != 0)
+		atomic_fetch_add(&total_heap, a->heap);
+	a->allocs = a->heap = 0;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED 1
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* what jansson has allocated, in all threads: how many allocations came
+ * from an arena, and how many from the heap; in how many chunks; and the
+ * most octets of arena one chunk used.
+ */
+struct arena_stats {
+	u_long	allocs, heap, chunks;
+	size_t	peak;
+};
+
+void arena_init(void);
+void arena_begin(void);
+void arena_end(void);
+void arena_release(void);
+void arena_fini(void);
+void arena_free(void *);
+void arena_stats(struct arena_stats *);
+
+#endif /*ARENA_H_INCLUDED*/
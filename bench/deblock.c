@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* deblock -- measure how fast writer_func() deblocks a response.
+ *
+ * usage: deblock [-c CHUNK] [-n LINES] [-r ROUNDS] [-i INDEXER]
+ *		  [-w WORKERS] [FILE]
+ *
+ * FILE is a recorded NDJSON response; without one, a response of LINES
+ * short rrnames results is made up.  The response is fed to writer_func()
+ * CHUNK octets at a time, as libcurl would, ROUNDS times over, and is
+ * deblocked and parsed but not presented.  this is done once with each
+ * structural indexer this CPU has, scalar first, or with INDEXER only.
+ * with WORKERS, the lines are parsed in that many threads, as with
+ * --workers.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAIN_PROGRAM
+#include "../defs.h"
+#include "../netio.h"
+#include "../pdns.h"
+#include "../sindex.h"
+#include "../arena.h"
+#include "../globals.h"
+#undef MAIN_PROGRAM
+
+static void run(const char *, char *, size_t, long, long,
+		struct fetch *);
+static bool present_none(pdns_tuple_ct, const char *, size_t, writer_t);
+static char *make_response(long, size_t *);
+static char *read_response(const char *, size_t *);
+static double now_sec(void);
+
+int
+main(int argc, char *argv[]) {
+	long chunk = 16384, lines = 1000000, rounds = 5;
+	const char *only = NULL;
+	struct query query = {};
+	struct fetch fetch = {};
+	writer_t writer;
+	size_t len;
+	char *response;
+	int ch, i;
+
+	program_name = "deblock";
+	arena_init();
+	while ((ch = getopt(argc, argv, "c:n:r:i:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			chunk = atol(optarg);
+			break;
+		case 'n':
+			lines = atol(optarg);
+			break;
+		case 'r':
+			rounds = atol(optarg);
+			break;
+		case 'i':
+			only = optarg;
+			break;
+		case 'w':
+			parse_workers = atol(optarg);
+			if (parse_workers <= 0)
+				my_panic(false, "-w must be positive");
+			break;
+		default:
+			fprintf(stderr, "usage: deblock [-c CHUNK] [-n LINES]"
+				" [-r ROUNDS] [-i INDEXER] [-w WORKERS]"
+				" [FILE]\n");
+			exit(1);
+		}
+	}
+	if (chunk <= 0 || lines <= 0 || rounds <= 0)
+		my_panic(false, "-c, -n, and -r must be positive");
+	if (only != NULL && !sindex_select(only))
+		my_panic(false, "-i names no indexer this CPU has");
+	if (optind < argc)
+		response = read_response(argv[optind], &len);
+	else
+		response = make_response(lines, &len);
+
+	presenter = present_none;
+	/* the workers wake the io engine, so it must be set up. */
+	if (parse_workers > 0)
+		make_curl();
+	writer = writer_init(-1, NULL, false);
+	writer->query = &query;
+	query.writer = writer;
+	fetch.query = &query;
+
+	if (only != NULL)
+		run(only, response, len, chunk, rounds, &fetch);
+	else
+		for (i = 0; sindex_impls[i] != NULL; i++)
+			if (sindex_select(sindex_impls[i]))
+				run(sindex_impls[i], response, len, chunk,
+				    rounds, &fetch);
+	if (parse_workers > 0)
+		unmake_curl();
+	free(fetch.buf);
+	free(response);
+	return 0;
+}
+
+/* run -- feed the response through writer_func() ROUNDS times, and report.
+ */
+static void
+run(const char *indexer, char *response, size_t len, long chunk,
+    long rounds, struct fetch *fetch)
+{
+	writer_t writer = fetch->query->writer;
+	double start, secs;
+	size_t off;
+	long round;
+
+	writer->count = 0;
+	start = now_sec();
+	for (round = 0; round < rounds; round++)
+		for (off = 0; off < len; off += (size_t)chunk) {
+			size_t n = len - off;
+
+			if (n > (size_t)chunk)
+				n = (size_t)chunk;
+			if (writer_func(response + off, 1, n, fetch) != n)
+				my_panic(false, "writer_func refused a chunk");
+		}
+	if (parse_workers > 0)
+		work_drain();
+	secs = now_sec() - start;
+
+	printf("deblock: %s, %ld workers, %d lines, %zu octets,"
+	       " %ld-octet chunks: %.0f lines/sec, %.1f MB/sec\n",
+	       indexer, parse_workers, writer->count,
+	       len * (size_t)rounds, chunk,
+	       writer->count / secs,
+	       (double)(len * (size_t)rounds) / secs / 1e6);
+}
+
+__attribute__((noreturn)) void
+my_exit(int code) {
+	exit(code);
+}
+
+__attribute__((noreturn)) void
+my_panic(bool want_perror, const char *s) {
+	fprintf(stderr, "%s: ", program_name);
+	if (want_perror)
+		perror(s);
+	else
+		fprintf(stderr, "%s\n", s);
+	my_exit(1);
+}
+
+/* present_none -- the cheapest presenter, so as to time only deblocking.
+ */
+static bool
+present_none(pdns_tuple_ct tup __attribute__ ((unused)),
+	     const char *buf __attribute__ ((unused)),
+	     size_t len __attribute__ ((unused)),
+	     writer_t writer __attribute__ ((unused)))
+{
+	return true;
+}
+
+/* make_response -- make up a response of short rrnames results.
+ */
+static char *
+make_response(long lines, size_t *lenp) {
+	char *response = NULL;
+	size_t len = 0;
+	FILE *f;
+	long i;
+
+	f = open_memstream(&response, &len);
+	if (f == NULL)
+		my_panic(true, "open_memstream");
+	fputs("{\"cond\":\"begin\"}\n", f);
+	for (i = 0; i < lines; i++)
+		fprintf(f, "{\"obj\":{\"rrname\":\"h%ld.example.com.\","
+			"\"rrtype\":\"A\"}}\n", i);
+	fputs("{\"cond\":\"succeeded\"}\n", f);
+	fclose(f);
+	*lenp = len;
+	return response;
+}
+
+/* read_response -- read a recorded response into memory.
+ */
+static char *
+read_response(const char *name, size_t *lenp) {
+	char *response = NULL;
+	struct stat sb;
+	FILE *f;
+
+	if ((f = fopen(name, "r")) == NULL || fstat(fileno(f), &sb) < 0)
+		my_panic(true, name);
+	CREATE(response, (size_t)sb.st_size + 1);
+	if (fread(response, 1, (size_t)sb.st_size, f) != (size_t)sb.st_size)
+		my_panic(true, name);
+	fclose(f);
+	*lenp = (size_t)sb.st_size;
+	return response;
+}
+
+/* now_sec -- seconds on a clock that does not jump.
+ */
+static double
+now_sec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,468 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* e2e -- measure dnsdbflex end to end against mockflex.
+ *
+ * usage: e2e [-n RESULTS] [-c CHUNK] [-l LATENCY] [-k KEEPALIVE]
+ *	      [-m JOBS] [-r ROUNDS] [-o FILE] [-- DNSDBFLEX-OPTIONS]
+ *
+ * starts bench/mockflex with the given RESULTS, CHUNK, LATENCY, and
+ * KEEPALIVE (see there), then runs ./dnsdbflex against it ROUNDS times
+ * in each of the -j, -F, and -T output modes, reading its output as fast
+ * as it comes.  for each mode the fastest round is reported: records and
+ * MB per second, peak RSS, and time to the first result.  each report is
+ * also appended to FILE, if given, as one JSON object per line.
+ *
+ * with -m, it instead runs a batch of JOBS queries at once in -j mode,
+ * first over HTTP/1.1 and then with --http2, and also reports how many
+ * connections each opened and the time spent setting them up.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct run {
+	long	records;
+	long	octets;
+	double	seconds;
+	double	first;		/* seconds until the first output */
+	long	rss_kb;
+	int	status;
+	long	connections;	/* -m only */
+	double	setup;		/* -m only: seconds connecting, summed */
+};
+
+static pid_t start_mock(const char **, int *);
+static void run_tool(const char **, const char *, const char *,
+		     struct run *);
+static void run_batch(bool, int, char **, const char *, struct run *);
+static void batch_stats(struct run *);
+static void report(FILE *, const char *, const struct run *);
+static bool numeric(const char *);
+static double now_sec(void);
+static __attribute__((noreturn)) void usage(void);
+
+static const char *results = "100000", *chunk = "16384", *latency = "0",
+	*keepalive = "0";
+static long jobs = 0;
+static char batch_name[] = "/tmp/e2e-batch.XXXXXX",
+	stats_name[] = "/tmp/e2e-stats.XXXXXX",
+	err_name[] = "/tmp/e2e-err.XXXXXX";
+
+int
+main(int argc, char *argv[]) {
+	static const char *modes[] = { "-j", "-F", "-T", NULL };
+	const char *out_name = NULL, **mode;
+	const char *mock_argv[] = {
+		"bench/mockflex", "-p", "0", "-n", NULL, "-c", NULL,
+		"-l", NULL, "-k", NULL, NULL
+	};
+	char server[64];
+	long rounds = 3, round;
+	FILE *out = NULL;
+	pid_t mock;
+	int ch, port;
+
+	while ((ch = getopt(argc, argv, "n:c:l:k:m:r:o:")) != -1) {
+		switch (ch) {
+		case 'n':
+			results = optarg;
+			break;
+		case 'c':
+			chunk = optarg;
+			break;
+		case 'l':
+			latency = optarg;
+			break;
+		case 'k':
+			keepalive = optarg;
+			break;
+		case 'm':
+			jobs = atol(optarg);
+			break;
+		case 'r':
+			rounds = atol(optarg);
+			break;
+		case 'o':
+			out_name = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (rounds <= 0 || jobs < 0 || !numeric(results) || !numeric(chunk) ||
+	    !numeric(latency) || !numeric(keepalive))
+		usage();
+	argc -= optind;
+	argv += optind;
+	if (out_name != NULL && (out = fopen(out_name, "a")) == NULL) {
+		perror(out_name);
+		exit(1);
+	}
+
+	mock_argv[4] = results;
+	mock_argv[6] = chunk;
+	mock_argv[8] = latency;
+	mock_argv[10] = keepalive;
+	mock = start_mock(mock_argv, &port);
+	snprintf(server, sizeof server, "http://127.0.0.1:%d", port);
+
+	if (jobs > 0) {
+		static const char *versions[] = { "http/1.1", "http/2" };
+		long i;
+		FILE *f;
+		int fd;
+
+		if ((fd = mkstemp(batch_name)) < 0 ||
+		    (f = fdopen(fd, "w")) == NULL)
+		{
+			perror(batch_name);
+			exit(1);
+		}
+		for (i = 0; i < jobs; i++)
+			fprintf(f, "--glob *.q%ld.example.com.\n", i);
+		fclose(f);
+		if ((fd = mkstemp(stats_name)) < 0 || close(fd) < 0 ||
+		    (fd = mkstemp(err_name)) < 0 || close(fd) < 0)
+		{
+			perror("mkstemp");
+			exit(1);
+		}
+		for (i = 0; i < 2; i++) {
+			struct run best = {}, run;
+
+			for (round = 0; round < rounds; round++) {
+				run_batch(i == 1, argc, argv, server, &run);
+				if (round == 0 || run.seconds < best.seconds)
+					best = run;
+			}
+			report(stdout, versions[i], &best);
+			if (out != NULL)
+				report(out, versions[i], &best);
+		}
+		unlink(batch_name);
+		unlink(stats_name);
+		unlink(err_name);
+	}
+	for (mode = modes; jobs == 0 && *mode != NULL; mode++) {
+		struct run best = {}, run;
+
+		for (round = 0; round < rounds; round++) {
+			const char **tool_argv;
+			int i;
+
+			/* ./dnsdbflex --glob *.example.com. MODE [OPTIONS] */
+			if ((tool_argv = calloc((size_t)argc + 5,
+						sizeof(char *))) == NULL)
+			{
+				perror("calloc");
+				exit(1);
+			}
+			tool_argv[0] = "./dnsdbflex";
+			tool_argv[1] = "--glob";
+			tool_argv[2] = "*.example.com.";
+			tool_argv[3] = *mode;
+			for (i = 0; i < argc; i++)
+				tool_argv[4 + i] = argv[i];
+			run_tool(tool_argv, server, "/dev/null", &run);
+			free((void *)(uintptr_t)tool_argv);
+			if (round == 0 || run.seconds < best.seconds)
+				best = run;
+		}
+		report(stdout, *mode, &best);
+		if (out != NULL)
+			report(out, *mode, &best);
+	}
+
+	kill(mock, SIGTERM);
+	waitpid(mock, NULL, 0);
+	if (out != NULL)
+		fclose(out);
+	return 0;
+}
+
+/* start_mock -- start mockflex and learn which port it is listening on.
+ */
+static pid_t
+start_mock(const char **mock_argv, int *portp) {
+	int fds[2];
+	char line[32];
+	ssize_t n;
+	pid_t pid;
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		/* execv() does not change its argv, whatever its type. */
+		execv(mock_argv[0], (char **)(uintptr_t)mock_argv);
+		perror(mock_argv[0]);
+		_exit(1);
+	}
+	close(fds[1]);
+	n = read(fds[0], line, sizeof line - 1);
+	close(fds[0]);
+	if (n <= 0) {
+		fprintf(stderr, "e2e: mockflex did not start\n");
+		exit(1);
+	}
+	line[n] = '\0';
+	*portp = atoi(line);
+	return pid;
+}
+
+/* run_tool -- run dnsdbflex once, with its stderr to err, and measure it.
+ */
+static void
+run_tool(const char **tool_argv, const char *server, const char *err,
+	 struct run *run)
+{
+	char buf[65536];
+	struct rusage ru;
+	double start;
+	bool bol = true;
+	ssize_t n, i;
+	int fds[2];
+	pid_t pid;
+
+	memset(run, 0, sizeof *run);
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+	start = now_sec();
+	if ((pid = fork()) < 0) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		int errfd = open(err, O_WRONLY | O_TRUNC);
+
+		dup2(fds[1], STDOUT_FILENO);
+		if (errfd >= 0)
+			dup2(errfd, STDERR_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+		setenv("DNSDB_SERVER", server, 1);
+		setenv("DNSDB_API_KEY", "bench", 1);
+		execv(tool_argv[0], (char **)(uintptr_t)tool_argv);
+		_exit(127);
+	}
+	close(fds[1]);
+	while ((n = read(fds[0], buf, sizeof buf)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			exit(1);
+		}
+		if (run->octets == 0)
+			run->first = now_sec() - start;
+		run->octets += n;
+		/* -T adds "# ..." lines, which are not results. */
+		for (i = 0; i < n; i++) {
+			if (bol && buf[i] != '#')
+				run->records++;
+			bol = buf[i] == '\n';
+		}
+	}
+	close(fds[0]);
+	if (wait4(pid, &run->status, 0, &ru) < 0) {
+		perror("wait4");
+		exit(1);
+	}
+	run->seconds = now_sec() - start;
+	run->rss_kb = ru.ru_maxrss;
+}
+
+/* run_batch -- run the batch once, over HTTP/2 or not, and measure it.
+ */
+static void
+run_batch(bool http2, int argc, char **argv, const char *server,
+	  struct run *run)
+{
+	const char **tool_argv;
+	char jobs_arg[32];
+	int i, j = 0;
+
+	/* ./dnsdbflex -j -d --batch FILE --jobs JOBS --stats FILE
+	 *	[--http2] [OPTIONS]
+	 */
+	if ((tool_argv = calloc((size_t)argc + 11, sizeof(char *))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	snprintf(jobs_arg, sizeof jobs_arg, "%ld", jobs);
+	tool_argv[j++] = "./dnsdbflex";
+	tool_argv[j++] = "-j";
+	tool_argv[j++] = "-d";
+	tool_argv[j++] = "--batch";
+	tool_argv[j++] = batch_name;
+	tool_argv[j++] = "--jobs";
+	tool_argv[j++] = jobs_arg;
+	tool_argv[j++] = "--stats";
+	tool_argv[j++] = stats_name;
+	if (http2)
+		tool_argv[j++] = "--http2";
+	for (i = 0; i < argc; i++)
+		tool_argv[j++] = argv[i];
+	run_tool(tool_argv, server, err_name, run);
+	free((void *)(uintptr_t)tool_argv);
+	batch_stats(run);
+}
+
+/* batch_stats -- learn from a batch run's -d output how many connections
+ * it opened, and from its --stats how long each fetch spent connecting.
+ * a fetch's setup ends at its TLS handshake, if any, else its connect.
+ */
+static void
+batch_stats(struct run *run) {
+	char *line = NULL;
+	size_t n = 0;
+	FILE *f;
+
+	if ((f = fopen(err_name, "r")) != NULL) {
+		while (getline(&line, &n, f) > 0) {
+			const char *p = strstr(line, "connections: ");
+
+			if (p != NULL)
+				run->connections = atol(p + 13);
+		}
+		fclose(f);
+	}
+	if ((f = fopen(stats_name, "r")) != NULL) {
+		while (getline(&line, &n, f) > 0) {
+			const char *p = strstr(line, "\"attempts\":");
+
+			while (p != NULL &&
+			       (p = strstr(p, "\"connect\":")) != NULL)
+			{
+				double connect = atof(p + 10), tls = 0.0;
+
+				if ((p = strstr(p, "\"tls\":")) != NULL)
+					tls = atof(p + 6);
+				run->setup += tls > connect ? tls : connect;
+			}
+		}
+		fclose(f);
+	}
+	free(line);
+}
+
+/* report -- say how one mode did, as text on stdout or else as JSON.
+ */
+static void
+report(FILE *f, const char *mode, const struct run *run) {
+	int status = WIFEXITED(run->status) ? WEXITSTATUS(run->status) : -1;
+
+	if (f == stdout && jobs > 0) {
+		fprintf(f, "e2e %s x%ld: %ld records, %ld octets in %.3f sec:"
+			" %.0f records/sec, %.1f MB/sec, %ld connections,"
+			" setup %.1f ms, first result %.1f ms%s\n",
+			mode, jobs, run->records, run->octets, run->seconds,
+			(double)run->records / run->seconds,
+			(double)run->octets / run->seconds / 1e6,
+			run->connections, run->setup * 1e3, run->first * 1e3,
+			status != 0 ? " (FAILED)" : "");
+		return;
+	}
+	if (f == stdout) {
+		fprintf(f, "e2e %s: %ld records, %ld octets in %.3f sec:"
+			" %.0f records/sec, %.1f MB/sec, peak RSS %ld KB,"
+			" first result %.1f ms%s\n",
+			mode, run->records, run->octets, run->seconds,
+			(double)run->records / run->seconds,
+			(double)run->octets / run->seconds / 1e6,
+			run->rss_kb, run->first * 1e3,
+			status != 0 ? " (FAILED)" : "");
+		return;
+	}
+	if (jobs > 0) {
+		fprintf(f, "{\"when\":%ld,\"mode\":\"%s\",\"jobs\":%ld,"
+			"\"results\":%s,\"chunk\":%s,\"latency_ms\":%s,"
+			"\"keepalive\":%s,\"records\":%ld,\"octets\":%ld,"
+			"\"seconds\":%.6f,\"records_per_sec\":%.0f,"
+			"\"mb_per_sec\":%.3f,\"connections\":%ld,"
+			"\"setup_ms\":%.3f,\"first_result_ms\":%.3f,"
+			"\"status\":%d}\n",
+			(long)time(NULL), mode, jobs, results, chunk, latency,
+			keepalive, run->records, run->octets, run->seconds,
+			(double)run->records / run->seconds,
+			(double)run->octets / run->seconds / 1e6,
+			run->connections, run->setup * 1e3, run->first * 1e3,
+			status);
+		return;
+	}
+	fprintf(f, "{\"when\":%ld,\"mode\":\"%s\",\"results\":%s,"
+		"\"chunk\":%s,\"latency_ms\":%s,\"keepalive\":%s,"
+		"\"records\":%ld,\"octets\":%ld,\"seconds\":%.6f,"
+		"\"records_per_sec\":%.0f,\"mb_per_sec\":%.3f,"
+		"\"peak_rss_kb\":%ld,\"first_result_ms\":%.3f,"
+		"\"status\":%d}\n",
+		(long)time(NULL), mode, results, chunk, latency, keepalive,
+		run->records, run->octets, run->seconds,
+		(double)run->records / run->seconds,
+		(double)run->octets / run->seconds / 1e6,
+		run->rss_kb, run->first * 1e3, status);
+}
+
+/* numeric -- is this a non-negative decimal number?
+ */
+static bool
+numeric(const char *s) {
+	return *s != '\0' && strspn(s, "0123456789") == strlen(s);
+}
+
+/* now_sec -- seconds on a clock that does not jump.
+ */
+static double
+now_sec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "usage: e2e [-n RESULTS] [-c CHUNK] [-l LATENCY]"
+		" [-k KEEPALIVE]\n\t[-m JOBS] [-r ROUNDS] [-o FILE]"
+		" [-- DNSDBFLEX-OPTIONS]\n");
+	exit(1);
+}
@@ -0,0 +1,1085 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* mockflex -- a local stand-in for the DNSDB Flex API, for benchmarks.
+ *
+ * usage: mockflex [-p PORT] [-n RESULTS] [-c CHUNK] [-l LATENCY]
+ *		   [-g GAP] [-k KEEPALIVE] [-e COND:AT] [-r FILE]
+ *
+ * serves GET /dnsdb/v2/{glob,regex}/{rrnames,rdata}/... with a SAF NDJSON
+ * stream of RESULTS made up results, honoring the offset and limit query
+ * parameters, or with the recorded body in FILE (see dnsdbflex --record).
+ * the made up results are given times spread evenly over FENCE_SPAN
+ * seconds from FENCE_EPOCH, each lasting FENCE_LIFE, and the time fence
+ * parameters (time_first_after and so on) choose among them before the
+ * offset and limit are applied, so that --bisect has something to split.
+ * the body is sent in chunks of about CHUNK octets, LATENCY milliseconds
+ * after the request and GAP milliseconds apart, with an ongoing keepalive
+ * every KEEPALIVE results.  with -e limited:AT or -e failed:AT, the stream
+ * ends with that condition after AT results.  one process is forked per
+ * connection.  PORT 0 picks one; the port is printed on stdout either way.
+ *
+ * a connection which opens with the HTTP/2 preface is spoken to in HTTP/2
+ * without TLS (as curl's --http2-prior-knowledge), up to H2_STREAMS
+ * streams at once, each served by its own thread.  this is just enough
+ * HTTP/2 for libcurl: flow control is honored, but header compression
+ * only decodes what clients send (printable ASCII), and never indexes
+ * what it sends.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct reply;
+struct h2stream;
+
+static void serve(int);
+static bool respond(struct reply *, const char *);
+static bool send_head(struct reply *, int, bool);
+static bool send_body(struct reply *, const char *, size_t);
+static void h2_serve(FILE *, int);
+static bool h2_request(uint32_t, const uint8_t *, size_t);
+static void *h2_stream_main(void *);
+static bool h2_data(struct h2stream *, const char *, size_t);
+static bool h2_frame(int, int, uint32_t, const void *, size_t);
+static bool hpack_block(const uint8_t *, size_t, char **, char **);
+static bool hpack_int(const uint8_t **, const uint8_t *, int, size_t *);
+static char *hpack_str(const uint8_t **, const uint8_t *);
+static bool hpack_index(size_t, const char **, const char **);
+static void hpack_add(const char *, const char *);
+static void hpack_evict(void);
+static char *huffman(const uint8_t *, size_t);
+static long param(const char *, const char *, long);
+static long fence_index(long, long);
+static void pause_ms(long);
+static __attribute__((noreturn)) void usage(void);
+
+static long results = 100000, chunk = 16384, latency = 0, gap = 0,
+	keepalive = 0, end_at = -1;
+static const char *end_cond = NULL;
+static char *recorded = NULL;
+static size_t recorded_len = 0;
+
+/* the times given to the made up results: 2010 on, for 15 years. */
+#define FENCE_EPOCH	1262304000L
+#define FENCE_SPAN	(15L * 365 * 86400)
+#define FENCE_LIFE	86400L
+
+/* HTTP/2 frame types and flags, and what we offer or assume. */
+#define H2_DATA			0
+#define H2_HEADERS		1
+#define H2_RST_STREAM		3
+#define H2_SETTINGS		4
+#define H2_PING			6
+#define H2_GOAWAY		7
+#define H2_WINDOW_UPDATE	8
+#define H2_CONTINUATION		9
+#define H2_ACK			0x01
+#define H2_END_STREAM		0x01
+#define H2_END_HEADERS		0x04
+#define H2_PADDED		0x08
+#define H2_PRIORITY		0x20
+#define H2_STREAMS		128
+#define H2_WINDOW		65535
+#define H2_FRAME		16384
+#define H2_TABLE		4096
+
+/* one request on the HTTP/2 connection, and what it may yet send. */
+struct h2stream {
+	uint32_t	id;
+	int64_t		window;
+	bool		reset;
+	bool		head;
+	char		*target;
+	struct h2stream	*next;
+};
+
+/* one entry of the HPACK dynamic table. */
+struct hpack_entry {
+	char		*name;
+	char		*value;
+	size_t		size;
+};
+
+/* the HTTP/2 connection this process is serving, if any.  lock covers
+ * the windows and the streams; write_lock keeps frames whole.  the
+ * dynamic table, newest entry first, is only used by the reader.
+ */
+static struct {
+	int		fd;
+	pthread_mutex_t	lock;
+	pthread_mutex_t	write_lock;
+	pthread_cond_t	cond;
+	int64_t		window;
+	int64_t		initial;
+	size_t		max_frame;
+	bool		closed;
+	struct h2stream	*streams;
+	struct hpack_entry *table;
+	size_t		table_len;
+	size_t		table_size;
+	size_t		table_max;
+} h2 = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.write_lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* the HPACK static table (RFC 7541 appendix A). */
+static const char *hpack_static[][2] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" },
+	{ ":path", "/" }, { ":path", "/index.html" }, { ":scheme", "http" },
+	{ ":scheme", "https" }, { ":status", "200" }, { ":status", "204" },
+	{ ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" }, { "accept-language", "" },
+	{ "accept-ranges", "" }, { "accept", "" },
+	{ "access-control-allow-origin", "" }, { "age", "" },
+	{ "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" },
+	{ "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" },
+	{ "content-type", "" }, { "cookie", "" }, { "date", "" },
+	{ "etag", "" }, { "expect", "" }, { "expires", "" }, { "from", "" },
+	{ "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+	{ "if-none-match", "" }, { "if-range", "" },
+	{ "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" },
+	{ "proxy-authenticate", "" }, { "proxy-authorization", "" },
+	{ "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" },
+	{ "strict-transport-security", "" }, { "transfer-encoding", "" },
+	{ "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" },
+};
+
+/* the HPACK Huffman codes (RFC 7541 appendix B) for printable ASCII.
+ * the code is canonical, so those of each length are consecutive, in
+ * the order of their symbols.
+ */
+static const struct {
+	int		bits;
+	uint64_t	first;
+	const char	*syms;
+} huff[] = {
+	{ 5, 0x0, "012aceiost" },
+	{ 6, 0x14, " %-./3456789=A_bdfghlmnpru" },
+	{ 7, 0x5c, ":BCDEFGHIJKLMNOPQRSTUVWYjkqvwxyz" },
+	{ 8, 0xf8, "&*,;XZ" },
+	{ 10, 0x3f8, "!\"()?" },
+	{ 11, 0x7fa, "'+|" },
+	{ 12, 0xffa, "#>" },
+	{ 13, 0x1ff9, "$@[]~" },
+	{ 14, 0x3ffc, "^}" },
+	{ 15, 0x7ffc, "<`{" },
+	{ 19, 0x7fff0, "\\" },
+};
+
+int
+main(int argc, char *argv[]) {
+	struct sockaddr_in sin = {};
+	socklen_t sinlen = sizeof sin;
+	long port = 0;
+	int ch, lfd, on = 1;
+
+	while ((ch = getopt(argc, argv, "p:n:c:l:g:k:e:r:")) != -1) {
+		switch (ch) {
+		case 'p':
+			port = atol(optarg);
+			break;
+		case 'n':
+			results = atol(optarg);
+			break;
+		case 'c':
+			chunk = atol(optarg);
+			break;
+		case 'l':
+			latency = atol(optarg);
+			break;
+		case 'g':
+			gap = atol(optarg);
+			break;
+		case 'k':
+			keepalive = atol(optarg);
+			break;
+		case 'e': {
+			char *colon = strchr(optarg, ':');
+
+			if (colon == NULL)
+				usage();
+			*colon = '\0';
+			if (strcmp(optarg, "limited") != 0 &&
+			    strcmp(optarg, "failed") != 0)
+				usage();
+			end_cond = optarg;
+			end_at = atol(colon + 1);
+			break;
+		    }
+		case 'r': {
+			struct stat sb;
+			FILE *f;
+
+			if ((f = fopen(optarg, "r")) == NULL ||
+			    fstat(fileno(f), &sb) < 0)
+			{
+				perror(optarg);
+				exit(1);
+			}
+			recorded_len = (size_t)sb.st_size;
+			if ((recorded = malloc(recorded_len + 1)) == NULL ||
+			    fread(recorded, 1, recorded_len, f) != recorded_len)
+			{
+				perror(optarg);
+				exit(1);
+			}
+			fclose(f);
+			break;
+		    }
+		default:
+			usage();
+		}
+	}
+	if (port < 0 || port > 65535 || results < 0 || chunk <= 0 ||
+	    latency < 0 || gap < 0 || keepalive < 0)
+		usage();
+
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	if ((lfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin.sin_port = htons((uint16_t)port);
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof sin) < 0 ||
+	    listen(lfd, 256) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &sinlen) < 0)
+	{
+		perror("bind");
+		exit(1);
+	}
+	printf("%d\n", ntohs(sin.sin_port));
+	fflush(stdout);
+
+	for (;;) {
+		int fd = accept(lfd, NULL, NULL);
+
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("accept");
+			exit(1);
+		}
+		switch (fork()) {
+		case -1:
+			perror("fork");
+			close(fd);
+			break;
+		case 0:
+			close(lfd);
+			serve(fd);
+			_exit(0);
+		default:
+			close(fd);
+		}
+	}
+}
+
+/* how one response goes out: in HTTP/1.1 on a connection, or on one
+ * HTTP/2 stream.
+ */
+struct reply {
+	FILE		*out;
+	struct h2stream	*st;
+};
+
+/* serve -- answer requests on one connection until the client is done.
+ */
+static void
+serve(int fd) {
+	FILE *in = fdopen(fd, "r"), *out = fdopen(dup(fd), "w");
+	char *line = NULL, *target = NULL;
+	struct reply reply = { out, NULL };
+	size_t n = 0;
+	int on = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof on);
+	if (in == NULL || out == NULL)
+		return;
+	while (getline(&line, &n, in) > 0) {
+		char method[16];
+		bool head;
+
+		if (strcmp(line, "PRI * HTTP/2.0\r\n") == 0) {
+			h2_serve(in, fd);
+			break;
+		}
+		free(target);
+		target = malloc(strlen(line) + 1);
+		if (target == NULL ||
+		    sscanf(line, "%15s %s", method, target) != 2)
+			break;
+		head = strcmp(method, "HEAD") == 0;
+
+		/* skip the request headers. */
+		while (getline(&line, &n, in) > 0)
+			if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+				break;
+
+		if (head) {
+			if (!send_head(&reply, 200, false))
+				break;
+		} else if (!respond(&reply, target)) {
+			break;
+		}
+		if (fflush(out) != 0)
+			break;
+	}
+	free(target);
+	free(line);
+	fclose(out);
+	fclose(in);
+}
+
+/* respond -- answer one GET.  returns false if the connection is done.
+ */
+static bool
+respond(struct reply *reply, const char *target) {
+	static const char begin[] = "{\"cond\":\"begin\"}\n",
+		ongoing[] = "{\"cond\":\"ongoing\"}\n",
+		not_found[] = "Not Found\n";
+	bool rdata = strstr(target, "/rdata/") != NULL;
+	long offset = param(target, "offset", 0),
+		limit = param(target, "limit", 0),
+		first_after = param(target, "time_first_after", 0),
+		first_before = param(target, "time_first_before", 0),
+		last_after = param(target, "time_last_after", 0),
+		last_before = param(target, "time_last_before", 0),
+		i, first = 0, last = results, sent = 0;
+	const char *cond = "succeeded", *msg = NULL;
+	char *body = NULL;
+	size_t len = 0;
+	FILE *f;
+
+	if (strncmp(target, "/dnsdb/v2/", 10) != 0 ||
+	    (strstr(target, "/glob/") == NULL &&
+	     strstr(target, "/regex/") == NULL) ||
+	    (strstr(target, "/rrnames/") == NULL && !rdata))
+	{
+		return send_head(reply, 404, true) &&
+			send_body(reply, not_found, sizeof not_found - 1) &&
+			send_body(reply, NULL, 0);
+	}
+	if (!send_head(reply, 200, true))
+		return false;
+	pause_ms(latency);
+
+	if (recorded != NULL) {
+		size_t off;
+
+		for (off = 0; off < recorded_len; off += (size_t)chunk) {
+			size_t piece = recorded_len - off;
+
+			if (piece > (size_t)chunk)
+				piece = (size_t)chunk;
+			if (!send_body(reply, recorded + off, piece))
+				return false;
+			if (off + piece < recorded_len)
+				pause_ms(gap);
+		}
+		return send_body(reply, NULL, 0);
+	}
+
+	/* the fence leaves results [first, last), as times only grow. */
+	if (first_after != 0 && fence_index(first_after, 0) > first)
+		first = fence_index(first_after, 0);
+	if (last_after != 0 && fence_index(last_after, FENCE_LIFE) > first)
+		first = fence_index(last_after, FENCE_LIFE);
+	if (first_before != 0 && fence_index(first_before - 1, 0) < last)
+		last = fence_index(first_before - 1, 0);
+	if (last_before != 0 &&
+	    fence_index(last_before - 1, FENCE_LIFE) < last)
+		last = fence_index(last_before - 1, FENCE_LIFE);
+	first += offset;
+
+	/* results [first, last) are sent, unless the stream ends early. */
+	if (limit > 0 && first + limit < last) {
+		last = first + limit;
+		cond = "limited";
+		msg = "Result limit reached";
+	}
+	if (end_cond != NULL && first + end_at < last) {
+		last = first + end_at;
+		cond = end_cond;
+		msg = strcmp(end_cond, "failed") == 0 ?
+			"Server error" : "Result limit reached";
+	}
+
+	if ((f = open_memstream(&body, &len)) == NULL)
+		return false;
+	fputs(begin, f);
+	for (i = first; i < last; i++) {
+		if (keepalive > 0 && sent % keepalive == 0 && sent > 0)
+			fputs(ongoing, f);
+		if (rdata)
+			fprintf(f, "{\"obj\":{\"rdata\":\"10.%ld.%ld.%ld\","
+				"\"rrtype\":\"A\",\"raw_rdata\":\"0A%06lX\"}}\n",
+				(i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff,
+				i & 0xffffff);
+		else
+			fprintf(f, "{\"obj\":{\"rrname\":\"host%ld.example.com.\","
+				"\"rrtype\":\"A\"}}\n", i);
+		sent++;
+		fflush(f);
+		if (len >= (size_t)chunk) {
+			if (!send_body(reply, body, len)) {
+				fclose(f);
+				free(body);
+				return false;
+			}
+			fseeko(f, 0, SEEK_SET);
+			len = 0;
+			pause_ms(gap);
+		}
+	}
+	if (msg != NULL)
+		fprintf(f, "{\"cond\":\"%s\",\"msg\":\"%s\"}\n", cond, msg);
+	else
+		fprintf(f, "{\"cond\":\"%s\"}\n", cond);
+	fflush(f);
+	fclose(f);
+	if (!send_body(reply, body, len)) {
+		free(body);
+		return false;
+	}
+	free(body);
+	return send_body(reply, NULL, 0);
+}
+
+/* send_head -- start a response with this status; a body follows if
+ * more, else there is none.
+ */
+static bool
+send_head(struct reply *reply, int status, bool more) {
+	uint8_t block[64];
+	size_t len = 0;
+
+	if (reply->st == NULL) {
+		fprintf(reply->out, "HTTP/1.1 %d %s\r\n", status,
+			status == 200 ? "OK" : "Not Found");
+		if (more && status == 200)
+			fputs("Content-Type: application/x-ndjson\r\n",
+			      reply->out);
+		fputs(more ? "Transfer-Encoding: chunked\r\n\r\n"
+		      : "Content-Length: 0\r\n\r\n", reply->out);
+		return fflush(reply->out) == 0;
+	}
+
+	/* :status 200 and 404 are in the static table, and content-type's
+	 * name is too, at 31; its value is given literally, not indexed.
+	 */
+	block[len++] = status == 200 ? 0x88 : 0x8d;
+	if (more && status == 200) {
+		static const char ndjson[] = "application/x-ndjson";
+
+		block[len++] = 0x0f;
+		block[len++] = 31 - 15;
+		block[len++] = sizeof ndjson - 1;
+		memcpy(block + len, ndjson, sizeof ndjson - 1);
+		len += sizeof ndjson - 1;
+	}
+	return h2_frame(H2_HEADERS, H2_END_HEADERS | (more ? 0 : H2_END_STREAM),
+			reply->st->id, block, len);
+}
+
+/* send_body -- send some of a response's body; len 0 ends the body.
+ */
+static bool
+send_body(struct reply *reply, const char *ptr, size_t len) {
+	if (reply->st != NULL)
+		return h2_data(reply->st, ptr, len);
+	fprintf(reply->out, "%zx\r\n", len);
+	if (len != 0)
+		fwrite(ptr, 1, len, reply->out);
+	fputs("\r\n", reply->out);
+	return fflush(reply->out) == 0;
+}
+
+/* h2_serve -- speak HTTP/2 on a connection whose first line was the
+ * start of the client's preface.
+ */
+static void
+h2_serve(FILE *in, int fd) {
+	static const uint8_t settings[] = {
+		0, 3, 0, 0, H2_STREAMS >> 8, H2_STREAMS & 0xff
+	};
+	uint8_t head[9], *payload = NULL, *block = NULL;
+	size_t block_len = 0;
+	uint32_t block_id = 0;
+	char rest[8];
+
+	if (fread(rest, 1, sizeof rest, in) != sizeof rest ||
+	    memcmp(rest, "\r\nSM\r\n\r\n", sizeof rest) != 0)
+		return;
+	h2.fd = fd;
+	h2.window = H2_WINDOW;
+	h2.initial = H2_WINDOW;
+	h2.max_frame = H2_FRAME;
+	h2.table_max = H2_TABLE;
+	if ((payload = malloc(H2_FRAME)) == NULL ||
+	    !h2_frame(H2_SETTINGS, 0, 0, settings, sizeof settings))
+		goto done;
+
+	while (fread(head, 1, sizeof head, in) == sizeof head) {
+		size_t len = (size_t)head[0] << 16 | (size_t)head[1] << 8 |
+			head[2];
+		int type = head[3], flags = head[4];
+		uint32_t id = ((uint32_t)head[5] << 24 |
+			       (uint32_t)head[6] << 16 |
+			       (uint32_t)head[7] << 8 | head[8]) & 0x7fffffff;
+		const uint8_t *p = payload;
+		struct h2stream *st;
+		size_t i;
+
+		if (len > H2_FRAME || fread(payload, 1, len, in) != len)
+			break;
+		if (block_id != 0 && type != H2_CONTINUATION)
+			break;
+		switch (type) {
+		case H2_HEADERS:
+			if ((flags & H2_PADDED) != 0) {
+				if (len < 1 || payload[0] >= len)
+					goto done;
+				len -= (size_t)payload[0] + 1;
+				p++;
+			}
+			if ((flags & H2_PRIORITY) != 0) {
+				if (len < 5)
+					goto done;
+				len -= 5;
+				p += 5;
+			}
+			block_id = id;
+			/* FALLTHROUGH */
+		case H2_CONTINUATION:
+			if (id != block_id ||
+			    (block = realloc(block, block_len + len)) == NULL)
+				goto done;
+			memcpy(block + block_len, p, len);
+			block_len += len;
+			if ((flags & H2_END_HEADERS) != 0) {
+				if (!h2_request(block_id, block, block_len))
+					goto done;
+				block_id = 0;
+				block_len = 0;
+			}
+			break;
+		case H2_SETTINGS:
+			if ((flags & H2_ACK) != 0)
+				break;
+			pthread_mutex_lock(&h2.lock);
+			for (i = 0; i + 6 <= len; i += 6) {
+				uint32_t value = (uint32_t)p[i + 2] << 24 |
+					(uint32_t)p[i + 3] << 16 |
+					(uint32_t)p[i + 4] << 8 | p[i + 5];
+
+				if (p[i] != 0)
+					continue;
+				if (p[i + 1] == 4) {
+					/* applies to open streams too. */
+					for (st = h2.streams; st != NULL;
+					     st = st->next)
+						st->window += (int64_t)value -
+							h2.initial;
+					h2.initial = value;
+				} else if (p[i + 1] == 5) {
+					h2.max_frame = value;
+				}
+			}
+			pthread_cond_broadcast(&h2.cond);
+			pthread_mutex_unlock(&h2.lock);
+			if (!h2_frame(H2_SETTINGS, H2_ACK, 0, NULL, 0))
+				goto done;
+			break;
+		case H2_WINDOW_UPDATE:
+			if (len != 4)
+				goto done;
+			pthread_mutex_lock(&h2.lock);
+			i = ((size_t)p[0] << 24 | (size_t)p[1] << 16 |
+			     (size_t)p[2] << 8 | p[3]) & 0x7fffffff;
+			if (id == 0)
+				h2.window += (int64_t)i;
+			for (st = h2.streams; st != NULL; st = st->next)
+				if (st->id == id)
+					st->window += (int64_t)i;
+			pthread_cond_broadcast(&h2.cond);
+			pthread_mutex_unlock(&h2.lock);
+			break;
+		case H2_RST_STREAM:
+			pthread_mutex_lock(&h2.lock);
+			for (st = h2.streams; st != NULL; st = st->next)
+				if (st->id == id)
+					st->reset = true;
+			pthread_cond_broadcast(&h2.cond);
+			pthread_mutex_unlock(&h2.lock);
+			break;
+		case H2_PING:
+			if ((flags & H2_ACK) == 0 &&
+			    !h2_frame(H2_PING, H2_ACK, 0, p, len))
+				goto done;
+			break;
+		case H2_GOAWAY:
+			goto done;
+		default:
+			/* DATA, PRIORITY, and the like need nothing. */
+			break;
+		}
+	}
+ done:
+	/* let the streams see that it is over, and wait for them. */
+	pthread_mutex_lock(&h2.lock);
+	h2.closed = true;
+	pthread_cond_broadcast(&h2.cond);
+	while (h2.streams != NULL)
+		pthread_cond_wait(&h2.cond, &h2.lock);
+	pthread_mutex_unlock(&h2.lock);
+	free(payload);
+	free(block);
+}
+
+/* h2_request -- start answering a request whose headers have all come.
+ */
+static bool
+h2_request(uint32_t id, const uint8_t *block, size_t len) {
+	char *method = NULL, *target = NULL;
+	struct h2stream *st;
+	pthread_attr_t attr;
+	pthread_t tid;
+
+	if (!hpack_block(block, len, &method, &target) ||
+	    method == NULL || target == NULL ||
+	    (st = calloc(1, sizeof *st)) == NULL)
+	{
+		free(method);
+		free(target);
+		return false;
+	}
+	st->id = id;
+	st->target = target;
+	st->head = strcmp(method, "HEAD") == 0;
+	free(method);
+
+	pthread_mutex_lock(&h2.lock);
+	st->window = h2.initial;
+	st->next = h2.streams;
+	h2.streams = st;
+	pthread_mutex_unlock(&h2.lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&tid, &attr, h2_stream_main, st) != 0) {
+		pthread_attr_destroy(&attr);
+		return false;
+	}
+	pthread_attr_destroy(&attr);
+	return true;
+}
+
+/* h2_stream_main -- body of the thread answering one stream.
+ */
+static void *
+h2_stream_main(void *arg) {
+	struct h2stream *st = arg, **pst;
+	struct reply reply = { NULL, st };
+
+	if (st->head)
+		(void) send_head(&reply, 200, false);
+	else
+		(void) respond(&reply, st->target);
+
+	pthread_mutex_lock(&h2.lock);
+	for (pst = &h2.streams; *pst != st; pst = &(*pst)->next)
+		;
+	*pst = st->next;
+	pthread_cond_broadcast(&h2.cond);
+	pthread_mutex_unlock(&h2.lock);
+	free(st->target);
+	free(st);
+	return NULL;
+}
+
+/* h2_data -- send some of a stream's body, as the client's flow control
+ * windows allow; len 0 ends the stream.
+ */
+static bool
+h2_data(struct h2stream *st, const char *ptr, size_t len) {
+	if (len == 0)
+		return h2_frame(H2_DATA, H2_END_STREAM, st->id, NULL, 0);
+	while (len != 0) {
+		size_t n = len;
+
+		pthread_mutex_lock(&h2.lock);
+		while (!h2.closed && !st->reset &&
+		       (h2.window <= 0 || st->window <= 0))
+			pthread_cond_wait(&h2.cond, &h2.lock);
+		if (h2.closed || st->reset) {
+			pthread_mutex_unlock(&h2.lock);
+			return false;
+		}
+		if (n > h2.max_frame)
+			n = h2.max_frame;
+		if ((int64_t)n > h2.window)
+			n = (size_t)h2.window;
+		if ((int64_t)n > st->window)
+			n = (size_t)st->window;
+		h2.window -= (int64_t)n;
+		st->window -= (int64_t)n;
+		pthread_mutex_unlock(&h2.lock);
+
+		if (!h2_frame(H2_DATA, 0, st->id, ptr, n))
+			return false;
+		ptr += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* h2_frame -- send one whole frame, not interleaved with any other.
+ */
+static bool
+h2_frame(int type, int flags, uint32_t id, const void *payload, size_t len) {
+	uint8_t head[9] = {
+		(uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len,
+		(uint8_t)type, (uint8_t)flags,
+		(uint8_t)(id >> 24), (uint8_t)(id >> 16), (uint8_t)(id >> 8),
+		(uint8_t)id
+	};
+	struct iovec iov[2] = {
+		{ head, sizeof head },
+		{ (void *)(uintptr_t)payload, len }
+	}, *v = iov;
+	int left = len != 0 ? 2 : 1;
+	bool ok = true;
+
+	pthread_mutex_lock(&h2.write_lock);
+	while (left > 0) {
+		ssize_t n = writev(h2.fd, v, left);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ok = false;
+			break;
+		}
+		while (left > 0 && (size_t)n >= v->iov_len) {
+			n -= (ssize_t)v->iov_len;
+			v++;
+			left--;
+		}
+		if (left > 0) {
+			v->iov_base = (char *)v->iov_base + n;
+			v->iov_len -= (size_t)n;
+		}
+	}
+	pthread_mutex_unlock(&h2.write_lock);
+	return ok;
+}
+
+/* hpack_block -- decode a request's header block, to find its method and
+ * path.  returns false if it could not be decoded, which spoils the
+ * connection, since its table of headers is then unknown.
+ */
+static bool
+hpack_block(const uint8_t *p, size_t len, char **method, char **path) {
+	const uint8_t *end = p + len;
+
+	while (p < end) {
+		const char *name, *value;
+		char *lit_name = NULL, *lit_value = NULL;
+		size_t index;
+		bool add = false;
+
+		if ((*p & 0x80) != 0) {
+			/* indexed header field. */
+			if (!hpack_int(&p, end, 7, &index) ||
+			    !hpack_index(index, &name, &value))
+				return false;
+		} else if ((*p & 0xe0) == 0x20) {
+			/* dynamic table size update. */
+			if (!hpack_int(&p, end, 5, &index) || index > H2_TABLE)
+				return false;
+			h2.table_max = index;
+			hpack_evict();
+			continue;
+		} else {
+			/* literal, with incremental indexing or without. */
+			add = (*p & 0x40) != 0;
+			if (!hpack_int(&p, end, add ? 6 : 4, &index))
+				return false;
+			if (index == 0) {
+				if ((lit_name = hpack_str(&p, end)) == NULL)
+					return false;
+				name = lit_name;
+			} else if (!hpack_index(index, &name, &value)) {
+				return false;
+			}
+			if ((lit_value = hpack_str(&p, end)) == NULL) {
+				free(lit_name);
+				return false;
+			}
+			value = lit_value;
+		}
+		if (strcmp(name, ":method") == 0 && *method == NULL)
+			*method = strdup(value);
+		else if (strcmp(name, ":path") == 0 && *path == NULL)
+			*path = strdup(value);
+		if (add)
+			hpack_add(name, value);
+		free(lit_name);
+		free(lit_value);
+	}
+	return true;
+}
+
+/* hpack_int -- decode an integer with a prefix of this many bits.
+ */
+static bool
+hpack_int(const uint8_t **pp, const uint8_t *end, int prefix, size_t *vp) {
+	const uint8_t *p = *pp;
+	size_t mask = ((size_t)1 << prefix) - 1, v;
+	int shift = 0;
+
+	if (p == end)
+		return false;
+	v = *p++ & mask;
+	if (v == mask) {
+		do {
+			if (p == end || shift > 28)
+				return false;
+			v += (size_t)(*p & 0x7f) << shift;
+			shift += 7;
+		} while ((*p++ & 0x80) != 0);
+	}
+	*pp = p;
+	*vp = v;
+	return true;
+}
+
+/* hpack_str -- decode a string literal, Huffman coded or not.
+ */
+static char *
+hpack_str(const uint8_t **pp, const uint8_t *end) {
+	bool coded = *pp < end && (**pp & 0x80) != 0;
+	size_t len;
+	char *str;
+
+	if (!hpack_int(pp, end, 7, &len) || len > (size_t)(end - *pp))
+		return NULL;
+	if (coded) {
+		str = huffman(*pp, len);
+	} else if ((str = malloc(len + 1)) != NULL) {
+		memcpy(str, *pp, len);
+		str[len] = '\0';
+	}
+	*pp += len;
+	return str;
+}
+
+/* hpack_index -- look up an entry of the static or dynamic table.
+ */
+static bool
+hpack_index(size_t index, const char **name, const char **value) {
+	if (index == 0)
+		return false;
+	if (index <= sizeof hpack_static / sizeof hpack_static[0]) {
+		*name = hpack_static[index - 1][0];
+		*value = hpack_static[index - 1][1];
+		return true;
+	}
+	index -= sizeof hpack_static / sizeof hpack_static[0] + 1;
+	if (index >= h2.table_len)
+		return false;
+	*name = h2.table[index].name;
+	*value = h2.table[index].value;
+	return true;
+}
+
+/* hpack_add -- put a header at the front of the dynamic table.
+ */
+static void
+hpack_add(const char *name, const char *value) {
+	size_t size = strlen(name) + strlen(value) + 32;
+	struct hpack_entry *table;
+
+	/* too big to fit just empties the table. */
+	if (size > h2.table_max) {
+		size_t max = h2.table_max;
+
+		h2.table_max = 0;
+		hpack_evict();
+		h2.table_max = max;
+		return;
+	}
+	table = realloc(h2.table, (h2.table_len + 1) * sizeof *table);
+	if (table == NULL)
+		exit(1);
+	h2.table = table;
+	memmove(table + 1, table, h2.table_len * sizeof *table);
+	table[0].name = strdup(name);
+	table[0].value = strdup(value);
+	table[0].size = size;
+	h2.table_len++;
+	h2.table_size += size;
+	hpack_evict();
+}
+
+/* hpack_evict -- drop the oldest entries until the table fits.
+ */
+static void
+hpack_evict(void) {
+	while (h2.table_size > h2.table_max) {
+		struct hpack_entry *old = &h2.table[--h2.table_len];
+
+		h2.table_size -= old->size;
+		free(old->name);
+		free(old->value);
+	}
+}
+
+/* huffman -- decode a Huffman coded string.  only the codes for
+ * printable ASCII are known; anything else fails.
+ */
+static char *
+huffman(const uint8_t *p, size_t len) {
+	uint64_t bits = 0;
+	int nbits = 0;
+	char *str, *s;
+
+	/* no code is shorter than 5 bits. */
+	if ((s = str = malloc(len * 8 / 5 + 1)) == NULL)
+		return NULL;
+	while (len-- != 0) {
+		bool found = true;
+
+		bits = bits << 8 | *p++;
+		nbits += 8;
+		while (found) {
+			size_t i;
+
+			found = false;
+			for (i = 0; i < sizeof huff / sizeof huff[0] &&
+				    huff[i].bits <= nbits; i++)
+			{
+				uint64_t code = bits >> (nbits - huff[i].bits);
+
+				if (code >= huff[i].first &&
+				    code - huff[i].first <
+				    strlen(huff[i].syms))
+				{
+					*s++ = huff[i].syms[code -
+							    huff[i].first];
+					nbits -= huff[i].bits;
+					bits &= ((uint64_t)1 << nbits) - 1;
+					found = true;
+					break;
+				}
+			}
+		}
+		if (nbits > 30) {
+			free(str);
+			return NULL;
+		}
+	}
+	/* what is left must be padding, the first bits of EOS: all ones. */
+	if (nbits > 7 || bits != ((uint64_t)1 << nbits) - 1) {
+		free(str);
+		return NULL;
+	}
+	*s = '\0';
+	return str;
+}
+
+/* param -- the value of a numeric query parameter, or dflt.
+ */
+static long
+param(const char *target, const char *name, long dflt) {
+	const char *p = strchr(target, '?');
+	size_t len = strlen(name);
+
+	while (p != NULL) {
+		p++;
+		if (strncmp(p, name, len) == 0 && p[len] == '=')
+			return atol(p + len + 1);
+		p = strchr(p, '&');
+	}
+	return dflt;
+}
+
+/* fence_index -- the first made up result whose time_first, plus life,
+ * is after t; or results, if there is none.
+ */
+static long
+fence_index(long t, long life) {
+	long lo = 0, hi = results, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (FENCE_EPOCH + (long)((long long)mid * FENCE_SPAN /
+					 results) + life > t)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* pause_ms -- do nothing for a while.
+ */
+static void
+pause_ms(long ms) {
+	if (ms > 0)
+		(void) poll(NULL, 0, (int)ms);
+}
+
+static void
+usage(void) {
+	fprintf(stderr, "usage: mockflex [-p PORT] [-n RESULTS] [-c CHUNK]"
+		" [-l LATENCY] [-g GAP]\n\t[-k KEEPALIVE]"
+		" [-e limited:AT|failed:AT] [-r FILE]\n");
+	exit(1);
+}
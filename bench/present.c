@@ -0,0 +1,395 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* present -- measure the cost of parsing and presenting each line.
+ *
+ * usage: present [-a] [-n LINES] [-r ROUNDS] [-o FILE]
+ *
+ * for each of several made up corpora of LINES lines (short rrnames,
+ * long TXT rdata, mixed rrtypes, a keepalive-heavy stream, and TXT rdata
+ * which is not ASCII, so that -j must have jansson present it), times
+ * tuple_make() alone and then data_blob() with each presenter, ROUNDS
+ * times over, writing to /dev/null.  each corpus is indexed once
+ * beforehand, as deblocking would.  reports ns and allocations per line
+ * for each stage, after checking that present_json() writes each obj
+ * just as jansson would, whether or not it copied the server's text.
+ * allocations are those made through jansson, which are all that these
+ * stages make per line.  with -a, they come from an arena taken back
+ * every CHUNK octets of the corpus, as deblocking does once per chunk
+ * received, and how many came from the heap all the same is reported
+ * too.  with -o, each report is also appended to FILE as one JSON object
+ * per line.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAIN_PROGRAM
+#include "../defs.h"
+#include "../netio.h"
+#include "../pdns.h"
+#include "../arena.h"
+#include "../globals.h"
+#undef MAIN_PROGRAM
+
+/* how often -a takes the arena back: once for each chunk as libcurl
+ * usually hands them to writer_func().
+ */
+#define CHUNK 16384
+
+/* a corpus is a buffer of NDJSON lines, with where each one starts. */
+struct corpus {
+	const char	*name;
+	char		*buf;
+	size_t		*starts;	/* one more than lines, for the end */
+	long		lines;
+	struct sindex	ix;
+};
+
+typedef void (*stage_t)(struct corpus *, struct fetch *);
+
+static void make_corpus(struct corpus *, const char *, long);
+static void verify_json(struct corpus *);
+static void stage_tuple_make(struct corpus *, struct fetch *);
+static void stage_data_blob(struct corpus *, struct fetch *);
+static bool present_none(pdns_tuple_ct, const char *, size_t, writer_t);
+static void chunk_at(size_t, size_t *);
+static double now_sec(void);
+
+static bool use_arena = false;
+
+int
+main(int argc, char *argv[]) {
+	static const char *corpora[] = {
+		"rrnames", "txt", "mixed", "keepalive", "utf8", NULL
+	};
+	static const struct {
+		const char	*name;
+		stage_t		stage;
+		present_t	presenter;
+	} stages[] = {
+		{ "tuple_make",	stage_tuple_make, NULL },
+		{ "data_blob",	stage_data_blob, present_none },
+		{ "json",	stage_data_blob, present_json },
+		{ "batch",	stage_data_blob, present_batch },
+		{ "dedup",	stage_data_blob, present_batch_dedup_rrtype },
+		{ NULL,		NULL, NULL }
+	};
+	long lines = 200000, rounds = 3, round;
+	const char **name, *out_name = NULL;
+	FILE *out = NULL;
+	int ch, i;
+
+	program_name = "present";
+	while ((ch = getopt(argc, argv, "an:r:o:")) != -1) {
+		switch (ch) {
+		case 'a':
+			use_arena = true;
+			break;
+		case 'n':
+			lines = atol(optarg);
+			break;
+		case 'r':
+			rounds = atol(optarg);
+			break;
+		case 'o':
+			out_name = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: present [-a] [-n LINES]"
+				" [-r ROUNDS] [-o FILE]\n");
+			exit(1);
+		}
+	}
+	if (lines <= 0 || rounds <= 0)
+		my_panic(false, "-n and -r must be positive");
+	if (out_name != NULL && (out = fopen(out_name, "a")) == NULL)
+		my_panic(true, out_name);
+	arena_init();
+
+	for (name = corpora; *name != NULL; name++) {
+		struct corpus corpus = {};
+
+		make_corpus(&corpus, *name, lines);
+		verify_json(&corpus);
+		for (i = 0; stages[i].name != NULL; i++) {
+			struct query query = {};
+			struct writer writer = {};
+			struct fetch fetch = {};
+			struct arena_stats before, after;
+			double start, ns, allocs, heap;
+			long n;
+
+			writer.out = fopen("/dev/null", "w");
+			if (writer.out == NULL)
+				my_panic(true, "/dev/null");
+			writer.output_limit = -1;
+			writer.query = &query;
+			query.writer = &writer;
+			fetch.query = &query;
+			presenter = stages[i].presenter;
+
+			arena_stats(&before);
+			start = now_sec();
+			for (round = 0; round < rounds; round++)
+				stages[i].stage(&corpus, &fetch);
+			n = corpus.lines * rounds;
+			ns = (now_sec() - start) * 1e9 / (double)n;
+			arena_stats(&after);
+			heap = (double)(after.heap - before.heap) / (double)n;
+			allocs = (double)(after.allocs - before.allocs) /
+				(double)n + heap;
+
+			printf("present %-9s %-10s %8.1f ns/line"
+			       " %6.2f allocs/line",
+			       corpus.name, stages[i].name, ns, allocs);
+			if (use_arena)
+				printf(" %6.2f from heap", heap);
+			putchar('\n');
+			if (out != NULL)
+				fprintf(out, "{\"when\":%ld,\"corpus\":\"%s\","
+					"\"stage\":\"%s\",\"lines\":%ld,"
+					"\"arena\":%s,"
+					"\"ns_per_line\":%.1f,"
+					"\"allocs_per_line\":%.3f,"
+					"\"heap_allocs_per_line\":%.3f}\n",
+					(long)time(NULL), corpus.name,
+					stages[i].name, n,
+					use_arena ? "true" : "false", ns,
+					allocs, heap);
+			fclose(writer.out);
+			DESTROY(writer.last_printed);
+			DESTROY(fetch.saf_msg);
+		}
+		sindex_free(&corpus.ix);
+		DESTROY(corpus.buf);
+		DESTROY(corpus.starts);
+	}
+	if (out != NULL)
+		fclose(out);
+	return 0;
+}
+
+__attribute__((noreturn)) void
+my_exit(int code) {
+	exit(code);
+}
+
+__attribute__((noreturn)) void
+my_panic(bool want_perror, const char *s) {
+	fprintf(stderr, "%s: ", program_name);
+	if (want_perror)
+		perror(s);
+	else
+		fprintf(stderr, "%s\n", s);
+	my_exit(1);
+}
+
+/* make_corpus -- make up lines of one kind.
+ */
+static void
+make_corpus(struct corpus *corpus, const char *name, long lines) {
+	static const char *types[] = { "A", "AAAA", "NS", "MX", "CNAME",
+				       "TXT", "PTR", "SOA" };
+	size_t len = 0;
+	FILE *f;
+	long i;
+
+	corpus->name = name;
+	corpus->lines = lines;
+	CREATE(corpus->starts, (size_t)(lines + 1) * sizeof(size_t));
+	if ((f = open_memstream(&corpus->buf, &len)) == NULL)
+		my_panic(true, "open_memstream");
+	for (i = 0; i < lines; i++) {
+		fflush(f);
+		corpus->starts[i] = len;
+		if (strcmp(name, "rrnames") == 0) {
+			fprintf(f, "{\"obj\":{\"rrname\":\"h%ld.example.com.\","
+				"\"rrtype\":\"A\"}}\n", i);
+		} else if (strcmp(name, "txt") == 0) {
+			fprintf(f, "{\"obj\":{\"rdata\":\"\\\"v=spf1 ip4:10.%ld."
+				"0.0/16 include:_spf.example.com include:"
+				"_spf.example.net include:_spf.example.org"
+				" ~all\\\" \\\"google-site-verification="
+				"%0128ld\\\"\",\"rrtype\":\"TXT\","
+				"\"raw_rdata\":\"%0256ld\"}}\n",
+				i % 256, i, i);
+		} else if (strcmp(name, "mixed") == 0) {
+			const char *type = types[i % 8];
+
+			if (i % 3 == 0)
+				fprintf(f, "{\"obj\":{\"rrname\":\"www%ld."
+					"example.com.\",\"rrtype\":\"%s\"}}\n",
+					i / 3, type);
+			else
+				fprintf(f, "{\"obj\":{\"rdata\":\"ns%ld.example."
+					"net.\",\"rrtype\":\"%s\",\"raw_rdata\":"
+					"\"036E73%08lX076578616D706C65036E657400\""
+					"}}\n", i, type, i);
+		} else if (strcmp(name, "utf8") == 0) {
+			fprintf(f, "{\"obj\":{\"rdata\":\"\\\"caf\xc3\xa9 %ld"
+				" \xe2\x82\xac\\\"\",\"rrtype\":\"TXT\"}}\n", i);
+		} else {
+			/* every other line a keepalive. */
+			if (i % 2 == 0)
+				fputs("{\"cond\":\"ongoing\"}\n", f);
+			else
+				fprintf(f, "{\"obj\":{\"rrname\":\"h%ld.example."
+					"com.\",\"rrtype\":\"A\"}}\n", i);
+		}
+	}
+	fclose(f);
+	corpus->starts[lines] = len;
+	sindex_build(&corpus->ix, corpus->buf, len);
+}
+
+/* verify_json -- check present_json()'s output for each line of a
+ * corpus, whether the line was scanned or left to jansson, against
+ * jansson's own rendering of the line's obj, octet for octet.
+ */
+static void
+verify_json(struct corpus *corpus) {
+	struct writer writer = {};
+	struct pdns_tuple tup;
+	long i, objs = 0, plain = 0;
+
+	presenter = present_json;
+	for (i = 0; i < corpus->lines; i++) {
+		size_t start = corpus->starts[i],
+			end = corpus->starts[i + 1] - 1, len = 0;
+		char *fast = NULL, *slow;
+		json_t *main_obj, *obj;
+		bool has_obj;
+
+		if (tuple_make(&tup, corpus->buf + start, end - start,
+			       &corpus->ix) != NULL)
+			my_panic(false, "tuple_make failed");
+		has_obj = tup.obj_json != NULL || tup.obj.saf_obj != NULL;
+		main_obj = json_loadb(corpus->buf + start, end - start, 0,
+				      NULL);
+		if (main_obj == NULL)
+			my_panic(false, "json_loadb failed");
+		obj = json_object_get(main_obj, "obj");
+		if ((obj != NULL) != has_obj)
+			my_panic(false, "tuple_make differs from jansson");
+		if (obj != NULL) {
+			objs++;
+			plain += tup.obj_plain;
+			writer.out = open_memstream(&fast, &len);
+			if (writer.out == NULL)
+				my_panic(true, "open_memstream");
+			if (!present_json(&tup, NULL, 0, &writer))
+				my_panic(false, "present_json failed");
+			fclose(writer.out);
+			slow = json_dumps(obj, JSON_INDENT(0) | JSON_COMPACT);
+			if (slow == NULL || strlen(slow) + 1 != len ||
+			    memcmp(slow, fast, len - 1) != 0 ||
+			    fast[len - 1] != '\n')
+				my_panic(false, "present_json differs from jansson");
+			arena_free(slow);
+			free(fast);
+		}
+		json_decref(main_obj);
+		tuple_unmake(&tup);
+	}
+	if (objs == 0)
+		my_panic(false, "no objs to verify");
+	printf("present %-9s %-10s %ld objs as jansson writes them,"
+	       " %ld copied verbatim\n",
+	       corpus->name, "verify", objs, plain);
+}
+
+/* stage_tuple_make -- parse each line, and free it.
+ */
+static void
+stage_tuple_make(struct corpus *corpus, struct fetch *fetch
+		 __attribute__ ((unused)))
+{
+	struct pdns_tuple tup;
+	size_t next = 0;
+	long i;
+
+	for (i = 0; i < corpus->lines; i++) {
+		size_t start = corpus->starts[i];
+
+		chunk_at(start, &next);
+		/* less the newline, as deblocking would. */
+		if (tuple_make(&tup, corpus->buf + start,
+			       corpus->starts[i + 1] - start - 1,
+			       &corpus->ix) != NULL)
+			my_panic(false, "tuple_make failed");
+		tuple_unmake(&tup);
+	}
+	chunk_at(SIZE_MAX, &next);
+}
+
+/* stage_data_blob -- parse and present each line.
+ */
+static void
+stage_data_blob(struct corpus *corpus, struct fetch *fetch) {
+	size_t next = 0;
+	long i;
+
+	for (i = 0; i < corpus->lines; i++) {
+		size_t start = corpus->starts[i];
+
+		chunk_at(start, &next);
+		(void) data_blob(fetch, corpus->buf + start,
+				 corpus->starts[i + 1] - start - 1, &corpus->ix);
+	}
+	chunk_at(SIZE_MAX, &next);
+}
+
+/* chunk_at -- with -a, begin a new chunk in the arena if a line starting
+ * at start is in the next one.  SIZE_MAX ends the last chunk.
+ */
+static void
+chunk_at(size_t start, size_t *next) {
+	if (!use_arena || start < *next)
+		return;
+	if (*next != 0)
+		arena_end();
+	if (start == SIZE_MAX)
+		return;
+	arena_begin();
+	*next = start + CHUNK;
+}
+
+/* present_none -- the cheapest presenter, so as to time only data_blob().
+ */
+static bool
+present_none(pdns_tuple_ct tup __attribute__ ((unused)),
+	     const char *buf __attribute__ ((unused)),
+	     size_t len __attribute__ ((unused)),
+	     writer_t writer __attribute__ ((unused)))
+{
+	return true;
+}
+
+/* now_sec -- seconds on a clock that does not jump.
+ */
+static double
+now_sec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "netio.h"
+#include "pdns.h"
+#include "cache.h"
+#include "record.h"
+#include "globals.h"
+
+/* a cache directory holds, for each fetch whose stream succeeded, a file
+ * named for a hash of the fetch's url, holding the url on its first line
+ * and then the response body exactly as libcurl delivered it.  entries
+ * are written under a temporary name and then renamed into place, so
+ * that other processes sharing the directory see each one whole or not
+ * at all.  an entry older than cache_ttl seconds is not used.
+ */
+
+struct cache {
+	char		*path;		/* the entry's name */
+	/* a hit: where libcurl can read the entry, and where its body is. */
+	char		*file_url;
+	curl_off_t	skip;
+	/* a miss: where the response is being written until it is kept. */
+	char		*tmp_path;
+	FILE		*tmp;
+};
+
+static char *entry_path(const char *);
+static bool entry_valid(const char *, const char *, curl_off_t *,
+			curl_off_t *);
+
+static char *cache_path = NULL;
+static u_long cache_hits = 0, cache_misses = 0, cache_stores = 0;
+static curl_off_t cache_saved = 0;
+
+/*---------------------------------------------------------------- public
+ */
+
+/* cache_init -- get ready to keep responses in this directory, which is
+ * made if need be.  returns NULL or an error message.
+ */
+const char *
+cache_init(const char *dir) {
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		return strerror(errno);
+	if ((cache_path = realpath(dir, NULL)) == NULL)
+		return strerror(errno);
+	return NULL;
+}
+
+/* cache_fini -- say how the cache did, and forget it.
+ */
+void
+cache_fini(void) {
+	if (cache_path == NULL)
+		return;
+	if (!quiet && cache_hits + cache_misses != 0)
+		my_logf("cache: %lu hits, %lu misses, %lu stored,"
+			" %" CURL_FORMAT_CURL_OFF_T " octets saved",
+			cache_hits, cache_misses, cache_stores, cache_saved);
+	DESTROY(cache_path);
+}
+
+/* cache_start -- look for a fresh entry for this url.  if there is none,
+ * get ready to write one from the response.
+ */
+cache_t
+cache_start(const char *url) {
+	cache_t cache = NULL;
+	curl_off_t body;
+	int fd;
+
+	CREATE(cache, sizeof(struct cache));
+	cache->path = entry_path(url);
+	if (entry_valid(cache->path, url, &cache->skip, &body)) {
+		cache->file_url = file_url(cache->path);
+		cache_hits++;
+		cache_saved += body;
+		DEBUG(1, true, "cache hit %s\n", cache->path);
+		return cache;
+	}
+	cache_misses++;
+
+	if (asprintf(&cache->tmp_path, "%s/.tmp.XXXXXX", cache_path) < 0)
+		my_panic(true, "asprintf");
+	if ((fd = mkstemp(cache->tmp_path)) < 0 ||
+	    (cache->tmp = fdopen(fd, "w")) == NULL)
+	{
+		my_logf("warning: cannot cache to %s: %s",
+			cache->tmp_path, strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+			unlink(cache->tmp_path);
+		}
+		DESTROY(cache->tmp_path);
+		return cache;
+	}
+	fprintf(cache->tmp, "%s\n", url);
+	return cache;
+}
+
+/* cache_hit -- is a fetch to be answered from the cache?
+ */
+bool
+cache_hit(cache_t cache) {
+	return cache->file_url != NULL;
+}
+
+/* cache_url -- the file:// url of a hit's entry.
+ */
+const char *
+cache_url(cache_t cache) {
+	return cache->file_url;
+}
+
+/* cache_skip -- where in a hit's entry the response body starts.
+ */
+curl_off_t
+cache_skip(cache_t cache) {
+	return cache->skip;
+}
+
+/* cache_write -- add to a miss's entry some of the response body.
+ */
+void
+cache_write(cache_t cache, const char *ptr, size_t len) {
+	if (cache->tmp != NULL)
+		fwrite(ptr, 1, len, cache->tmp);
+}
+
+/* cache_end -- a fetch attempt is over.  a miss's entry is put in place
+ * if keep, which the caller decides by whether its stream succeeded.
+ */
+void
+cache_end(cache_t cache, bool keep) {
+	if (cache->tmp != NULL) {
+		if (fclose(cache->tmp) != 0)
+			keep = false;
+		if (keep && rename(cache->tmp_path, cache->path) == 0) {
+			cache_stores++;
+			DEBUG(1, true, "cache store %s\n", cache->path);
+		} else {
+			unlink(cache->tmp_path);
+		}
+	}
+	DESTROY(cache->path);
+	DESTROY(cache->file_url);
+	DESTROY(cache->tmp_path);
+	DESTROY(cache);
+}
+
+/*---------------------------------------------------------------- private
+ */
+
+/* entry_path -- name a url's entry, for a 64-bit FNV-1a hash of the url.
+ * a collision is caught by entry_valid() comparing the url itself.
+ */
+static char *
+entry_path(const char *url) {
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	const char *p;
+	char *path;
+
+	for (p = url; *p != '\0'; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 0x100000001b3ULL;
+	}
+	if (asprintf(&path, "%s/%016llx", cache_path,
+		     (unsigned long long)hash) < 0)
+		my_panic(true, "asprintf");
+	return path;
+}
+
+/* entry_valid -- is there an entry for this url, younger than the ttl?
+ * if so, give where its body starts and how long that is.
+ */
+static bool
+entry_valid(const char *path, const char *url, curl_off_t *skip,
+	    curl_off_t *body)
+{
+	char *line = NULL;
+	struct stat sb;
+	size_t n = 0;
+	ssize_t len;
+	bool ok;
+	FILE *f;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return false;
+	if (fstat(fileno(f), &sb) < 0 ||
+	    time(NULL) - sb.st_mtime >= cache_ttl)
+	{
+		fclose(f);
+		return false;
+	}
+	len = getline(&line, &n, f);
+	fclose(f);
+	ok = len > 0 && line[len - 1] == '\n' &&
+		strncmp(line, url, (size_t)len - 1) == 0 &&
+		url[len - 1] == '\0';
+	DESTROY(line);
+	if (!ok)
+		return false;
+	*skip = (curl_off_t)len;
+	*body = (curl_off_t)sb.st_size - *skip;
+	return true;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <curl/curl.h>
+
+/* one fetch attempt's cache entry, being read or written. */
+typedef struct cache *cache_t;
+
+const char *cache_init(const char *);
+void cache_fini(void);
+cache_t cache_start(const char *);
+bool cache_hit(cache_t);
+const char *cache_url(cache_t);
+curl_off_t cache_skip(cache_t);
+void cache_write(cache_t, const char *, size_t);
+void cache_end(cache_t, bool);
+
+#endif /*CACHE_H_INCLUDED*/
@@ -53,6 +53,9 @@
 #if WANT_PDNS_DNSDB2
 #include "pdns_dnsdb.h"
 #endif
+#include "arena.h"
+#include "cache.h"
+#include "record.h"
 #include "time.h"
 #include "globals.h"
 #undef MAIN_PROGRAM
@@ -63,16 +66,31 @@ static void help(void);
 static pdns_system_ct pick_system(const char *);
 static void qdesc_debug(const char *, qdesc_ct);
 static __attribute__((noreturn)) void usage(const char *, ...);
+static bool parse_double(const char *, double *);
 static bool parse_long(const char *, long *);
 static void set_timeout(const char *, const char *);
 static void read_configs(void);
+static const char *query_option(qdesc_t, int, const char *);
+static const char *qdesc_ready(qdesc_t, bool);
+static void qdesc_free(qdesc_t);
+static void batch_loop(const char *);
+static const char *batch_parse(char *, qdesc_t);
+static int batch_split(char *, char **, int);
+static void serve_request(client_t, char *);
+static const char *serve_member(qdesc_t, const char *, json_t *);
 static char *makepath(qdesc_ct);
 static void query_launcher(qdesc_ct, writer_t);
 static const char *check_printable_ascii(const char *);
-static void check_glob_trailing_char(bool, qdesc_ct);
+static const char *check_glob_trailing_char(qdesc_ct, bool);
 
 /* Constants. */
 
+#define STRINGIFY(x) #x
+#define TOSTRING(x) STRINGIFY(x)
+
+/* maximum number of words on one batch line */
+#define MAX_BATCH_ARGS 64
+
 static const char * const conf_files[] = {
 	"~/.isc-dnsdb-query.conf",
 	"~/.dnsdb-query.conf",
@@ -81,29 +99,161 @@ static const char * const conf_files[] = {
 	NULL
 };
 
+static const struct qdesc qdesc_default = {
+	method_none, search_rrnames, return_details,
+	.value = NULL, .exclude = NULL, .rrtype = NULL,
+	.after = 0, .before = 0, .complete = false, .force = false,
+	.query_limit = -1, .output_limit = -1, .offset = 0 };
+
+/* options which describe one query, as opposed to the whole run.  these
+ * are all that can appear on a batch line.
+ */
+static const char query_short_options[] = "A:B:cl:O:s:t:"
+#if 0 /* disable output limit feature */
+	"L:"
+#endif
+	;
+
 /* Private. */
 
-static bool force_query = false;
+/* All the getopt_long switches use the following enum */
+static enum {
+	long_opt_none,		/* nothing specified */
+	long_opt_batch,		/* --batch */
+	long_opt_bisect,	/* --bisect */
+	long_opt_cache,		/* --cache */
+	long_opt_cache_ttl,	/* --cache-ttl */
+	long_opt_compress,	/* --compress */
+	long_opt_exclude,	/* --exclude */
+	long_opt_force,		/* --force */
+	long_opt_glob,		/* --glob */
+	long_opt_hedge,		/* --hedge */
+	long_opt_hedge_cap,	/* --hedge-cap */
+	long_opt_http2,		/* --http2 */
+	long_opt_http2_streams,	/* --http2-streams */
+	long_opt_jobs,		/* --jobs */
+	long_opt_mode,		/* --mode */
+	long_opt_paced,		/* --paced */
+	long_opt_paginate,	/* --paginate */
+	long_opt_prewarm,	/* --prewarm */
+	long_opt_rate,		/* --rate */
+	long_opt_raw,		/* --raw */
+	long_opt_record,	/* --record */
+	long_opt_regex,		/* --regex */
+	long_opt_replay,	/* --replay */
+	long_opt_retries,	/* --retries */
+	long_opt_serve,		/* --serve */
+	long_opt_stall,		/* --stall */
+	long_opt_stats,		/* --stats */
+	long_opt_streams,	/* --streams */
+	long_opt_strip_saf,	/* --strip-saf */
+	long_opt_timeout,	/* --timeout */
+	long_opt_workers	/* --workers */
+} long_opt_switch = long_opt_none;
+
+static struct option long_options[] = {
+	/* NAME	    ARGUMENT	       FLAG  SHORTNAME */
+	{"batch",   required_argument, (int*)&long_opt_switch,
+	 long_opt_batch},
+	{"bisect",  no_argument,       (int*)&long_opt_switch,
+	 long_opt_bisect},
+	{"cache",   required_argument, (int*)&long_opt_switch,
+	 long_opt_cache},
+	{"cache-ttl", required_argument, (int*)&long_opt_switch,
+	 long_opt_cache_ttl},
+	{"compress", no_argument,      (int*)&long_opt_switch,
+	 long_opt_compress},
+	{"exclude", required_argument, (int*)&long_opt_switch,
+	 long_opt_exclude},
+	{"force",   no_argument,       (int*)&long_opt_switch,
+	 long_opt_force},
+	{"glob",    required_argument, (int*)&long_opt_switch,
+	 long_opt_glob},
+	{"hedge",   required_argument, (int*)&long_opt_switch,
+	 long_opt_hedge},
+	{"hedge-cap", required_argument, (int*)&long_opt_switch,
+	 long_opt_hedge_cap},
+	{"http2",   no_argument,       (int*)&long_opt_switch,
+	 long_opt_http2},
+	{"http2-streams", required_argument, (int*)&long_opt_switch,
+	 long_opt_http2_streams},
+	{"jobs",    required_argument, (int*)&long_opt_switch,
+	 long_opt_jobs},
+	{"mode",    required_argument, (int*)&long_opt_switch,
+	 long_opt_mode},
+	{"paced",   no_argument,       (int*)&long_opt_switch,
+	 long_opt_paced},
+	{"paginate", required_argument, (int*)&long_opt_switch,
+	 long_opt_paginate},
+	{"prewarm", no_argument,       (int*)&long_opt_switch,
+	 long_opt_prewarm},
+	{"rate",    required_argument, (int*)&long_opt_switch,
+	 long_opt_rate},
+	{"raw",     no_argument,       (int*)&long_opt_switch,
+	 long_opt_raw},
+	{"record",  required_argument, (int*)&long_opt_switch,
+	 long_opt_record},
+	{"regex",   required_argument, (int*)&long_opt_switch,
+	 long_opt_regex},
+	{"replay",  required_argument, (int*)&long_opt_switch,
+	 long_opt_replay},
+	{"retries", required_argument, (int*)&long_opt_switch,
+	 long_opt_retries},
+	{"serve",   required_argument, (int*)&long_opt_switch,
+	 long_opt_serve},
+	{"stall",   required_argument, (int*)&long_opt_switch,
+	 long_opt_stall},
+	{"stats",   required_argument, (int*)&long_opt_switch,
+	 long_opt_stats},
+	{"streams", required_argument, (int*)&long_opt_switch,
+	 long_opt_streams},
+	{"strip-saf", no_argument,     (int*)&long_opt_switch,
+	 long_opt_strip_saf},
+	{"timeout",   required_argument, (int*)&long_opt_switch,
+	 long_opt_timeout},
+	{"workers", required_argument, (int*)&long_opt_switch,
+	 long_opt_workers},
+	{NULL,	    0,			NULL, 0}
+};
+
+static struct option query_long_options[] = {
+	/* NAME	    ARGUMENT	       FLAG  SHORTNAME */
+	{"exclude", required_argument, (int*)&long_opt_switch,
+	 long_opt_exclude},
+	{"force",   no_argument,       (int*)&long_opt_switch,
+	 long_opt_force},
+	{"glob",    required_argument, (int*)&long_opt_switch,
+	 long_opt_glob},
+	{"mode",    required_argument, (int*)&long_opt_switch,
+	 long_opt_mode},
+	{"regex",   required_argument, (int*)&long_opt_switch,
+	 long_opt_regex},
+	{NULL,	    0,			NULL, 0}
+};
+
+static long batch_jobs = 1;
+static bool prewarm = false;
+static const char *serve_socket = NULL;
 
 /* Public. */
 
 int
 main(int argc, char *argv[]) {
-	static struct qdesc qd = {
-		method_none, search_rrnames, return_details,
-		.value = NULL, .exclude = NULL, .rrtype = NULL,
-		.after = 0, .before = 0, .complete = false,
-		.query_limit = -1, .output_limit = -1, .offset = 0 };
+	struct qdesc qd = qdesc_default;
+	const char *batch_file = NULL;
+	bool query_opts_seen = false;
 	const char *msg;
 	int ch;
 	size_t sz;
 
 	/* global dynamic initialization. */
 	gettimeofday(&startup_time, NULL);
+	srandom((unsigned)(startup_time.tv_usec ^ getpid()));
 	if ((program_name = strrchr(argv[0], '/')) == NULL)
 		program_name = argv[0];
 	else
 		program_name++;
+	arena_init();
 
 	char *value;
 	if ((value = getenv(env_timeout)) != NULL)
@@ -111,37 +261,9 @@ main(int argc, char *argv[]) {
 
 	int option_index = 0;
 
-	/* All the getopt_long switches use the following enum */
-	static enum {
-		long_opt_none,		/* nothing specified */
-		long_opt_exclude,	/* --exclude */
-		long_opt_force,		/* --force */
-		long_opt_glob,		/* --glob */
-		long_opt_mode,		/* --mode */
-		long_opt_regex,		/* --regex */
-		long_opt_timeout	/* --timeout */
-	} long_opt_switch = long_opt_none;
-
-	static struct option long_options[] = {
-		/* NAME	    ARGUMENT	       FLAG  SHORTNAME */
-		{"exclude", required_argument, (int*)&long_opt_switch,
-		 long_opt_exclude},
-		{"force",   no_argument,       (int*)&long_opt_switch,
-		 long_opt_force},
-		{"glob",    required_argument, (int*)&long_opt_switch,
-		 long_opt_glob},
-		{"mode",    required_argument, (int*)&long_opt_switch,
-		 long_opt_mode},
-		{"regex",   required_argument, (int*)&long_opt_switch,
-		 long_opt_regex},
-		{"timeout",   required_argument, (int*)&long_opt_switch,
-		 long_opt_timeout},
-		{NULL,	    0,			NULL, 0}
-	};
-
 	/* process the command line options. */
 	while ((ch = getopt_long(argc, argv,
-				 "jr:n:u:p:t:b:k:O:s:FT"
+				 "fjr:n:u:p:t:b:k:O:s:FT"
 #if 0 /* disable output limit feature */
 				 "dhqUvA:B:l:c46",
 #else
@@ -167,76 +289,136 @@ main(int argc, char *argv[]) {
 					      MAX_VALUE_LEN);
 				set_timeout(optarg, "--timeout");
 				break;
-			case long_opt_regex:
-				sz = strlen(optarg);
-				if (sz == 0)
-					usage("The --regex option requires"
+			case long_opt_batch:
+				if (batch_file != NULL)
+					usage("Cannot specify -f or --batch"
+					      " more than once");
+				if (*optarg == '\0')
+					usage("The --batch option requires"
 					      " a non-empty argument");
-				if (sz > MAX_VALUE_LEN)
-					usage("The --regex option is too long"
-					      " (%u is the maximum length)",
-					      MAX_VALUE_LEN);
-				if (qd.value != NULL)
-					usage("Cannot specify --glob or"
-					      " --regex more than once");
-				qd.value = strdup(optarg);
-				qd.search_method = method_regex;
+				batch_file = optarg;
 				break;
-			case long_opt_glob:
-				sz = strlen(optarg);
-				if (sz == 0)
-					usage("The --glob option requires a"
-					      " non-empty argument");
-				if (sz > MAX_VALUE_LEN)
-					usage("The --glob option is too long"
-					      " (%u is the maximum length)",
-					      MAX_VALUE_LEN);
-				if (qd.value != NULL)
-					usage("Cannot specify --glob or"
-					      " --regex more than once");
-				qd.value = strdup(optarg);
-				qd.search_method = method_glob;
+			case long_opt_jobs:
+				if (!parse_long(optarg, &batch_jobs) ||
+				    batch_jobs <= 0)
+					usage("--jobs must be positive");
 				break;
-			case long_opt_exclude:
-				sz = strlen(optarg);
-				if (sz == 0)
-					usage("The --exclude option requires"
+			case long_opt_bisect:
+				bisect = true;
+				break;
+			case long_opt_cache:
+				if (*optarg == '\0')
+					usage("The --cache option requires"
 					      " a non-empty argument");
-				if (sz > MAX_VALUE_LEN)
-					usage("The --exclude option is too"
-					      " long (%u is the maximum"
-					      " length)",
-					      MAX_VALUE_LEN);
-				if (qd.exclude != NULL)
-					usage("Cannot specify --exclude"
+				cache_dir = optarg;
+				break;
+			case long_opt_cache_ttl:
+				if (!parse_long(optarg, &cache_ttl) ||
+				    cache_ttl <= 0)
+					usage("--cache-ttl must be positive");
+				break;
+			case long_opt_compress:
+				compression = true;
+				break;
+			case long_opt_hedge:
+				if (strcmp(optarg, "auto") == 0)
+					hedge_ms = -1;
+				else if (!parse_long(optarg, &hedge_ms) ||
+					 hedge_ms < 0)
+					usage("--hedge must be 'auto' or"
+					      " not negative");
+				break;
+			case long_opt_hedge_cap:
+				if (!parse_long(optarg, &hedge_cap) ||
+				    hedge_cap < 0 || hedge_cap > 100)
+					usage("--hedge-cap must be from 0"
+					      " to 100");
+				break;
+			case long_opt_http2:
+				http2 = true;
+				break;
+			case long_opt_http2_streams:
+				if (!parse_long(optarg, &http2_streams) ||
+				    http2_streams <= 0)
+					usage("--http2-streams must be"
+					      " positive");
+				break;
+			case long_opt_paced:
+				replay_paced = true;
+				break;
+			case long_opt_record:
+				record_dir = optarg;
+				break;
+			case long_opt_replay:
+				replay_dir = optarg;
+				break;
+			case long_opt_paginate:
+				if (!parse_long(optarg, &paginate) ||
+				    paginate <= 0)
+					usage("--paginate must be positive");
+				break;
+			case long_opt_retries:
+				if (!parse_long(optarg, &retries) ||
+				    retries < 0)
+					usage("--retries must not be negative");
+				break;
+			case long_opt_serve:
+				if (*optarg == '\0')
+					usage("The --serve option requires"
+					      " a non-empty argument");
+				serve_socket = optarg;
+				break;
+			case long_opt_stall:
+				if (!parse_long(optarg, &stall_timeout) ||
+				    stall_timeout < 0)
+					usage("--stall must not be negative");
+				break;
+			case long_opt_stats:
+				if (stats_out != NULL)
+					usage("Cannot specify --stats"
 					      " more than once");
-				qd.exclude = strdup(optarg);
+				if ((stats_out = fopen(optarg, "w")) == NULL) {
+					my_logf("--stats %s: %s", optarg,
+						strerror(errno));
+					my_exit(1);
+				}
 				break;
-			case long_opt_force:
-				force_query = true;
+			case long_opt_rate:
+				if (!parse_double(optarg, &rate_limit) ||
+				    rate_limit <= 0.0)
+					usage("--rate must be positive");
+				break;
+			case long_opt_raw:
+				raw_output = true;
+				break;
+			case long_opt_strip_saf:
+				strip_saf = true;
+				break;
+			case long_opt_workers:
+				if (!parse_long(optarg, &parse_workers) ||
+				    parse_workers <= 0)
+					usage("--workers must be positive");
 				break;
+			case long_opt_streams:
+				if (strcmp(optarg, "auto") == 0)
+					max_streams = -1;
+				else if (!parse_long(optarg, &max_streams) ||
+					 max_streams <= 0)
+					usage("--streams must be 'auto' or"
+					      " positive");
+				break;
+			case long_opt_prewarm:
+				prewarm = true;
+				break;
+			case long_opt_regex:
+			case long_opt_glob:
+			case long_opt_exclude:
+			case long_opt_force:
 			case long_opt_mode:
-				sz = strlen(optarg);
-				if (sz == 0)
-					usage("The --mode option requires"
-					      " a non-empty argument");
-				/* allow abbreviations t for terse and d for details */
-				if (strcmp(optarg, "terse") == 0 ||
-				    strcmp(optarg, "t") == 0)
-					qd.mode_to_return = return_terse;
-#ifdef DETAILS_SUPPORTED
-				else if (strcmp(optarg, "details") == 0 ||
-					 strcmp(optarg, "d") == 0)
-					qd.mode_to_return = return_details;
-#endif
-				else
-#ifdef DETAILS_SUPPORTED
-					usage("Illegal mode value, "
-					      "must be 'terse'|'t' or 'details'|'d'");
-#else
-					usage("Illegal mode value, "
-					      "must be 'terse'|'t'");
-#endif
+				if ((msg = query_option(&qd, ch, optarg))
+				    != NULL)
+					usage(msg);
+				query_opts_seen = true;
 				break;
 			case long_opt_none: /* FALLTHROUGH */
 			default:
@@ -245,20 +427,15 @@ main(int argc, char *argv[]) {
 				break;
 			}
 			break;
-		case 'A':
-			if (!time_get(optarg, &qd.after) || qd.after == 0UL)
-				usage("bad -A timestamp");
-			break;
-		case 'B':
-			if (!time_get(optarg, &qd.before) || qd.before == 0UL)
-				usage("bad -B timestamp");
-			break;
-		case 'c':
-			qd.complete = true;
-			break;
 		case 'd':
 			debug_level++;
 			break;
+		case 'f':
+			if (batch_file != NULL)
+				usage("Cannot specify -f or --batch"
+				      " more than once");
+			batch_file = "-";
+			break;
 		case 'F':
 			presentation = pres_batch;
 			break;
@@ -268,40 +445,9 @@ main(int argc, char *argv[]) {
 		case 'j':
 			presentation = pres_json;
 			break;
-		case 'l':
-			if (!parse_long(optarg, &qd.query_limit) ||
-			    (qd.query_limit < 0))
-				usage("-l must be zero or positive");
-			break;
-#if 0 /* disable output limit feature */
-		case 'L':
-			if (!parse_long(optarg, &qd.output_limit) ||
-			    (qd.output_limit <= 0))
-				usage("-L must be positive");
-			break;
-#endif
-		case 'O':
-			if (!parse_long(optarg, &qd.offset) || (qd.offset < 0))
-				usage("-O must be zero or positive");
-			break;
 		case 'q':
 			quiet = true;
 			break;
-		case 's':
-			/* allow abbreviations n for rrnames and d for rdata */
-			if (strcmp(optarg, "rrnames") == 0 ||
-			    strcmp(optarg, "n") == 0)
-				qd.what_to_search = search_rrnames;
-			else if (strcmp(optarg, "rdata") == 0 ||
-			    strcmp(optarg, "d") == 0)
-				qd.what_to_search = search_rdata;
-			else
-				usage("Illegal what to search, "
-				      "must be 'rrnames'|'n' or 'rdata'|'d'");
-			break;
-		case 't':
-			qd.rrtype = strdup(optarg);
-			break;
 		case 'T':
 			presentation = pres_batch_dedup_rrtype;
 			break;
@@ -322,57 +468,91 @@ main(int argc, char *argv[]) {
 			curl_ipresolve = CURL_IPRESOLVE_V6;
 			break;
 		default:
-			usage("unrecognized option");
+			/* everything else describes the query itself. */
+			if ((msg = query_option(&qd, ch, optarg)) != NULL)
+				usage(msg);
+			query_opts_seen = true;
 		}
 	}
 
 	argc -= optind;
 	if (argc != 0)
 		usage("there are no non-option arguments to this program");
+	if (bisect && paginate > 0)
+		usage("--bisect and --paginate cannot be used together");
+	if (strip_saf && !raw_output)
+		usage("--strip-saf only makes sense with --raw");
+	if (raw_output && (bisect || paginate > 0))
+		usage("--raw cannot be used with --bisect or --paginate");
+	if (raw_output && presentation != pres_json)
+		usage("--raw cannot be used with -F or -T");
+	if (parse_workers > 0 &&
+	    (bisect || presentation == pres_batch_dedup_rrtype))
+		usage("--workers cannot be used with --bisect or -T");
+	if (record_dir != NULL && replay_dir != NULL)
+		usage("--record and --replay cannot be used together");
+	if (replay_paced && replay_dir == NULL)
+		usage("--paced only makes sense with --replay");
+	if (cache_dir != NULL && replay_dir != NULL)
+		usage("--cache and --replay cannot be used together");
+	if (cache_dir != NULL && (msg = cache_init(cache_dir)) != NULL) {
+		my_logf("--cache %s: %s", cache_dir, msg);
+		my_exit(1);
+	}
+	if (record_dir != NULL && (msg = record_init(record_dir)) != NULL) {
+		my_logf("--record %s: %s", record_dir, msg);
+		my_exit(1);
+	}
+	if (replay_dir != NULL && (msg = replay_init(replay_dir)) != NULL) {
+		my_logf("--replay %s: %s", replay_dir, msg);
+		my_exit(1);
+	}
 	argv = NULL;
 
-	if (qd.value == NULL)
-		usage("Need to provide a --regex or --glob option and"
-		      " its argument");
-
-	if (qd.search_method == method_glob)
-		check_glob_trailing_char(force_query, &qd);
-	else if (force_query)
-		usage("--force only makes sense with a glob query");
-
-	if (!force_query) {
-		msg = check_printable_ascii(qd.value);
-		if (msg != NULL)
-			usage(msg);
-
-		if (qd.exclude) {
-			msg = check_printable_ascii(qd.exclude);
-			if (msg != NULL)
-				usage(msg);
+	/* if asked, start connecting to the likely server while we
+	 * finish checking arguments and reading configuration.
+	 */
+	make_curl();
+	if (prewarm && replay_dir == NULL) {
+		pdns_system_ct sys = psys;
+		char *url;
+
+		if (sys == NULL)
+			sys = pick_system(DEFAULT_SYS);
+		if (sys != NULL && sys->server != NULL &&
+		    (url = sys->server()) != NULL)
+		{
+			prewarm_start(url);
+			DESTROY(url);
 		}
 	}
 
-	/* recondition for HTML use. */
-	CURL *easy = curl_easy_init();
-	escape(easy, &qd.value);
-	escape(easy, &qd.rrtype);
-	curl_easy_cleanup(easy);
-	easy = NULL;
-
-	if (qd.output_limit == -1 && qd.query_limit != -1)
-		qd.output_limit = qd.query_limit;
-
-	if (qd.after != 0 && qd.before != 0) {
-		if (qd.complete && qd.after > qd.before)
-			usage("-A value must be before -B value"
-			      " if using complete time matching");
-	}
-	if (qd.complete && qd.after == 0 && qd.before == 0)
-		usage("-c without -A or -B makes no sense.");
+	if (serve_socket != NULL) {
+		/* each request's output is tagged, as a batch line's is. */
+		batching = true;
+		if (batch_file != NULL)
+			usage("--serve cannot be used with -f or --batch");
+		if (batch_jobs != 1)
+			usage("--jobs only makes sense with -f or --batch");
+		if (query_opts_seen)
+			usage("query options must be given in each --serve"
+			      " request, not on the command line");
+	} else if (batch_file != NULL) {
+		batching = true;
+		if (query_opts_seen)
+			usage("query options must be given on each batch"
+			      " line, not on the command line, with -f or"
+			      " --batch");
+	} else {
+		if (batch_jobs != 1)
+			usage("--jobs only makes sense with -f or --batch");
+		if ((msg = qdesc_ready(&qd, true)) != NULL)
+			usage(msg);
 
-	/* optionally dump program options as interpreted. */
-	if (debug_level >= 1) {
-		qdesc_debug("main", &qd);
+		/* optionally dump program options as interpreted. */
+		if (debug_level >= 1) {
+			qdesc_debug("main", &qd);
+		}
 	}
 
 	/* select presenter. */
@@ -400,6 +580,16 @@ main(int argc, char *argv[]) {
 			      " and there is no default.");
 	}
 
+	/* the server prewarmed was a guess; drop it if it was wrong. */
+	if (prewarm && replay_dir == NULL) {
+		char *url = NULL;
+
+		if (psys->server != NULL)
+			url = psys->server();
+		prewarm_check(url);
+		DESTROY(url);
+	}
+
 	/* verify that some of the fields in our psys are set. */
 	assert(psys->base_url != NULL);
 	assert(psys->url != NULL);
@@ -407,19 +597,32 @@ main(int argc, char *argv[]) {
 	assert(psys->ready != NULL);
 	assert(psys->destroy != NULL);
 
-	if ((msg = psys->ready()) != NULL)
+	/* a replay sends nothing to the server, so needs no API key. */
+	if ((msg = psys->ready()) != NULL && replay_dir == NULL)
 		usage(msg);
-	make_curl();
-	writer_t writer = writer_init(qd.output_limit);
-	query_launcher(&qd, writer);
-	io_engine(0);
-	writer_fini(writer);
-	writer = NULL;
+	if (serve_socket != NULL) {
+		if ((msg = serve_init(serve_socket, serve_request)) != NULL) {
+			my_logf("--serve %s: %s", serve_socket, msg);
+			my_exit(1);
+		}
+		serve_loop();
+	} else if (batching) {
+		batch_loop(batch_file);
+	} else {
+		writer_t writer = writer_init(qd.output_limit, NULL, false);
+		query_launcher(&qd, writer);
+		io_engine(0);
+		writer_fini(writer);
+		writer = NULL;
+	}
 	unmake_curl();
+	record_fini();
+	cache_fini();
+	arena_fini();
+	if (stats_out != NULL)
+		fclose(stats_out);
 
 	/* clean up and go home. */
-	DESTROY(qd.value);
-	DESTROY(qd.rrtype);
 	my_exit(exit_code);
 }
 
@@ -462,7 +665,7 @@ my_panic(bool want_perror, const char *s) {
  */
 static void
 help(void) {
-	printf("usage: %s [-cdFhjqsTUv46] \n",
+	printf("usage: %s [-cdfFhjqsTUv46] \n",
 	       program_name);
 #if 0 /* disable output limit feature */
 	puts("\t[-l QUERY-LIMIT] [-L OUTPUT-LIMIT] [-A AFTER] [-B BEFORE]\n"
@@ -470,6 +673,16 @@ help(void) {
 	puts("\t[-l QUERY-LIMIT] [-A AFTER] [-B BEFORE]\n"
 #endif
 	     "\t[-u SYSTEM] [-O OFFSET]\n"
+	     "\t[--batch FILE] [--jobs N] [--prewarm] [--bisect]"
+	     " [--paginate PAGES]\n"
+	     "\t[--retries N] [--stall SECONDS] [--rate QPS]\n"
+	     "\t[--streams N|auto] [--hedge MS|auto [--hedge-cap PERCENT]]\n"
+	     "\t[--http2 [--http2-streams N]] [--compress]"
+	     " [--raw [--strip-saf]]\n"
+	     "\t[--record DIR | --replay DIR [--paced]]"
+	     " [--stats FILE]\n"
+	     "\t[--cache DIR [--cache-ttl SECONDS]]\n"
+	     "\t[--serve SOCKET] [--workers N]\n"
 	     "\t{\n"
 	     "\t\t[--regex REGEX] |\n"
 	     "\t\t[--glob GLOB]\n"
@@ -486,10 +699,45 @@ help(void) {
 	     "\tor relative format %dw%dd%dh%dm%ds.\n"
 	     "use -c to get complete (strict) time matching for -A and -B.\n"
 	     "use -d one or more times to ramp up the diagnostic output.\n"
+	     "use -f or --batch FILE to read one query per line"
+	     " (- is stdin).\n"
+	     "use --jobs # to run that many batch queries at once.\n"
+	     "use --serve SOCKET to answer JSON queries sent to that unix"
+	     " socket.\n"
+	     "use --bisect to split time ranges until no results are"
+	     " limited.\n"
+	     "use --paginate # to fetch -l sized pages, that many at once,"
+	     " until done.\n"
 	     "use -F to get batch mode output.\n"
 	     "use -T to get batch mode output with deduplicated rrtypes.\n"
+	     "use --raw to output responses as the server sent them, and"
+	     " --strip-saf\n\tto leave out the lines carrying no results.\n"
 	     "use --force to issue possibly invalid or non-useful queries.\n"
 	     "use -O # to skip this many results in what is returned.\n"
+	     "use --retries # to retry that many times a fetch which fails"
+	     " partway.\n"
+	     "use --stall # to treat that many seconds of silence as a"
+	     " failure.\n"
+	     "use --hedge # to race a fetch with no data after that many ms"
+	     " with a\n\tduplicate (auto: after the 95th percentile),"
+	     " and --hedge-cap # to\n\thedge at most that percent of"
+	     " fetches (default 10).\n"
+	     "use --stats FILE to write a JSON summary of each query there.\n"
+	     "use --rate # to start at most that many fetches per second.\n"
+	     "use --streams # to have at most that many fetches running"
+	     " (auto: adapt\n\tthat to how the server copes).\n"
+	     "use --prewarm to connect to the server while starting up.\n"
+	     "use --http2 to run fetches as HTTP/2 streams sharing"
+	     " connections, and\n\t--http2-streams # for at most that"
+	     " many on each (default 100).\n"
+	     "use --compress to ask for compressed responses.\n"
+	     "use --workers # to parse and present responses in that many"
+	     " threads.\n"
+	     "use --cache DIR to keep complete responses there for reuse,"
+	     " and\n\t--cache-ttl # for how many seconds (default 3600).\n"
+	     "use --record DIR to save each response there, and --replay DIR"
+	     " to\n\tuse them instead of the server (--paced: at their"
+	     " original pace).\n"
 	     "use -q for warning reticence.\n"
 	     "use -U to turn off SSL certificate verification.\n"
 	     "use -4 to force connecting to the server via IPv4.\n"
@@ -604,6 +852,23 @@ parse_long(const char *in, long *out) {
 	return true;
 }
 
+/* parse a double from a string.
+ *
+ * Return true if ok, else return false.
+ */
+static bool
+parse_double(const char *in, double *out) {
+	char *ep;
+	double result;
+
+	errno = 0;
+	result = strtod(in, &ep);
+	if (errno != 0 || ep == in || *ep != '\0')
+		return false;
+	*out = result;
+	return true;
+}
+
 /* set_timeout -- ingest a setting for curl_timeout
  *
  * exits through usage() if the value is invalid.
@@ -614,6 +879,485 @@ set_timeout(const char *value, const char *source) {
 		usage("%s must be non-negative", source);
 }
 
+/* query_option -- apply one query-describing option to a qdesc.
+ *
+ * ch is what getopt_long() returned, where zero means that long_opt_switch
+ * says which long option it was.  returns NULL if ok, else a static
+ * error message.
+ */
+static const char *
+query_option(qdesc_t qdp, int ch, const char *arg) {
+	size_t sz;
+
+	switch (ch) {
+	case 0:
+		switch (long_opt_switch) {
+		case long_opt_regex:
+			sz = strlen(arg);
+			if (sz == 0)
+				return "The --regex option requires"
+					" a non-empty argument";
+			if (sz > MAX_VALUE_LEN)
+				return "The --regex option is too long"
+					" (" TOSTRING(MAX_VALUE_LEN)
+					" is the maximum length)";
+			if (qdp->value != NULL)
+				return "Cannot specify --glob or"
+					" --regex more than once";
+			qdp->value = strdup(arg);
+			qdp->search_method = method_regex;
+			break;
+		case long_opt_glob:
+			sz = strlen(arg);
+			if (sz == 0)
+				return "The --glob option requires a"
+					" non-empty argument";
+			if (sz > MAX_VALUE_LEN)
+				return "The --glob option is too long"
+					" (" TOSTRING(MAX_VALUE_LEN)
+					" is the maximum length)";
+			if (qdp->value != NULL)
+				return "Cannot specify --glob or"
+					" --regex more than once";
+			qdp->value = strdup(arg);
+			qdp->search_method = method_glob;
+			break;
+		case long_opt_exclude:
+			sz = strlen(arg);
+			if (sz == 0)
+				return "The --exclude option requires"
+					" a non-empty argument";
+			if (sz > MAX_VALUE_LEN)
+				return "The --exclude option is too"
+					" long (" TOSTRING(MAX_VALUE_LEN)
+					" is the maximum length)";
+			if (qdp->exclude != NULL)
+				return "Cannot specify --exclude"
+					" more than once";
+			qdp->exclude = strdup(arg);
+			break;
+		case long_opt_force:
+			qdp->force = true;
+			break;
+		case long_opt_mode:
+			sz = strlen(arg);
+			if (sz == 0)
+				return "The --mode option requires"
+					" a non-empty argument";
+			/* allow abbreviations t for terse and d for details */
+			if (strcmp(arg, "terse") == 0 ||
+			    strcmp(arg, "t") == 0)
+				qdp->mode_to_return = return_terse;
+#ifdef DETAILS_SUPPORTED
+			else if (strcmp(arg, "details") == 0 ||
+				 strcmp(arg, "d") == 0)
+				qdp->mode_to_return = return_details;
+#endif
+			else
+#ifdef DETAILS_SUPPORTED
+				return "Illegal mode value, "
+					"must be 'terse'|'t' or 'details'|'d'";
+#else
+				return "Illegal mode value, "
+					"must be 'terse'|'t'";
+#endif
+			break;
+		case long_opt_none:
+		case long_opt_batch:
+		case long_opt_bisect:
+		case long_opt_cache:
+		case long_opt_cache_ttl:
+		case long_opt_compress:
+		case long_opt_hedge:
+		case long_opt_hedge_cap:
+		case long_opt_http2:
+		case long_opt_http2_streams:
+		case long_opt_jobs:
+		case long_opt_paced:
+		case long_opt_paginate:
+		case long_opt_prewarm:
+		case long_opt_rate:
+		case long_opt_raw:
+		case long_opt_record:
+		case long_opt_replay:
+		case long_opt_retries:
+		case long_opt_serve:
+		case long_opt_stall:
+		case long_opt_stats:
+		case long_opt_streams:
+		case long_opt_strip_saf:
+		case long_opt_timeout:
+		case long_opt_workers:
+		default:
+			return "unrecognized option";
+		}
+		break;
+	case 'A':
+		if (!time_get(arg, &qdp->after) || qdp->after == 0UL)
+			return "bad -A timestamp";
+		break;
+	case 'B':
+		if (!time_get(arg, &qdp->before) || qdp->before == 0UL)
+			return "bad -B timestamp";
+		break;
+	case 'c':
+		qdp->complete = true;
+		break;
+	case 'l':
+		if (!parse_long(arg, &qdp->query_limit) ||
+		    (qdp->query_limit < 0))
+			return "-l must be zero or positive";
+		break;
+#if 0 /* disable output limit feature */
+	case 'L':
+		if (!parse_long(arg, &qdp->output_limit) ||
+		    (qdp->output_limit <= 0))
+			return "-L must be positive";
+		break;
+#endif
+	case 'O':
+		if (!parse_long(arg, &qdp->offset) || (qdp->offset < 0))
+			return "-O must be zero or positive";
+		break;
+	case 's':
+		/* allow abbreviations n for rrnames and d for rdata */
+		if (strcmp(arg, "rrnames") == 0 ||
+		    strcmp(arg, "n") == 0)
+			qdp->what_to_search = search_rrnames;
+		else if (strcmp(arg, "rdata") == 0 ||
+		    strcmp(arg, "d") == 0)
+			qdp->what_to_search = search_rdata;
+		else
+			return "Illegal what to search, "
+				"must be 'rrnames'|'n' or 'rdata'|'d'";
+		break;
+	case 't':
+		DESTROY(qdp->rrtype);
+		qdp->rrtype = strdup(arg);
+		break;
+	default:
+		return "unrecognized option";
+	}
+	return NULL;
+}
+
+/* qdesc_ready -- check a fully parsed qdesc for consistency, and
+ * recondition it for use in a URL.  if fatal, as for the command line,
+ * a glob ending in the wrong character is reported here, and we exit.
+ *
+ * returns NULL if ok, else a static error message.
+ */
+static const char *
+qdesc_ready(qdesc_t qdp, bool fatal) {
+	const char *msg;
+
+	if (qdp->value == NULL)
+		return "Need to provide a --regex or --glob option and"
+			" its argument";
+
+	if (qdp->search_method == method_glob) {
+		if ((msg = check_glob_trailing_char(qdp, fatal)) != NULL)
+			return msg;
+	} else if (qdp->force)
+		return "--force only makes sense with a glob query";
+
+	if (!qdp->force) {
+		msg = check_printable_ascii(qdp->value);
+		if (msg != NULL)
+			return msg;
+
+		if (qdp->exclude) {
+			msg = check_printable_ascii(qdp->exclude);
+			if (msg != NULL)
+				return msg;
+		}
+	}
+
+	if (qdp->after != 0 && qdp->before != 0) {
+		if (qdp->complete && qdp->after > qdp->before)
+			return "-A value must be before -B value"
+				" if using complete time matching";
+	}
+	if (qdp->complete && qdp->after == 0 && qdp->before == 0)
+		return "-c without -A or -B makes no sense.";
+	if (bisect && qdp->offset != 0)
+		return "-O cannot be used with --bisect";
+	if (paginate > 0 && qdp->query_limit <= 0)
+		return "--paginate requires -l to set the page size";
+
+	/* recondition for HTML use. */
+	CURL *easy = curl_easy_init();
+	escape(easy, &qdp->value);
+	escape(easy, &qdp->rrtype);
+	curl_easy_cleanup(easy);
+	easy = NULL;
+
+	/* when bisecting or paginating, the query limit is per fetch. */
+	if (qdp->output_limit == -1 && qdp->query_limit != -1 &&
+	    !bisect && paginate == 0)
+		qdp->output_limit = qdp->query_limit;
+
+	return NULL;
+}
+
+/* qdesc_free -- release the heap storage held by a qdesc.
+ */
+static void
+qdesc_free(qdesc_t qdp) {
+	DESTROY(qdp->value);
+	DESTROY(qdp->exclude);
+	DESTROY(qdp->rrtype);
+}
+
+/* batch_loop -- run one query per line of a batch file ("-" is stdin),
+ * keeping up to batch_jobs fetches outstanding at once.
+ */
+static void
+batch_loop(const char *file) {
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+	int l = 0;
+	FILE *f;
+
+	if (strcmp(file, "-") == 0) {
+		f = stdin;
+	} else if ((f = fopen(file, "r")) == NULL) {
+		my_logf("cannot open batch file '%s': %s",
+			file, strerror(errno));
+		my_exit(1);
+	}
+	while ((len = getline(&line, &n, f)) > 0) {
+		struct qdesc qd = qdesc_default;
+		const char *msg;
+		size_t ws;
+		char *descr;
+
+		l++;
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		/* blank lines and comments are not queries. */
+		ws = strspn(line, "\040\t");
+		if (line[ws] == '\0' || line[ws] == '#')
+			continue;
+
+		descr = strdup(line + ws);
+		msg = batch_parse(line, &qd);
+		if (msg != NULL) {
+			my_logf("batch line #%d: %s", l, msg);
+			exit_code = 1;
+			qdesc_free(&qd);
+			DESTROY(descr);
+			continue;
+		}
+		if (debug_level >= 1)
+			qdesc_debug("batch", &qd);
+
+		/* make room for this query, then start it.  when more than
+		 * one query can be in flight, each one's output is held
+		 * until it is complete so that outputs do not interleave.
+		 */
+		io_engine((int)batch_jobs - 1);
+		if (output_closed()) {
+			DESTROY(descr);
+			qdesc_free(&qd);
+			break;
+		}
+		query_launcher(&qd, writer_init(qd.output_limit, descr,
+						batch_jobs > 1));
+		DESTROY(descr);
+	}
+	DESTROY(line);
+	if (f != stdin)
+		fclose(f);
+	io_engine(0);
+}
+
+/* batch_parse -- parse one batch line's options into a qdesc.
+ *
+ * the line is modified in place.  returns NULL if ok, else a static
+ * error message.
+ */
+static const char *
+batch_parse(char *line, qdesc_t qdp) {
+	static char argv0[] = "batch";
+	char *argv[MAX_BATCH_ARGS + 2];
+	const char *msg = NULL;
+	int argc, ch, option_index = 0;
+
+	argv[0] = argv0;
+	argc = batch_split(line, argv + 1, MAX_BATCH_ARGS);
+	if (argc < 0)
+		return "too many words, or unbalanced quotes";
+	argc++;
+	argv[argc] = NULL;
+
+	/* getopt_long() keeps its state in globals, so start it over. */
+#ifdef __GLIBC__
+	optind = 0;
+#else
+	optreset = 1;
+	optind = 1;
+#endif
+	opterr = 0;
+	while (msg == NULL &&
+	       (ch = getopt_long(argc, argv, query_short_options,
+				 query_long_options, &option_index)) != -1)
+	{
+		if (ch == '?')
+			msg = "unrecognized option or missing argument";
+		else
+			msg = query_option(qdp, ch, optarg);
+	}
+	opterr = 1;
+	if (msg == NULL && optind != argc)
+		msg = "there are no non-option arguments on a batch line";
+	if (msg == NULL)
+		msg = qdesc_ready(qdp, false);
+	return msg;
+}
+
+/* batch_split -- break a batch line into words, in place, honoring
+ * single quotes, double quotes, and backslashes much as a shell would.
+ *
+ * returns the number of words, or -1 if there are too many or a quote
+ * is unbalanced.
+ */
+static int
+batch_split(char *line, char **words, int max) {
+	char *src = line, *dst = line;
+	int n = 0;
+
+	for (;;) {
+		char quote = '\0';
+
+		while (*src == '\040' || *src == '\t')
+			src++;
+		if (*src == '\0')
+			break;
+		if (n == max)
+			return -1;
+		words[n++] = dst;
+		while (*src != '\0' &&
+		       (quote != '\0' || (*src != '\040' && *src != '\t')))
+		{
+			if (quote == '\0' && (*src == '\'' || *src == '"')) {
+				quote = *src++;
+				continue;
+			}
+			if (quote != '\0' && *src == quote) {
+				quote = '\0';
+				src++;
+				continue;
+			}
+			if (*src == '\\' && src[1] != '\0' &&
+			    (quote == '\0' ||
+			     (quote == '"' &&
+			      (src[1] == '"' || src[1] == '\\'))))
+				src++;
+			*dst++ = *src++;
+		}
+		if (quote != '\0')
+			return -1;
+		if (*src != '\0')
+			src++;
+		*dst++ = '\0';
+	}
+	return n;
+}
+
+/* serve_request -- start answering one --serve request, which is a JSON
+ * object whose members are named for the query options.  a bad request
+ * is answered with an error instead.
+ */
+static void
+serve_request(client_t client, char *line) {
+	struct qdesc qd = qdesc_default;
+	const char *msg = NULL;
+	json_error_t error;
+	json_t *req;
+	void *iter;
+
+	req = json_loads(line, 0, &error);
+	if (req == NULL || !json_is_object(req))
+		msg = "request is not a JSON object";
+	else
+		for (iter = json_object_iter(req);
+		     msg == NULL && iter != NULL;
+		     iter = json_object_iter_next(req, iter))
+			msg = serve_member(&qd, json_object_iter_key(iter),
+					   json_object_iter_value(iter));
+	if (msg == NULL)
+		msg = qdesc_ready(&qd, false);
+	json_decref(req);
+	if (msg != NULL) {
+		client_reject(client, line, msg);
+		qdesc_free(&qd);
+		return;
+	}
+	if (debug_level >= 1)
+		qdesc_debug("serve", &qd);
+	query_launcher(&qd, client_writer(client, qd.output_limit, line));
+}
+
+/* serve_member -- apply one member of a --serve request to a qdesc, as
+ * query_option() would the command line option it is named for.  flags
+ * are given as true or false, and numbers as numbers or strings.
+ *
+ * returns NULL if ok, else a static error message.
+ */
+static const char *
+serve_member(qdesc_t qdp, const char *name, json_t *val) {
+	static const struct {
+		const char	*name;
+		int		ch;
+		int		long_opt;
+		bool		flag;
+	} members[] = {
+		{ "after",	'A', long_opt_none, false },
+		{ "before",	'B', long_opt_none, false },
+		{ "complete",	'c', long_opt_none, true },
+		{ "exclude",	0, long_opt_exclude, false },
+		{ "force",	0, long_opt_force, true },
+		{ "glob",	0, long_opt_glob, false },
+		{ "limit",	'l', long_opt_none, false },
+		{ "mode",	0, long_opt_mode, false },
+		{ "offset",	'O', long_opt_none, false },
+		{ "regex",	0, long_opt_regex, false },
+		{ "rrtype",	't', long_opt_none, false },
+		{ "search",	's', long_opt_none, false },
+		{ NULL,		0, long_opt_none, false }
+	};
+	char num[sizeof "-9223372036854775808"];
+	const char *arg;
+	int i;
+
+	for (i = 0; members[i].name != NULL; i++)
+		if (strcmp(members[i].name, name) == 0)
+			break;
+	if (members[i].name == NULL)
+		return "unrecognized request member";
+
+	if (members[i].flag) {
+		if (!json_is_boolean(val))
+			return "request flags must be true or false";
+		if (json_is_false(val))
+			return NULL;
+		arg = NULL;
+	} else if (json_is_string(val)) {
+		arg = json_string_value(val);
+	} else if (json_is_integer(val)) {
+		snprintf(num, sizeof num, "%" JSON_INTEGER_FORMAT,
+			 json_integer_value(val));
+		arg = num;
+	} else {
+		return "request values must be strings or integers";
+	}
+	long_opt_switch = members[i].long_opt;
+	return query_option(qdp, members[i].ch, arg);
+}
+
 /* read_configs -- try to find a config file in static path, then parse it.
  */
 static void
@@ -797,12 +1541,13 @@ makepath(qdesc_ct qdp)
 }
 
 /* query_launcher -- fork off curl job for this query.
+ *
+ * the query takes over the heap storage held by the qdesc.
  */
-void
+static void
 query_launcher(qdesc_ct qdp, writer_t writer) {
 	struct pdns_fence fence = {};
 	query_t query = NULL;
-	char *url;
 
 	CREATE(query, sizeof(struct query));
 	query->writer = writer;
@@ -834,15 +1579,26 @@ query_launcher(qdesc_ct qdp, writer_t writer) {
 		}
 	}
 
-	url = psys->url(query->command, NULL, &query->qd, &fence);
-	if (url == NULL)
-		my_exit(1);
+	/* time slices of a bisected query may return the same tuple. */
+	if (bisect)
+		query->seen = tuple_set_new(NULL);
 
-	DEBUG(1, true, "url [%s]\n", url);
 	if (curl_timeout != 0)
 		DEBUG(1, true, "curl_timeout is %lu\n", curl_timeout);
 
-	create_fetch(query, url);
+	if (paginate > 0) {
+		long page;
+
+		/* the first page is output as it arrives, the rest held. */
+		query->next_offset = qdp->offset;
+		for (page = 0; page < paginate; page++) {
+			launch_fetch(query, &fence, query->next_offset)
+				->held = (page != 0);
+			query->next_offset += qdp->query_limit;
+		}
+	} else {
+		launch_fetch(query, &fence, qdp->offset);
+	}
 }
 
 /* check if its argument is printable ASCII.
@@ -863,25 +1619,26 @@ check_printable_ascii(const char *name) {
 }
 
 /* check if a glob ends in a useful character.
- * If warn_only then just warn; otherwise it is fatal.
+ * If the query is forced then just warn; otherwise it is fatal if fatal,
+ * else return an error message.
  */
-static void
-check_glob_trailing_char(bool warn_only, qdesc_ct qdp) {
+static const char *
+check_glob_trailing_char(qdesc_ct qdp, bool fatal) {
 	const char *msg = NULL;
 
 	size_t sz = strlen(qdp->value);
 	if (sz == 0)
-		usage("search argument is blank."); /* FATAL always */
+		return "search argument is blank."; /* FATAL always */
 
 	int last_ch = qdp->value[sz - 1];
 
 	if (last_ch == '*' || last_ch == '?' || last_ch == ']' ||
 	    last_ch == '.')
-		return;		/* fine */
+		return NULL;		/* fine */
 
 	if (qdp->what_to_search == search_rdata) {
 		if (last_ch == '"')
-			return;		/* fine, but only for rdata */
+			return NULL;	/* fine, but only for rdata */
 		msg = "a glob search argument for rdata should end either"
 			" in a period,\n"
 			"a double quote, or certain "
@@ -890,13 +1647,16 @@ check_glob_trailing_char(bool warn_only, qdesc_ct qdp) {
 		msg = "a glob search argument for rrnames should end either"
 			" in a period\n"
 			"or certain glob special characters (*, ?, or ]).";
-	if (warn_only) {
+	if (qdp->force) {
 		if (!quiet)
 			fprintf(stderr, "Warning: %s\nYou may not get results"
 				" from your search.\n", msg);
-	} else {
+		return NULL;
+	}
+	if (fatal) {
 		fprintf(stderr, "Error: %s\nYou may not get results from your"
 			" search.\n", msg);
 		my_exit(1);
 	}
+	return msg;
 }
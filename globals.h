@@ -37,6 +37,27 @@ EXTERN	pdns_system_ct psys		INIT(NULL);
 EXTERN	int debug_level			INIT(0);
 EXTERN	bool donotverify		INIT(false);
 EXTERN	bool quiet			INIT(false);
+EXTERN	bool batching			INIT(false);
+EXTERN	bool bisect			INIT(false);
+EXTERN	bool compression		INIT(false);
+EXTERN	long paginate			INIT(0);
+EXTERN	long retries			INIT(0);
+EXTERN	long stall_timeout		INIT(0);
+EXTERN	double rate_limit		INIT(0.0);
+EXTERN	long max_streams		INIT(0);
+EXTERN	const char *record_dir		INIT(NULL);
+EXTERN	const char *replay_dir		INIT(NULL);
+EXTERN	bool replay_paced		INIT(false);
+EXTERN	FILE *stats_out			INIT(NULL);
+EXTERN	const char *cache_dir		INIT(NULL);
+EXTERN	long cache_ttl			INIT(3600);
+EXTERN	long hedge_ms			INIT(0);
+EXTERN	long hedge_cap			INIT(10);
+EXTERN	bool http2			INIT(false);
+EXTERN	long http2_streams		INIT(100);
+EXTERN	bool raw_output			INIT(false);
+EXTERN	bool strip_saf			INIT(false);
+EXTERN	long parse_workers		INIT(0);
 EXTERN	present_e presentation		INIT(pres_json);
 EXTERN	present_t presenter		INIT(NULL);
 EXTERN	struct timeval startup_time	INIT({});
@@ -20,29 +20,323 @@
 #define _BSD_SOURCE
 #define _DEFAULT_SOURCE
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "defs.h"
 #include "netio.h"
 #include "pdns.h"
+#include "arena.h"
+#include "cache.h"
+#include "record.h"
+#include "sindex.h"
 #include "globals.h"
 
 static void io_drain(void);
 static void fetch_reap(fetch_t);
 static void fetch_done(fetch_t);
 static void fetch_unlink(fetch_t);
+static void fetch_finish(fetch_t);
+static void fetch_start(fetch_t);
+static void fetch_admit(fetch_t);
+static bool fetch_throttled(fetch_t);
+static bool gate_pass(void);
+static long streams_limit(void);
+static void aimd_fetch(fetch_t, CURLcode);
+static void aimd_ttfb(fetch_t, long long);
+static void aimd_cut(fetch_t, int);
+static long gate_run(void);
+static void fetch_end(fetch_t, CURLcode);
+static bool fetch_retry(fetch_t, CURLcode);
+static long fetch_timers(void);
+static void lost_reap(fetch_t);
+static bool fetch_hedgeable(fetch_t);
+static void fetch_hedge(fetch_t);
+static long hedge_after(void);
+static void ttfb_note(long long);
+static long long mono_ms(void);
+static void io_step(void);
+static void outq_init(void);
+static void outq_fini(struct outq *);
+static void outq_restore(void);
+static void outq_signal(int);
+static void outq_put(struct outq *, const char *, size_t);
+static void outq_direct(struct outq *, const char *, size_t);
+static void outq_flush(struct outq *, bool);
+static void outq_watch(struct outq *);
+static void outq_ready(int, int, void *);
+static void outq_check(struct outq *);
+static void outq_resume(struct outq *);
+static void outq_abort(struct outq *);
+static void serve_accept(int, int, void *);
+static void serve_signal(int);
+static bool clients_run(void);
+static void client_ready(int, int, void *);
+static void client_read(client_t);
+static void client_watch(client_t);
+static void client_free(client_t);
+static void writer_flush(writer_t);
+static void fetch_stats(fetch_t, CURLcode, curl_off_t, bool);
+static void query_stats(query_t);
+static void fetch_cancel(fetch_t);
+static bool fetch_deblock(fetch_t);
+static bool fetch_raw(fetch_t, const char *, size_t);
+static bool fetch_raw_strip(fetch_t, const char *, size_t);
+static bool raw_note(fetch_t, const char *, size_t);
+static void writer_put(writer_t, const char *, size_t);
+static bool deblock_line(fetch_t, const char *, size_t, sindex_ct);
+static bool work_submit(fetch_t);
+static void work_queue(fetch_t, const char *, size_t);
+static bool work_commit(bool);
+static void work_sync(fetch_t);
+static void work_start(void);
+static void work_fini(void);
+static void *work_main(void *);
+static void work_ready(int, int, void *);
+static void fetch_append(fetch_t, const char *, size_t);
+static void fetch_empty(fetch_t);
+static fetch_t page_next(query_t);
 static void query_done(query_t);
+static void share_lock(CURL *, curl_lock_data, curl_lock_access, void *);
+static void share_unlock(CURL *, curl_lock_data, void *);
+static CURL *easy_get(void);
+static void easy_put(CURL *);
+static void easy_common(CURL *);
+static void easy_http(CURL *, const char *);
+static void *prewarm_main(void *);
+static int socket_cb(CURL *, curl_socket_t, int, void *, void *);
+static int timer_cb(CURLM *, long, void *);
+static void socket_ready(int, int, void *);
+static void watch_set(int, int, watch_func_t, void *);
+static void watch_wait(long);
+static int prewarm_progress(void *, curl_off_t, curl_off_t,
+			    curl_off_t, curl_off_t);
+
+/* initial size of a fetch's buffer, enough for several curl chunks. */
+#define FETCH_BUF_SIZE 65536
+
+/* most idle easy handles we will keep around for reuse. */
+#define EASY_POOL_MAX 16
 
 static writer_t writers = NULL;
 static CURLM *multi = NULL;
+static CURLSH *share = NULL;
+static pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
 static bool curl_cleanup_needed = false;
 
+static CURL *easy_pool[EASY_POOL_MAX];
+static int easy_pooled = 0;
+
+/* a prewarm gets this long, in seconds, to connect, if --timeout is not
+ * shorter; it is otherwise only abandoned when we exit.
+ */
+#define PREWARM_TIMEOUT	10L
+
+static pthread_t prewarm_thread;
+static CURL *prewarm_easy = NULL;
+static char *prewarm_url = NULL;
+static CURLcode prewarm_result = CURLE_OK;
+static atomic_bool prewarm_abort = false;
+static atomic_bool prewarm_done = false;
+
+static u_long conns_new = 0, conns_reused = 0;
+static u_long fetches_http2 = 0, fetches_http1 = 0;
+
+/* fetch_deblock()'s index of each chunk, kept for its bitmaps' sake. */
+static struct sindex deblock_ix;
+
+/* --workers: the complete lines of a fetch, in batches of about this
+ * many octets, are parsed and presented by a pool of threads.  each
+ * batch is presented into its own buffer, as if by a fetch, query, and
+ * writer of its own, and then output and counted as its fetch's, in the
+ * order the batches were made.  batches run from work_head, the oldest
+ * not yet output, to work_tail; work_next is the oldest not yet taken
+ * by a worker.  a worker finishing work_head wakes us, through a pipe
+ * when we are waiting in io_engine(), else through work_done.
+ */
+#define WORK_BATCH	65536
+/* most batches not yet output, for each worker. */
+#define WORK_DEPTH	4
+struct batch {
+	struct batch	*next;
+	fetch_t		fetch;
+	query_t		query;
+	char		*lines;
+	size_t		len;
+	bool		done;
+	struct fetch	w_fetch;
+	struct query	w_query;
+	struct writer	w_writer;
+};
+static pthread_t *work_threads = NULL;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_todo = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static struct batch *work_head = NULL, *work_tail = NULL, *work_next = NULL;
+static long work_depth = 0;
+static bool work_stop = false;
+static int work_fds[2] = { -1, -1 };
+static u_long work_batches = 0, work_stalls = 0;
+
+/* one file descriptor the io engine is watching. */
+struct watch {
+	watch_func_t	func;
+	void		*arg;
+	int		events;
+};
+static struct watch *watches = NULL;
+static int watches_size = 0;
+#ifdef __linux__
+static int epfd = -1;
+#endif
+
+/* what libcurl last asked of its timer, and how many of our fetches
+ * libcurl has been given but has not yet reported as done.
+ */
+static long multi_timeout_ms = -1;
+static int multi_running = 0, multi_inflight = 0;
+
+/* fetches waiting out a backoff before being retried. */
+static int fetches_waiting = 0;
+
+/* first and greatest delay before retrying a fetch. */
+#define RETRY_BASE_MS	1000
+#define RETRY_MAX_MS	60000
+
+/* times to retry a fetch the server throttled, if --retries is fewer. */
+#define THROTTLE_RETRIES 10
+
+/* times a --bisect query may be split on the way to any one part, so
+ * that it has at most 65536 parts.
+ */
+#define BISECT_SPLITS	16
+
+/* hedging: how many fetches have been given to libcurl, not counting
+ * hedges; how many hedges, and how many of those beat their twin.
+ */
+static u_long fetches_admitted = 0, hedges_issued = 0, hedges_won = 0;
+
+/* recent times to first data, in a ring, for --hedge auto; and their
+ * 95th percentile, or -1 if that needs working out again.
+ */
+#define TTFB_SAMPLES		100
+#define TTFB_MIN_SAMPLES	20
+static long ttfb_ms[TTFB_SAMPLES];
+static int ttfb_count = 0, ttfb_next = 0;
+static long ttfb_p95 = -1;
+
+/* how long --hedge auto waits until it has seen enough fetches. */
+#define HEDGE_DEFAULT_MS 1000
+
+/* fetches which lost to their twin, no longer part of any query, until
+ * they can be taken back from libcurl.
+ */
+static fetch_t lost_fetches = NULL;
+
+/* an output queue: presented output not yet written to stdout or to a
+ * --serve client, which is len octets at buf + start.  if it is a pipe or
+ * socket (for stdout, one stderr is not also going to), it is written
+ * without blocking, and the fetches writing to it are paused while the
+ * queue is above its high water mark, until it drains below its low one.
+ */
+struct outq {
+	int	fd;
+	struct client *client;	/* whose it is, if not stdout's */
+	char	*buf;
+	size_t	size, start, len;
+	bool	nonblock;	/* we made stdout non-blocking */
+	int	flags;		/* what its file status flags were */
+	bool	watched;	/* waiting for fd to be writable */
+	bool	closed;		/* nobody is reading it any more */
+	int	paused;		/* fetches paused for the queue to drain */
+};
+static struct outq stdout_q = { .fd = STDOUT_FILENO };
+#define OUTQ_HIGH	(1024 * 1024)
+#define OUTQ_LOW	(OUTQ_HIGH / 4)
+
+/* one --serve client: requests it has sent which have not been acted on
+ * yet, which are in_len octets at in, and the one being answered, if any.
+ */
+struct client {
+	struct client	*next;
+	int		fd;
+	u_long		serial;
+	char		*in;
+	size_t		in_len;
+	bool		eof;		/* it will send no more requests */
+	int		events;		/* what we are watching its fd for */
+	writer_t	writer;
+	struct outq	outq;
+};
+static client_t clients = NULL;
+static u_long clients_seen = 0;
+#define CLIENT_IN_MAX	65536
+
+/* the --serve listening socket, and what to do with each request. */
+static int serve_fd = -1;
+static char *serve_path = NULL;
+static serve_func_t serve_func = NULL;
+static volatile sig_atomic_t serve_stop = 0;
+
+/* the rate limiter: fetches waiting for it, in order; its token bucket;
+ * and when it reopens, if the server said to back off.
+ */
+static fetch_t gate_head = NULL, gate_tail = NULL;
+static double gate_tokens = 0.0;
+static long long gate_fill_ms = 0, gate_resume_ms = 0;
+static u_long gate_queued = 0, gate_throttled = 0;
+
+/* --streams auto: the limit on running fetches, which grows by about one
+ * for each limit's worth that succeed, while they are being held back by
+ * it, and halves when the server or the network shows strain.  a cut is
+ * felt only by fetches started after it, so those started before which
+ * show the same strain do not cut it again.
+ */
+#define AIMD_START	4.0
+#define AIMD_MIN	1.0
+#define AIMD_MAX	1024.0
+#define AIMD_DECREASE	0.5
+/* time to first byte is rising if it is more than twice its running
+ * average, once that has this many samples, and by more than some ms.
+ */
+#define AIMD_TTFB_SAMPLES	8
+#define AIMD_TTFB_SLACK_MS	20
+static double aimd_limit = AIMD_START, aimd_peak = AIMD_START;
+static double aimd_ttfb_avg = 0.0;
+static u_long aimd_ttfb_seen = 0, aimd_raises = 0;
+static long long aimd_cut_ms = 0;
+static bool aimd_adapted = false;
+
+/* why the limit was cut, and how often for each reason. */
+enum { aimd_throttled, aimd_server, aimd_timeout, aimd_slow, aimd_reasons };
+static struct {
+	const char	*name;
+	u_long		count;
+} aimd_cuts[aimd_reasons] = {
+	{ "throttled", 0 },
+	{ "server error", 0 },
+	{ "timeout", 0 },
+	{ "slower first byte", 0 },
+};
+
 const char saf_begin[] = "begin";
 const char saf_ongoing[] = "ongoing";
 const char saf_succeeded[] = "succeeded";
@@ -54,9 +348,15 @@ const char *saf_valid_conds[] = {
 };
 
 /* make_curl -- perform global initializations of libcurl.
+ *
+ * all of our easy handles share one DNS cache, TLS session cache, and
+ * connection pool, so that each fetch after the first to a given server
+ * can skip the name lookup and the TLS handshake.
  */
 void
 make_curl(void) {
+	int i;
+
 	curl_global_init(CURL_GLOBAL_DEFAULT);
 	curl_cleanup_needed = true;
 	multi = curl_multi_init();
@@ -64,58 +364,273 @@ make_curl(void) {
 		my_logf("curl_multi_init() failed");
 		my_exit(1);
 	}
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+
+	/* with --http2, fetches to a server run as streams on as few
+	 * connections as will hold them, rather than one on each.
+	 */
+	if (http2 && (curl_version_info(CURLVERSION_NOW)->features &
+		      CURL_VERSION_HTTP2) == 0)
+	{
+		my_logf("warning: libcurl lacks HTTP/2, using HTTP/1.1");
+		http2 = false;
+	}
+	curl_multi_setopt(multi, CURLMOPT_PIPELINING,
+			  http2 ? (long)CURLPIPE_MULTIPLEX
+			  : (long)CURLPIPE_NOTHING);
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7,67,0)
+	if (http2)
+		curl_multi_setopt(multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+				  http2_streams);
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
+#ifdef __linux__
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		my_panic(true, "epoll_create1");
+#endif
+	share = curl_share_init();
+	if (share == NULL) {
+		my_logf("curl_share_init() failed");
+		my_exit(1);
+	}
+	/* the prewarm thread, if any, uses the share concurrently. */
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++)
+		pthread_mutex_init(&share_locks[i], NULL);
+	curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+	curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7,57,0)
+	curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
+	outq_init();
 }
 
 /* unmake_curl -- clean up and discard libcurl's global state.
  */
 void
 unmake_curl(void) {
+	if (prewarm_easy != NULL) {
+		atomic_store(&prewarm_abort, true);
+		prewarm_finish();
+	}
+	work_fini();
+	outq_fini(&stdout_q);
+	sindex_free(&deblock_ix);
+	if (conns_new + conns_reused != 0) {
+		DEBUG(1, true, "connections: %lu new, %lu reused\n",
+		      conns_new, conns_reused);
+		conns_new = conns_reused = 0;
+	}
+	if (fetches_http2 + fetches_http1 != 0) {
+		DEBUG(1, true, "http2: %lu fetches as HTTP/2, %lu as HTTP/1\n",
+		      fetches_http2, fetches_http1);
+		fetches_http2 = fetches_http1 = 0;
+	}
+	if (gate_queued + gate_throttled != 0) {
+		DEBUG(1, true, "rate limiter: %lu queued, %lu throttled\n",
+		      gate_queued, gate_throttled);
+		gate_queued = gate_throttled = 0;
+	}
+	if (hedges_issued != 0) {
+		DEBUG(1, true, "hedging: %lu of %lu fetches hedged,"
+		      " %lu hedges won\n",
+		      hedges_issued, fetches_admitted, hedges_won);
+		hedges_issued = hedges_won = fetches_admitted = 0;
+	}
+	while (lost_fetches != NULL)
+		lost_reap(lost_fetches);
+	if (aimd_adapted) {
+		int i;
+
+		DEBUG(1, true, "adaptive streams: limit %ld (peak %ld),"
+		      " raised %lu times\n",
+		      streams_limit(), (long)aimd_peak, aimd_raises);
+		for (i = 0; i < aimd_reasons; i++) {
+			if (aimd_cuts[i].count != 0)
+				DEBUG(1, true, "adaptive streams: cut %lu"
+				      " times for %s\n",
+				      aimd_cuts[i].count, aimd_cuts[i].name);
+			aimd_cuts[i].count = 0;
+		}
+		aimd_raises = 0;
+		aimd_adapted = false;
+	}
 	if (multi != NULL) {
 		curl_multi_cleanup(multi);
 		multi = NULL;
 	}
+#ifdef __linux__
+	if (epfd != -1) {
+		close(epfd);
+		epfd = -1;
+	}
+#endif
+	DESTROY(watches);
+	watches_size = 0;
+	while (easy_pooled > 0)
+		curl_easy_cleanup(easy_pool[--easy_pooled]);
+	if (share != NULL) {
+		curl_share_cleanup(share);
+		share = NULL;
+	}
 	if (curl_cleanup_needed) {
 		curl_global_cleanup();
 		curl_cleanup_needed = false;
 	}
 }
 
-/* fetch -- given a url, tell libcurl to go fetch it.
+/* prewarm_start -- begin resolving, connecting, and handshaking with a
+ * server in the background, so that the first fetch finds it ready.
+ */
+void
+prewarm_start(const char *url) {
+	int x;
+
+	assert(prewarm_easy == NULL);
+	DEBUG(1, true, "prewarm(%s)\n", url);
+	prewarm_easy = easy_get();
+	easy_common(prewarm_easy);
+	if (curl_timeout == 0L || curl_timeout > PREWARM_TIMEOUT) {
+		curl_easy_setopt(prewarm_easy, CURLOPT_CONNECTTIMEOUT,
+				 PREWARM_TIMEOUT);
+		curl_easy_setopt(prewarm_easy, CURLOPT_TIMEOUT,
+				 PREWARM_TIMEOUT);
+	}
+	curl_easy_setopt(prewarm_easy, CURLOPT_URL, url);
+	easy_http(prewarm_easy, url);
+	curl_easy_setopt(prewarm_easy, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(prewarm_easy, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(prewarm_easy, CURLOPT_XFERINFOFUNCTION,
+			 prewarm_progress);
+	x = pthread_create(&prewarm_thread, NULL, prewarm_main, prewarm_easy);
+	if (x != 0) {
+		/* not fatal; the first fetch will just do this itself. */
+		DEBUG(1, true, "prewarm: pthread_create: %s\n", strerror(x));
+		easy_put(prewarm_easy);
+		prewarm_easy = NULL;
+		return;
+	}
+	prewarm_url = strdup(url);
+}
+
+/* prewarm_check -- abandon a prewarm if, now that configuration is read,
+ * the server it guessed (url) is not the one that will be used.
+ */
+void
+prewarm_check(const char *url) {
+	if (prewarm_easy == NULL)
+		return;
+	if (url != NULL && prewarm_url != NULL &&
+	    strcmp(url, prewarm_url) == 0)
+		return;
+	DEBUG(1, true, "prewarm(%s) abandoned for %s\n",
+	      prewarm_url, or_else(url, "no server"));
+	atomic_store(&prewarm_abort, true);
+}
+
+/* prewarm_finish -- wait for a prewarm to complete.
  */
 void
+prewarm_finish(void) {
+	if (prewarm_easy == NULL)
+		return;
+	pthread_join(prewarm_thread, NULL);
+	DEBUG(1, true, "prewarm done: %s\n",
+	      curl_easy_strerror(prewarm_result));
+	easy_put(prewarm_easy);
+	prewarm_easy = NULL;
+	DESTROY(prewarm_url);
+}
+
+/* fetch -- given a url, tell libcurl to go fetch it.
+ */
+fetch_t
 create_fetch(query_t query, char *url) {
 	fetch_t fetch = NULL;
-	CURLMcode res;
 
 	DEBUG(2, true, "fetch(%s)\n", url);
 	CREATE(fetch, sizeof *fetch);
+	if (query->start_ms == 0)
+		query->start_ms = mono_ms();
 	fetch->query = query;
-	query = NULL;
-	fetch->easy = curl_easy_init();
-	if (fetch->easy == NULL) {
-		/* an error will have been output by libcurl in this case. */
-		DESTROY(fetch);
-		DESTROY(url);
-		my_exit(1);
-	}
 	fetch->url = url;
 	url = NULL;
-	curl_easy_setopt(fetch->easy, CURLOPT_URL, fetch->url);
-	if (donotverify) {
-		curl_easy_setopt(fetch->easy, CURLOPT_SSL_VERIFYPEER, 0L);
-		curl_easy_setopt(fetch->easy, CURLOPT_SSL_VERIFYHOST, 0L);
+	fetch->next = query->fetches;
+	query->fetches = fetch;
+	fetch_start(fetch);
+	return fetch;
+}
+
+/* fetch_start -- give a fetch's url to libcurl, anew if retrying, once
+ * the rate limiter allows.  fetches it holds back start in arrival order.
+ */
+static void
+fetch_start(fetch_t fetch) {
+	if (gate_head != NULL || !gate_pass()) {
+		fetch->gate_next = NULL;
+		if (gate_head == NULL)
+			gate_head = fetch;
+		else
+			gate_tail->gate_next = fetch;
+		gate_tail = fetch;
+		fetch->gated = true;
+		fetches_waiting++;
+		gate_queued++;
+		return;
 	}
+	fetch_admit(fetch);
+}
 
-	/* if user specified a prefence for IPv4 or IPv6, use it. */
-	if (curl_ipresolve != CURL_IPRESOLVE_WHATEVER)
-		curl_easy_setopt(fetch->easy,
-				 CURLOPT_IPRESOLVE, curl_ipresolve);
+/* fetch_admit -- give a fetch's url to libcurl now.
+ */
+static void
+fetch_admit(fetch_t fetch) {
+	CURLMcode res;
 
-	if (curl_timeout != 0L) {
-		curl_easy_setopt(fetch->easy,
-				 CURLOPT_CONNECTTIMEOUT, curl_timeout);
-		curl_easy_setopt(fetch->easy,
-				 CURLOPT_TIMEOUT, curl_timeout);
+	/* a finished prewarm has left its connection in the shared pool.
+	 * one still connecting is not waited for; it will leave its
+	 * connection there when it is done, for whichever fetch is next.
+	 */
+	if (atomic_load(&prewarm_done))
+		prewarm_finish();
+
+	fetch->easy = easy_get();
+	easy_common(fetch->easy);
+	if (replay_dir != NULL) {
+		/* libcurl reads the recorded body instead of the server. */
+		fetch->rec = replay_start(fetch->url, &fetch->rcode);
+		if (fetch->rec != NULL) {
+			curl_easy_setopt(fetch->easy, CURLOPT_URL,
+					 replay_url(fetch->rec));
+		} else {
+			my_logf("warning: no recording of %s", fetch->url);
+			exit_code = 1;
+			fetch->stopped = true;
+			curl_easy_setopt(fetch->easy, CURLOPT_URL,
+					 "file:///dev/null/");
+		}
+	} else {
+		if (cache_dir != NULL)
+			fetch->cache = cache_start(fetch->url);
+		if (fetch->cache != NULL && cache_hit(fetch->cache)) {
+			/* libcurl reads the cached body instead. */
+			curl_easy_setopt(fetch->easy, CURLOPT_URL,
+					 cache_url(fetch->cache));
+			curl_easy_setopt(fetch->easy, CURLOPT_RESUME_FROM_LARGE,
+					 cache_skip(fetch->cache));
+			fetch->rcode = HTTP_OK;
+		} else {
+			curl_easy_setopt(fetch->easy, CURLOPT_URL, fetch->url);
+			easy_http(fetch->easy, fetch->url);
+			if (record_dir != NULL)
+				fetch->rec = record_start(fetch->url);
+		}
 	}
 
 	if (psys->auth != NULL)
@@ -126,17 +641,12 @@ create_fetch(query_t query, char *url) {
 	curl_easy_setopt(fetch->easy, CURLOPT_WRITEFUNCTION, writer_func);
 	curl_easy_setopt(fetch->easy, CURLOPT_WRITEDATA, fetch);
 	curl_easy_setopt(fetch->easy, CURLOPT_PRIVATE, fetch);
-#ifdef CURL_AT_LEAST_VERSION
-/* If CURL_AT_LEAST_VERSION is not defined then the curl is probably too old */
-#if CURL_AT_LEAST_VERSION(7,42,0)
-	/* do not allow curl to swallow /./ and /../ in our URLs */
-	curl_easy_setopt(fetch->easy, CURLOPT_PATH_AS_IS, 1L);
-#endif
-#endif /* CURL_AT_LEAST_VERSION */
-	if (debug_level >= 3)
-		curl_easy_setopt(fetch->easy, CURLOPT_VERBOSE, 1L);
-
-	fetch->query->fetch = fetch;
+	/* "" offers every encoding this libcurl can decode. */
+	if (compression)
+		curl_easy_setopt(fetch->easy, CURLOPT_ACCEPT_ENCODING, "");
+	fetch->active_ms = fetch->admit_ms = mono_ms();
+	if (!fetch->is_hedge)
+		fetches_admitted++;
 
 	res = curl_multi_add_handle(multi, fetch->easy);
 	if (res != CURLM_OK) {
@@ -144,53 +654,437 @@ create_fetch(query_t query, char *url) {
 			curl_multi_strerror(res));
 		my_exit(1);
 	}
+	multi_inflight++;
+}
+
+/* fetch_url -- make the url for what a fetch has yet to output.
+ */
+static char *
+fetch_url(fetch_t fetch) {
+	query_t query = fetch->query;
+	struct qdesc qd = query->qd;
+	char *url;
+
+	/* resume after the results already output, asking for fewer. */
+	qd.offset = fetch->offset + fetch->count;
+	if (qd.query_limit > 0)
+		qd.query_limit -= fetch->count;
+	url = psys->url(query->command, NULL, &qd, &fetch->fence);
+	if (url == NULL)
+		my_exit(1);
+	DEBUG(1, true, "url [%s]\n", url);
+	return url;
+}
+
+/* launch_fetch -- fetch the part of a query that lies within a time fence,
+ * starting at some offset into the results.
+ */
+fetch_t
+launch_fetch(query_t query, pdns_fence_ct fp, long offset) {
+	struct fetch proto = { .query = query, .fence = *fp, .offset = offset };
+	fetch_t fetch;
+
+	fetch = create_fetch(query, fetch_url(&proto));
+	fetch->fence = *fp;
+	fetch->offset = offset;
+	return (fetch);
 }
 
 /* fetch_reap -- reap one fetch.
  */
 static void
 fetch_reap(fetch_t fetch) {
+	work_sync(fetch);
 	if (fetch->easy != NULL) {
 		curl_multi_remove_handle(multi, fetch->easy);
-		curl_easy_cleanup(fetch->easy);
+		easy_put(fetch->easy);
 		fetch->easy = NULL;
 	}
 	if (fetch->hdrs != NULL) {
 		curl_slist_free_all(fetch->hdrs);
 		fetch->hdrs = NULL;
 	}
+	if (fetch->rec != NULL) {
+		record_end(fetch->rec, fetch->rcode, "cancelled");
+		fetch->rec = NULL;
+	}
+	if (fetch->cache != NULL) {
+		cache_end(fetch->cache, false);
+		fetch->cache = NULL;
+	}
+	if (fetch->twin != NULL) {
+		fetch->twin->twin = NULL;
+		fetch->twin = NULL;
+	}
+	tuple_set_free(fetch->seen);
 	DESTROY(fetch->url);
 	DESTROY(fetch->buf);
+	DESTROY(fetch->saf_msg);
 	DESTROY(fetch);
 }
 
+/* share_lock -- lock one kind of data in the curl share.
+ */
+static void
+share_lock(CURL *easy __attribute__ ((unused)),
+	   curl_lock_data data,
+	   curl_lock_access access __attribute__ ((unused)),
+	   void *userptr __attribute__ ((unused)))
+{
+	pthread_mutex_lock(&share_locks[data]);
+}
+
+/* share_unlock -- unlock one kind of data in the curl share.
+ */
+static void
+share_unlock(CURL *easy __attribute__ ((unused)),
+	     curl_lock_data data,
+	     void *userptr __attribute__ ((unused)))
+{
+	pthread_mutex_unlock(&share_locks[data]);
+}
+
+/* easy_get -- get an easy handle, reusing an idle one if possible.
+ */
+static CURL *
+easy_get(void) {
+	CURL *easy;
+
+	if (easy_pooled > 0)
+		return easy_pool[--easy_pooled];
+	easy = curl_easy_init();
+	if (easy == NULL) {
+		/* an error will have been output by libcurl in this case. */
+		my_exit(1);
+	}
+	return easy;
+}
+
+/* easy_put -- return an easy handle for reuse, or destroy it.
+ */
+static void
+easy_put(CURL *easy) {
+	if (easy_pooled == EASY_POOL_MAX) {
+		curl_easy_cleanup(easy);
+		return;
+	}
+	curl_easy_reset(easy);
+	easy_pool[easy_pooled++] = easy;
+}
+
+/* easy_common -- set the options every one of our easy handles needs.
+ */
+static void
+easy_common(CURL *easy) {
+	curl_easy_setopt(easy, CURLOPT_SHARE, share);
+	if (donotverify) {
+		curl_easy_setopt(easy, CURLOPT_SSL_VERIFYPEER, 0L);
+		curl_easy_setopt(easy, CURLOPT_SSL_VERIFYHOST, 0L);
+	}
+
+	/* if user specified a prefence for IPv4 or IPv6, use it. */
+	if (curl_ipresolve != CURL_IPRESOLVE_WHATEVER)
+		curl_easy_setopt(easy, CURLOPT_IPRESOLVE, curl_ipresolve);
+
+	if (curl_timeout != 0L) {
+		curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, curl_timeout);
+		curl_easy_setopt(easy, CURLOPT_TIMEOUT, curl_timeout);
+	}
+#ifdef CURL_AT_LEAST_VERSION
+/* If CURL_AT_LEAST_VERSION is not defined then the curl is probably too old */
+#if CURL_AT_LEAST_VERSION(7,42,0)
+	/* do not allow curl to swallow /./ and /../ in our URLs */
+	curl_easy_setopt(easy, CURLOPT_PATH_AS_IS, 1L);
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
+	if (debug_level >= 3)
+		curl_easy_setopt(easy, CURLOPT_VERBOSE, 1L);
+}
+
+/* easy_http -- choose the HTTP version for an easy handle's URL.
+ *
+ * over TLS, HTTP/2 is offered and HTTP/1.1 is used if the server does
+ * not take it up.  cleartext has no such negotiation, so there HTTP/2 is
+ * assumed.  a fetch waits for a connection which is still being set up
+ * to learn whether it can take another stream, rather than open its own.
+ */
+static void
+easy_http(CURL *easy, const char *url) {
+	if (!http2) {
+		curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+				 (long)CURL_HTTP_VERSION_1_1);
+		return;
+	}
+	curl_easy_setopt(easy, CURLOPT_HTTP_VERSION,
+			 strncasecmp(url, "http:", 5) == 0
+			 ? (long)CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE
+			 : (long)CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(easy, CURLOPT_PIPEWAIT, 1L);
+}
+
+/* prewarm_main -- body of the prewarm thread.
+ */
+static void *
+prewarm_main(void *arg) {
+	prewarm_result = curl_easy_perform((CURL *)arg);
+	atomic_store(&prewarm_done, true);
+	return NULL;
+}
+
+/* prewarm_progress -- let a prewarm be abandoned if we are exiting.
+ */
+static int
+prewarm_progress(void *clientp __attribute__ ((unused)),
+		 curl_off_t dltotal __attribute__ ((unused)),
+		 curl_off_t dlnow __attribute__ ((unused)),
+		 curl_off_t ultotal __attribute__ ((unused)),
+		 curl_off_t ulnow __attribute__ ((unused)))
+{
+	return atomic_load(&prewarm_abort) ? 1 : 0;
+}
+
+/* fetch_bisect -- replace a limited fetch by two covering halves of its
+ * time_first range.  Returns false if the range cannot be split further.
+ */
+static bool
+fetch_bisect(fetch_t fetch) {
+	query_t query = fetch->query;
+	pdns_fence_t lower = fetch->fence, upper = fetch->fence;
+	u_long lo, hi, mid;
+	fetch_t part;
+
+	/* a server limiting every part would have us split without end. */
+	if (fetch->splits >= BISECT_SPLITS) {
+		if (!query->split_out)
+			my_logf("warning: %s still limited after %d splits",
+				query->command, BISECT_SPLITS);
+		query->split_out = true;
+		return false;
+	}
+
+	/* time_first lies after lo and before hi. */
+	lo = fetch->fence.first_after;
+	hi = fetch->fence.first_before;
+	if (hi == 0)
+		hi = (u_long)startup_time.tv_sec + 1;
+	if (fetch->fence.last_before != 0 && fetch->fence.last_before < hi)
+		hi = fetch->fence.last_before;
+	if (hi <= lo || hi - lo < 3)
+		return false;
+	mid = lo + (hi - lo) / 2;
+
+	/* (lo .. mid] and (mid .. hi), so each half is narrower. */
+	lower.first_before = mid + 1;
+	upper.first_after = mid;
+	DEBUG(1, true, "bisect(%s) %lu .. %lu .. %lu\n",
+	      query->command, lo, mid, hi);
+	part = launch_fetch(query, &lower, fetch->offset);
+	part->splits = fetch->splits + 1;
+	part->seen = tuple_set_new(fetch->seen);
+	part = launch_fetch(query, &upper, fetch->offset);
+	part->splits = fetch->splits + 1;
+	part->seen = tuple_set_new(fetch->seen);
+	return true;
+}
+
+/* fetch_paginate -- after a page is output, keep the pages in flight
+ * topped up.  Returns false if this was the last page.
+ */
+static bool
+fetch_paginate(fetch_t fetch) {
+	query_t query = fetch->query;
+	fetch_t later;
+
+	/* a full page means there may be more; a short one, that there are
+	 * not, or that the server limits pages to fewer results than -l.
+	 */
+	if (fetch->count >= query->qd.query_limit &&
+	    (fetch->saf_cond == sc_succeeded || fetch->saf_cond == sc_limited))
+	{
+		later = launch_fetch(query, &fetch->fence, query->next_offset);
+		later->held = true;
+		query->next_offset += query->qd.query_limit;
+		return true;
+	}
+
+	/* pages prefetched beyond the last one are of no use. */
+	while ((later = query->fetches) != NULL && later != fetch)
+		fetch_cancel(later);
+	while ((later = fetch->next) != NULL)
+		fetch_cancel(later);
+	return false;
+}
+
 /* fetch_done -- deal with consequences of end-of-fetch.
+ *
+ * When bisecting, a fetch the server limited is replaced by two narrower
+ * ones.  Otherwise its SAF condition becomes the query's, unless the query
+ * already has one worse than success.
  */
 static void
 fetch_done(fetch_t fetch) {
 	query_t query = fetch->query;
 
+	/* a page released by fetch_finish() may still be with the workers. */
+	work_sync(fetch);
+
+	/* only a complete result stream is worth caching. */
+	if (fetch->cache != NULL) {
+		cache_end(fetch->cache, fetch->rcode == HTTP_OK &&
+			  fetch->saf_cond == sc_succeeded);
+		fetch->cache = NULL;
+	}
+	if (query->writer->outq->closed) {
+		/* launch nothing more. */
+	} else if (bisect && fetch->saf_cond == sc_limited &&
+		   fetch_bisect(fetch))
+	{
+		return;
+	} else if (paginate > 0 && fetch_paginate(fetch)) {
+		return;
+	}
+	switch (query->saf_cond) {
+	case sc_init:
+	case sc_begin:
+	case sc_ongoing:
+	case sc_succeeded:
+		query->saf_cond = fetch->saf_cond;
+		DESTROY(query->saf_msg);
+		query->saf_msg = fetch->saf_msg;
+		fetch->saf_msg = NULL;
+		break;
+	case sc_limited:
+	case sc_failed:
+	case sc_we_limited:
+	case sc_missing:
+		break;
+	}
+}
+
+/* fetch_cancel -- abandon a fetch whose results will not be wanted.
+ */
+static void
+fetch_cancel(fetch_t fetch) {
+	DEBUG(2, true, "fetch_cancel(%s)\n", fetch->url);
+	if (fetch->gated) {
+		fetch_t *pf, prev = NULL;
+
+		for (pf = &gate_head; *pf != fetch; pf = &(*pf)->gate_next)
+			prev = *pf;
+		*pf = fetch->gate_next;
+		if (gate_tail == fetch)
+			gate_tail = prev;
+		fetches_waiting--;
+	} else if (fetch->retry_ms != 0) {
+		fetches_waiting--;
+	} else if (fetch->easy != NULL) {
+		multi_inflight--;
+	}
+	fetch_unlink(fetch);
+	fetch_reap(fetch);
+}
+
+/* fetch_finish -- a fetch's output is complete, so let the query go on.
+ *
+ * when paginating, this can release the next page, which may itself be
+ * complete already.  when no fetches remain, the query is over.
+ */
+static void
+fetch_finish(fetch_t fetch) {
+	query_t query = fetch->query;
+
+	for (;;) {
+		fetch_done(fetch);
+		fetch_unlink(fetch);
+		fetch_reap(fetch);
+
+		/* the next page in order, if any, can now be output. */
+		if ((fetch = page_next(query)) == NULL)
+			break;
+		fetch->held = false;
+		(void) fetch_deblock(fetch);
+		if (!fetch->done)
+			break;
+
+		/* only now is it known whether its stream ended early. */
+		work_sync(fetch);
+		if (!query->writer->outq->closed &&
+		    fetch_retry(fetch, CURLE_OK))
+			break;
+	}
+
+	/* the query is over when its last fetch is. */
+	if (query->fetches != NULL)
+		return;
+
+	/* record emptiness as status if nothing else. */
+	if (query->writer != NULL &&
+	    query->writer->count == 0 && !query->raw_results &&
+	    query->status == NULL)
+	{
+		query_status(query,
+			     status_noerror,
+			     "no results found for query.");
+	}
 	query_done(query);
+
+	/* a batch query's output is complete now. */
+	if (batching)
+		writer_fini(query->writer);
+}
+
+/* page_next -- find the page to output next, once no earlier page remains.
+ */
+static fetch_t
+page_next(query_t query) {
+	fetch_t fetch, next = NULL;
+
+	for (fetch = query->fetches; fetch != NULL; fetch = fetch->next) {
+		if (!fetch->held)
+			return NULL;
+		if (next == NULL || fetch->offset < next->offset)
+			next = fetch;
+	}
+	return next;
 }
 
-/* fetch_unlink -- disconnect a fetch from its writer.
+/* fetch_unlink -- disconnect a fetch from its query.
  */
 static void
 fetch_unlink(fetch_t fetch) {
-	assert(fetch == fetch->query->fetch);
-	fetch->query->fetch = NULL;
+	fetch_t *pf;
+
+	for (pf = &fetch->query->fetches; *pf != fetch; pf = &(*pf)->next)
+		assert(*pf != NULL);
+	*pf = fetch->next;
+	fetch->next = NULL;
 	fetch->query = NULL;
 }
 
 /* writer_init -- instantiate a writer
+ *
+ * descr is non-NULL when batching, and tags the output.  if held, the
+ * output is kept in memory until writer_fini(), so that it will not be
+ * interleaved with the output of other writers.
  */
 writer_t
-writer_init(long output_limit) {
+writer_init(long output_limit, const char *descr, bool held) {
 	writer_t writer = NULL;
 
 	CREATE(writer, sizeof(struct writer));
 	writer->output_limit = output_limit;
+	if (descr != NULL)
+		writer->descr = strdup(descr);
+	writer->held = held;
+	writer->outq = &stdout_q;
+	writer->out = open_memstream(&writer->out_buf, &writer->out_len);
+	if (writer->out == NULL)
+		my_panic(true, "open_memstream");
+	if (writer->descr != NULL)
+		fprintf(writer->out, "++ %s\n", writer->descr);
 
+	writer->next = writers;
+	writers = writer;
 	return (writer);
 }
 
@@ -214,32 +1108,112 @@ query_status(query_t query, const char *status, const char *message) {
  */
 size_t
 writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
-	fetch_t fetch = (fetch_t) blob;
+	fetch_t fetch = (fetch_t) blob, twin;
 	query_t query = fetch->query;
-	writer_t writer = query->writer;
 	size_t bytes = size * nmemb;
-	char *nl;
+	struct outq *q;
 
 	DEBUG(3, true, "writer_func(%d, %d): %d\n",
 	      (int)size, (int)nmemb, (int)bytes);
 
-	fetch->buf = realloc(fetch->buf, fetch->len + bytes);
-	memcpy(fetch->buf + fetch->len, ptr, bytes);
-	fetch->len += bytes;
+	/* one of a hedged pair which lost the race goes no further. */
+	if (fetch->lost)
+		return 0;
+	q = query->writer->outq;
+	if (fetch->first_ms == 0) {
+		fetch->first_ms = mono_ms();
+		if (replay_dir == NULL &&
+		    (fetch->cache == NULL || !cache_hit(fetch->cache)))
+		{
+			ttfb_note(fetch->first_ms - fetch->admit_ms);
+			if (max_streams < 0)
+				aimd_ttfb(fetch,
+					  fetch->first_ms - fetch->admit_ms);
+		}
+		if (fetch->twin != NULL) {
+			DEBUG(1, true, "hedge: %s won\n",
+			      fetch->is_hedge ? "hedge" : "original");
+			if (fetch->is_hedge)
+				hedges_won++;
+			/* libcurl cannot be told from here, so the loser
+			 * leaves its query now and is reaped later.
+			 */
+			twin = fetch->twin;
+			twin->twin = NULL;
+			fetch->twin = NULL;
+			twin->lost = true;
+			twin->stopped = true;
+			fetch_unlink(twin);
+			twin->next = lost_fetches;
+			lost_fetches = twin;
+		}
+	}
 
-	/* when the fetch is a live web result, emit
-	 * !2xx errors and info payloads as reports.
+	/* if our output is slow, wait for it; if nobody reads it, stop.
+	 * libcurl cannot pause a file:// transfer, so a replay or a cache
+	 * hit blocks.
 	 */
-	if (fetch->easy != NULL) {
-		if (fetch->rcode == 0)
-			curl_easy_getinfo(fetch->easy,
-					  CURLINFO_RESPONSE_CODE,
-					  &fetch->rcode);
-		if (fetch->rcode != HTTP_OK) {
-			char *message = strndup(fetch->buf, fetch->len);
+	if (q->len >= OUTQ_HIGH) {
+		if (replay_dir == NULL &&
+		    (fetch->cache == NULL || !cache_hit(fetch->cache)))
+		{
+			DEBUG(2, true, "output queue full, pausing fetch\n");
+			fetch->paused = true;
+			q->paused++;
+			return CURL_WRITEFUNC_PAUSE;
+		}
+		outq_flush(q, true);
+	}
+	if (q->closed) {
+		fetch->stopped = true;
+		return 0;
+	}
 
-			/* only report the first line of data. */
-			char *eol = strpbrk(message, "\r\n");
+	if (fetch->rec != NULL) {
+		if (record_dir != NULL) {
+			record_chunk(fetch->rec, ptr, bytes);
+		} else if (replay_paced) {
+			/* wait until the recording had these octets. */
+			long wait;
+
+			while ((wait = replay_wait(fetch->rec, bytes)) > 0)
+				(void) poll(NULL, 0, (int)wait);
+		}
+	}
+	if (fetch->cache != NULL && !cache_hit(fetch->cache))
+		cache_write(fetch->cache, ptr, bytes);
+
+	query->body_bytes += (curl_off_t)bytes;
+
+	/* any complete line, even a COF keepalive, shows the stream lives. */
+	if (stall_timeout > 0 && memchr(ptr, '\n', bytes) != NULL)
+		fetch->active_ms = mono_ms();
+
+	if (fetch->easy != NULL && fetch->rcode == 0)
+		curl_easy_getinfo(fetch->easy, CURLINFO_RESPONSE_CODE,
+				  &fetch->rcode);
+
+	/* --raw results are output from where libcurl put them. */
+	if (raw_output && !fetch->held &&
+	    (fetch->easy == NULL || fetch->rcode == HTTP_OK))
+		return fetch_raw(fetch, ptr, bytes) ? bytes : 0;
+	fetch_append(fetch, ptr, bytes);
+
+	/* when the fetch is a live web result, emit
+	 * !2xx errors and info payloads as reports.
+	 */
+	if (fetch->easy != NULL) {
+		/* a throttled fetch will be tried again, so say nothing. */
+		if (fetch_throttled(fetch)) {
+			fetch_empty(fetch);
+			return (bytes);
+		}
+		if (fetch->rcode != HTTP_OK) {
+			char *message = strndup(fetch->buf + fetch->start,
+						fetch->len);
+
+			/* only report the first line of data. */
+			char *eol = strpbrk(message, "\r\n");
 			if (eol != NULL)
 				*eol = '\0';
 
@@ -274,52 +1248,569 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 				my_logf("warning: libcurl: [%s]",
 					message);
 			DESTROY(message);
-			fetch->buf[0] = '\0';
-			fetch->len = 0;
+			fetch_empty(fetch);
 			return (bytes);
 		}
 	}
 
-	/* deblock. */
-	while ((nl = memchr(fetch->buf, '\n', fetch->len)) != NULL) {
-		size_t pre_len = (size_t)(nl - fetch->buf),
-			post_len = (fetch->len - pre_len) - 1;
+	/* a page that is not yet due for output is only buffered. */
+	if (!fetch->held && !fetch_deblock(fetch))
+		bytes = 0;
 
-		if (writer->output_limit > 0 &&
-		    writer->count >= writer->output_limit)
-		{
-			DEBUG(9, true, "hit output limit %ld\n",
-			      writer->output_limit);
-			/* cause CURLE_WRITE_ERROR for this transfer. */
-			bytes = 0;
-			query->saf_cond = sc_we_limited;
-			/* inform io_engine() that the abort is intentional. */
+	return (bytes);
+}
+
+/* fetch_append -- add a chunk of a response to a fetch's buffer.
+ *
+ * the buffer is compacted at most once per chunk, and only grows when a
+ * line too long for it is still incomplete.
+ */
+static void
+fetch_append(fetch_t fetch, const char *ptr, size_t bytes) {
+	if (fetch->start + fetch->len + bytes > fetch->size) {
+		if (fetch->start != 0) {
+			memmove(fetch->buf, fetch->buf + fetch->start,
+				fetch->len);
+			fetch->start = 0;
+		}
+		if (fetch->len + bytes > fetch->size) {
+			size_t size = fetch->size != 0
+				? fetch->size : FETCH_BUF_SIZE;
+			char *buf;
+
+			while (size < fetch->len + bytes)
+				size *= 2;
+			buf = realloc(fetch->buf, size);
+			if (buf == NULL)
+				my_panic(true, "realloc");
+			fetch->buf = buf;
+			fetch->size = size;
+		}
+	}
+	memcpy(fetch->buf + fetch->start + fetch->len, ptr, bytes);
+	fetch->len += bytes;
+}
+
+/* fetch_empty -- forget what a fetch has buffered.
+ */
+static void
+fetch_empty(fetch_t fetch) {
+	fetch->start = fetch->len = fetch->scan = 0;
+}
+
+/* fetch_deblock -- process each complete line a fetch has buffered.
+ *
+ * returns false if the fetch should be aborted.
+ */
+static bool
+fetch_deblock(fetch_t fetch) {
+	query_t query = fetch->query;
+	writer_t writer = query->writer;
+	size_t from = fetch->start + fetch->scan, end = 0, at = 0, nl;
+	bool more = true;
+
+	/* with --workers, the lines are parsed and presented elsewhere. */
+	if (parse_workers > 0 && work_submit(fetch))
+		return true;
+
+	/* index what is new in one pass, and take each line's end from the
+	 * newlines found there.  a line begun before what is new is not
+	 * wholly covered, so tuple_make() indexes that one by itself.
+	 */
+	if (fetch->scan < fetch->len) {
+		end = fetch->len - fetch->scan;
+		sindex_build(&deblock_ix, fetch->buf + from, end);
+	}
+
+	/* hand each line to data_blob() where it lies in the buffer.  what
+	 * jansson allocates for them comes from an arena, taken back whole
+	 * at the next chunk.
+	 */
+	arena_begin();
+	while ((nl = sindex_next(deblock_ix.nl, at, end)) < end) {
+		char *line = fetch->buf + fetch->start;
+		size_t pre_len = from + nl - fetch->start;
+		sindex_ct ix = fetch->start >= from ? &deblock_ix : NULL;
+
+		if (!deblock_line(fetch, line, pre_len, ix))
+			more = false;
+		fetch->start += pre_len + 1;
+		fetch->len -= pre_len + 1;
+		fetch->scan = 0;
+		at = nl + 1;
+	}
+	arena_end();
+
+	/* what is left has no newline, so need not be searched again. */
+	fetch->scan = fetch->len;
+	if (fetch->len == 0)
+		fetch->start = 0;
+
+	writer_flush(writer);
+	return (more);
+}
+
+/* deblock_line -- process one complete line of a fetch, counting the
+ * results it held as the fetch's, its query's, and its writer's.
+ *
+ * returns false if the fetch should be aborted.
+ */
+static bool
+deblock_line(fetch_t fetch, const char *line, size_t len, sindex_ct ix) {
+	query_t query = fetch->query;
+	writer_t writer = query->writer;
+	int count;
+
+	if (writer->output_limit > 0 &&
+	    writer->count >= writer->output_limit)
+	{
+		DEBUG(9, true, "hit output limit %ld\n",
+		      writer->output_limit);
+		fetch->saf_cond = sc_we_limited;
+		/* inform io_engine() that the abort is intentional. */
+		fetch->stopped = true;
+		/* cause CURLE_WRITE_ERROR for this transfer. */
+		return false;
+	}
+
+	count = data_blob(fetch, line, len, ix);
+	fetch->count += count;
+	writer->count += count;
+	query->tuples += count;
+	query->lines++;
+
+	switch (fetch->saf_cond) {
+	case sc_init:
+	case sc_begin:
+	case sc_ongoing:
+	case sc_missing:
+		break;
+	case sc_succeeded:
+	case sc_limited:
+	case sc_failed:
+	case sc_we_limited:
+		/* inform io_engine() intentional abort. */
+		fetch->stopped = true;
+		break;
+	}
+	return true;
+}
+
+/* fetch_raw -- output a chunk of a --raw fetch as libcurl gave it.  only
+ * the fetch's first line and the last complete line of each chunk are
+ * looked at, for their SAF cond; a keepalive among the rest is taken to
+ * be results.  the unfinished line a chunk ends with is kept, in case
+ * the next chunk finishes it and nothing more.
+ *
+ * returns false if the fetch should be aborted.
+ */
+static bool
+fetch_raw(fetch_t fetch, const char *ptr, size_t bytes) {
+	query_t query = fetch->query;
+	const char *end = ptr + bytes, *nl, *last, *prev;
+
+	if (strip_saf)
+		return fetch_raw_strip(fetch, ptr, bytes);
+	writer_put(query->writer, ptr, bytes);
+	fetch->raw_out += bytes;
+
+	if ((nl = memchr(ptr, '\n', bytes)) == NULL) {
+		fetch_append(fetch, ptr, bytes);
+	} else {
+		last = memrchr(nl, '\n', (size_t)(end - nl));
+		if (!fetch->raw_begun || last == nl) {
+			fetch_append(fetch, ptr, (size_t)(nl - ptr));
+			(void) raw_note(fetch, fetch->buf + fetch->start,
+					fetch->len);
+			fetch->raw_begun = true;
+		}
+		if (last != nl) {
+			prev = memrchr(nl, '\n', (size_t)(last - nl));
+			(void) raw_note(fetch, prev + 1,
+					(size_t)(last - prev - 1));
+		}
+		fetch_empty(fetch);
+		fetch_append(fetch, last + 1, (size_t)(end - last - 1));
+	}
+	if (fetch->raw_out - fetch->len > fetch->raw_empty)
+		query->raw_results = true;
+	return !query->writer->outq->closed;
+}
+
+/* fetch_raw_strip -- output a chunk of a --raw --strip-saf fetch, less
+ * the lines carrying no results.  every line's start is looked at, but
+ * only those which do not start as results do are parsed.  a line split
+ * across chunks is kept until it is whole.
+ *
+ * returns false if the fetch should be aborted.
+ */
+static bool
+fetch_raw_strip(fetch_t fetch, const char *ptr, size_t bytes) {
+	query_t query = fetch->query;
+	writer_t writer = query->writer;
+	const char *end = ptr + bytes, *run = ptr, *line = ptr, *nl;
+
+	/* finish the line an earlier chunk began, if any. */
+	if (fetch->len != 0) {
+		if ((nl = memchr(ptr, '\n', bytes)) == NULL) {
+			fetch_append(fetch, ptr, bytes);
+			return true;
+		}
+		fetch_append(fetch, ptr, (size_t)(nl + 1 - ptr));
+		if (!raw_note(fetch, fetch->buf + fetch->start,
+			      fetch->len - 1))
+			writer_put(writer, fetch->buf + fetch->start,
+				   fetch->len);
+		fetch_empty(fetch);
+		run = line = nl + 1;
+	}
+
+	/* output each run of lines with results in one go. */
+	while ((nl = memchr(line, '\n', (size_t)(end - line))) != NULL) {
+		if (raw_note(fetch, line, (size_t)(nl - line))) {
+			writer_put(writer, run, (size_t)(line - run));
+			run = nl + 1;
+		}
+		line = nl + 1;
+	}
+	writer_put(writer, run, (size_t)(line - run));
+	fetch_append(fetch, line, (size_t)(end - line));
+	return !writer->outq->closed;
+}
+
+/* raw_note -- look at a complete --raw line for its SAF cond, unless it
+ * starts as results do.  with --strip-saf, which sees every line, count
+ * it too.
+ *
+ * returns true if it carries no results.
+ */
+static bool
+raw_note(fetch_t fetch, const char *line, size_t len) {
+	static const char results[] = "{\"obj\":";
+	query_t query = fetch->query;
+
+	if (strip_saf)
+		query->lines++;
+	if (len == 0 ||
+	    ((len < sizeof results - 1 ||
+	      memcmp(line, results, sizeof results - 1) != 0) &&
+	     saf_line(fetch, line, len)))
+	{
+		fetch->raw_empty += len + 1;
+		switch (fetch->saf_cond) {
+		case sc_init:
+		case sc_begin:
+		case sc_ongoing:
+		case sc_missing:
+			break;
+		case sc_succeeded:
+		case sc_limited:
+		case sc_failed:
+		case sc_we_limited:
+			/* inform io_engine() intentional abort. */
 			fetch->stopped = true;
-		} else {
-			query->writer->count +=
-				data_blob(query, fetch->buf, pre_len);
-
-			switch (query->saf_cond) {
-			case sc_init:
-			case sc_begin:
-			case sc_ongoing:
-			case sc_missing:
-				break;
-			case sc_succeeded:
-			case sc_limited:
-			case sc_failed:
-			case sc_we_limited:
-				/* inform io_engine() intentional
-				 * abort. */
-				fetch->stopped = true;
-				break;
-			}
+			break;
 		}
-		memmove(fetch->buf, nl + 1, post_len);
-		fetch->len = post_len;
+		return true;
+	}
+	if (strip_saf) {
+		fetch->count++;
+		query->writer->count++;
+		query->tuples++;
+		query->raw_results = true;
+	}
+	return false;
+}
+
+/* writer_put -- output what was presented elsewhere, such as part of a
+ * --raw fetch's body, after whatever its writer has already presented,
+ * or behind it if the writer is held.
+ */
+static void
+writer_put(writer_t writer, const char *ptr, size_t len) {
+	if (len == 0)
+		return;
+	if (writer->held) {
+		fwrite(ptr, 1, len, writer->out);
+		return;
 	}
+	writer_flush(writer);
+	outq_direct(writer->outq, ptr, len);
+}
 
-	return (bytes);
+/* work_submit -- hand the complete lines a fetch has buffered to the
+ * workers, in batches to be output in turn by work_commit().
+ *
+ * returns false if they are to be processed here instead, as they are
+ * when an output limit is to be checked line by line.
+ */
+static bool
+work_submit(fetch_t fetch) {
+	if (fetch->query->writer->output_limit > 0) {
+		work_sync(fetch);
+		return false;
+	}
+	if (work_threads == NULL)
+		work_start();
+
+	for (;;) {
+		const char *buf = fetch->buf + fetch->start, *nl;
+		size_t len = fetch->len < WORK_BATCH ? fetch->len : WORK_BATCH,
+			scan = fetch->scan < len ? fetch->scan : len;
+
+		/* end the batch at the last newline that fits, or failing
+		 * that, at the end of a line too long to fit.
+		 */
+		nl = memrchr(buf + scan, '\n', len - scan);
+		if (nl == NULL && len < fetch->len)
+			nl = memchr(buf + len, '\n', fetch->len - len);
+		if (nl == NULL)
+			break;
+		len = (size_t)(nl - buf) + 1;
+		work_queue(fetch, buf, len);
+		fetch->start += len;
+		fetch->len -= len;
+		fetch->scan = 0;
+	}
+
+	/* what is left has no newline, so need not be searched again. */
+	fetch->scan = fetch->len;
+	if (fetch->len == 0)
+		fetch->start = 0;
+	return true;
+}
+
+/* work_queue -- make a batch of some complete lines of a fetch, and
+ * queue it for the workers, first outputting what they have done if
+ * too much is waiting for that.
+ */
+static void
+work_queue(fetch_t fetch, const char *buf, size_t len) {
+	struct batch *b = NULL;
+
+	while (work_depth >= parse_workers * WORK_DEPTH) {
+		work_stalls++;
+		(void) work_commit(true);
+	}
+
+	CREATE(b, sizeof *b);
+	b->fetch = fetch;
+	b->query = fetch->query;
+	b->lines = malloc(len);
+	if (b->lines == NULL)
+		my_panic(true, "malloc");
+	memcpy(b->lines, buf, len);
+	b->len = len;
+	b->w_fetch.query = &b->w_query;
+	b->w_query.writer = &b->w_writer;
+	b->w_writer.query = &b->w_query;
+	b->w_writer.held = true;
+	fetch->work_batches++;
+	work_batches++;
+
+	pthread_mutex_lock(&work_lock);
+	if (work_tail == NULL)
+		work_head = b;
+	else
+		work_tail->next = b;
+	work_tail = b;
+	if (work_next == NULL)
+		work_next = b;
+	work_depth++;
+	pthread_cond_signal(&work_todo);
+	pthread_mutex_unlock(&work_lock);
+}
+
+/* work_commit -- output the oldest batch, if the workers are done with
+ * it or (if wait) once they are, and count what it held as its fetch's.
+ *
+ * returns false if there was none to output.
+ */
+static bool
+work_commit(bool wait) {
+	struct batch *b;
+	fetch_t fetch;
+	query_t query;
+
+	pthread_mutex_lock(&work_lock);
+	while ((b = work_head) != NULL && !b->done && wait)
+		pthread_cond_wait(&work_done, &work_lock);
+	if (b != NULL && b->done) {
+		work_head = b->next;
+		if (work_head == NULL)
+			work_tail = NULL;
+		work_depth--;
+	} else {
+		b = NULL;
+	}
+	pthread_mutex_unlock(&work_lock);
+	if (b == NULL)
+		return false;
+
+	fetch = b->fetch;
+	query = b->query;
+	writer_put(query->writer, b->w_writer.out_buf, b->w_writer.out_len);
+	fetch->count += b->w_fetch.count;
+	query->writer->count += b->w_fetch.count;
+	query->tuples += b->w_query.tuples;
+	query->lines += b->w_query.lines;
+	query->keepalives += b->w_query.keepalives;
+	if (b->w_fetch.saf_cond != sc_init)
+		fetch->saf_cond = b->w_fetch.saf_cond;
+	if (b->w_fetch.saf_msg != NULL) {
+		DESTROY(fetch->saf_msg);
+		fetch->saf_msg = b->w_fetch.saf_msg;
+	}
+	if (b->w_fetch.stopped)
+		fetch->stopped = true;
+	fetch->work_batches--;
+	DESTROY(b->w_writer.out_buf);
+	DESTROY(b->lines);
+	DESTROY(b);
+	return true;
+}
+
+/* work_sync -- output, in order, the batches up to a fetch's last, or
+ * all of them if fetch is NULL, waiting for the workers as need be.
+ */
+static void
+work_sync(fetch_t fetch) {
+	while (fetch != NULL ? fetch->work_batches > 0 : work_head != NULL)
+		(void) work_commit(true);
+}
+
+/* work_drain -- output all the batches the workers have, for benchmarks.
+ */
+void
+work_drain(void) {
+	work_sync(NULL);
+}
+
+/* work_ready -- the workers have finished the oldest batch, so output
+ * it and any finished behind it.
+ */
+static void
+work_ready(int fd,
+	   int events __attribute__ ((unused)),
+	   void *arg __attribute__ ((unused)))
+{
+	char drain[64];
+
+	while (read(fd, drain, sizeof drain) > 0)
+		continue;
+	while (work_commit(false))
+		continue;
+}
+
+/* work_start -- start the --workers threads.
+ */
+static void
+work_start(void) {
+	long i;
+	int x;
+
+	/* the indexer is chosen, and jansson's hash seeded, on first use;
+	 * let that be now, before there are threads to race to it.
+	 */
+	sindex_build(&deblock_ix, "", 0);
+	json_object_seed(0);
+
+	if (pipe(work_fds) == -1)
+		my_panic(true, "pipe");
+	for (i = 0; i < 2; i++) {
+		if (fcntl(work_fds[i], F_SETFL,
+			  fcntl(work_fds[i], F_GETFL) | O_NONBLOCK) == -1 ||
+		    fcntl(work_fds[i], F_SETFD, FD_CLOEXEC) == -1)
+			my_panic(true, "fcntl");
+	}
+	watch_set(work_fds[0], WATCH_READ, work_ready, NULL);
+
+	CREATE(work_threads, (size_t)parse_workers * sizeof *work_threads);
+	for (i = 0; i < parse_workers; i++) {
+		x = pthread_create(&work_threads[i], NULL, work_main, NULL);
+		if (x != 0) {
+			errno = x;
+			my_panic(true, "pthread_create");
+		}
+	}
+	DEBUG(1, true, "workers: %ld started\n", parse_workers);
+}
+
+/* work_fini -- output what the workers have done, and stop them.
+ */
+static void
+work_fini(void) {
+	long i;
+
+	if (work_threads == NULL)
+		return;
+	work_sync(NULL);
+	pthread_mutex_lock(&work_lock);
+	work_stop = true;
+	pthread_cond_broadcast(&work_todo);
+	pthread_mutex_unlock(&work_lock);
+	for (i = 0; i < parse_workers; i++)
+		pthread_join(work_threads[i], NULL);
+	DESTROY(work_threads);
+	work_stop = false;
+
+	watch_set(work_fds[0], 0, NULL, NULL);
+	close(work_fds[0]);
+	close(work_fds[1]);
+	work_fds[0] = work_fds[1] = -1;
+	DEBUG(1, true, "workers: %lu batches, waited %lu times for"
+	      " a worker\n", work_batches, work_stalls);
+	work_batches = work_stalls = 0;
+}
+
+/* work_main -- a worker thread: parse and present batch after batch,
+ * with an index and an arena of its own.
+ */
+static void *
+work_main(void *arg __attribute__ ((unused))) {
+	struct sindex ix;
+	struct batch *b;
+
+	memset(&ix, 0, sizeof ix);
+	pthread_mutex_lock(&work_lock);
+	for (;;) {
+		size_t at = 0, nl;
+
+		while ((b = work_next) == NULL && !work_stop)
+			pthread_cond_wait(&work_todo, &work_lock);
+		if (b == NULL)
+			break;
+		work_next = b->next;
+		pthread_mutex_unlock(&work_lock);
+
+		b->w_writer.out = open_memstream(&b->w_writer.out_buf,
+						 &b->w_writer.out_len);
+		if (b->w_writer.out == NULL)
+			my_panic(true, "open_memstream");
+		sindex_build(&ix, b->lines, b->len);
+		arena_begin();
+		while ((nl = sindex_next(ix.nl, at, b->len)) < b->len) {
+			(void) deblock_line(&b->w_fetch, b->lines + at,
+					    nl - at, &ix);
+			at = nl + 1;
+		}
+		arena_end();
+		fclose(b->w_writer.out);
+		b->w_writer.out = NULL;
+
+		pthread_mutex_lock(&work_lock);
+		b->done = true;
+		if (b == work_head) {
+			pthread_cond_signal(&work_done);
+			if (write(work_fds[1], "", 1) == -1) {
+				/* the pipe is full, which wakes us as well. */
+			}
+		}
+	}
+	pthread_mutex_unlock(&work_lock);
+	sindex_free(&ix);
+	arena_release();
+	return NULL;
 }
 
 /* query_done -- do something with leftover buffer data when a query ends.
@@ -327,55 +1818,236 @@ writer_func(char *ptr, size_t size, size_t nmemb, void *blob) {
 static void
 query_done(query_t query) {
 	DEBUG(2, true, "query_done(%s)\n", query->command);
+	DEBUG(1, true, "%s: %" CURL_FORMAT_CURL_OFF_T " octets received,"
+	      " %" CURL_FORMAT_CURL_OFF_T " decoded\n",
+	      query->command, query->wire_bytes, query->body_bytes);
+	if (stats_out != NULL)
+		query_stats(query);
 
 	if (!quiet) {
 		const char *msg = or_else(query->saf_msg, "");
+		/* when batching, say which query this is about. */
+		const char *descr = or_else(query->writer->descr, ""),
+			*sep = query->writer->descr != NULL ? ": " : "";
 
 		if (query->saf_cond == sc_limited)
-			fprintf(stderr, "Query limited: %s\n", msg);
+			fprintf(stderr, "%s%sQuery limited: %s\n",
+				descr, sep, msg);
 		else if (query->saf_cond == sc_failed)
-			fprintf(stderr, "Query failed: %s\n", msg);
+			fprintf(stderr, "%s%sQuery failed: %s\n",
+				descr, sep, msg);
 		else if (query->saf_cond == sc_missing)
-			fprintf(stderr, "Query response_missing: %s\n", msg);
+			fprintf(stderr, "%s%sQuery response_missing: %s\n",
+				descr, sep, msg);
 		else if (query->status != NULL)
-			fprintf(stderr, "Query status: %s (%s)\n",
-				query->status, query->message);
+			fprintf(stderr, "%s%sQuery status: %s (%s)\n",
+				descr, sep, query->status, query->message);
+	}
+}
+
+/* fetch_stats -- note one fetch attempt's timings for --stats.
+ *
+ * libcurl's times are each from the start of the attempt, to when the
+ * name was looked up, connected, TLS was negotiated, the first octet
+ * arrived, and it was over.  they are kept in seconds.
+ */
+static void
+fetch_stats(fetch_t fetch, CURLcode result, curl_off_t wire, bool reused) {
+	static const struct {
+		const char	*name;
+		CURLINFO	info;
+	} times[] = {
+		{ "dns",	CURLINFO_NAMELOOKUP_TIME_T },
+		{ "connect",	CURLINFO_CONNECT_TIME_T },
+		{ "tls",	CURLINFO_APPCONNECT_TIME_T },
+		{ "ttfb",	CURLINFO_STARTTRANSFER_TIME_T },
+		{ "total",	CURLINFO_TOTAL_TIME_T },
+	};
+	query_t query = fetch->query;
+	json_t *attempt;
+	size_t i;
+
+	attempt = json_pack("{s:s, s:i, s:s, s:b, s:I}",
+			    "url", fetch->url,
+			    "rcode", (int)fetch->rcode,
+			    "result", curl_easy_strerror(result),
+			    "reused", reused,
+			    "bytes", (json_int_t)wire);
+	if (attempt == NULL)
+		my_panic(false, "json_pack");
+	if (hedge_ms != 0)
+		json_object_set_new(attempt, "hedge",
+				    fetch->is_hedge ? json_true()
+				    : json_false());
+	if (http2)
+		json_object_set_new(attempt, "http",
+				    json_string(fetch->http_version ==
+						CURL_HTTP_VERSION_2_0 ? "2"
+						: fetch->http_version == 0 ? "none"
+						: "1"));
+	if (fetch->cache != NULL)
+		json_object_set_new(attempt, "cache",
+				    json_string(cache_hit(fetch->cache)
+						? "hit" : "miss"));
+	for (i = 0; i < sizeof times / sizeof times[0]; i++) {
+		curl_off_t us = 0;
+
+		curl_easy_getinfo(fetch->easy, times[i].info, &us);
+		json_object_set_new(attempt, times[i].name,
+				    json_real((double)us / 1e6));
+	}
+	if (query->attempts == NULL)
+		query->attempts = json_array();
+	json_array_append_new(query->attempts, attempt);
+}
+
+/* query_stats -- write one query's summary for --stats, as a JSON line.
+ *
+ * the per-attempt times are also given summed, so that time spent on the
+ * network can be set against the time the query took.
+ */
+static void
+query_stats(query_t query) {
+	static const char *sums[] = {
+		"dns", "connect", "tls", "ttfb", "total", NULL
+	};
+	json_t *stats, *attempt;
+	const char **sum;
+	long reused = 0;
+	size_t i;
+
+	if (query->attempts == NULL)
+		query->attempts = json_array();
+	stats = json_pack("{s:s, s:s?, s:s, s:s?, s:s?, s:i,"
+			  " s:f, s:I, s:I, s:I, s:I, s:I, s:i}",
+			  "query", query->command,
+			  "descr", query->writer->descr,
+			  "saf_cond", saf_cond_name(query->saf_cond),
+			  "saf_msg", query->saf_msg,
+			  "status", query->status,
+			  "rcode", (int)query->rcode,
+			  "elapsed",
+			  (double)(mono_ms() - query->start_ms) / 1e3,
+			  "bytes", (json_int_t)query->wire_bytes,
+			  "decoded", (json_int_t)query->body_bytes,
+			  "lines", (json_int_t)query->lines,
+			  "tuples", (json_int_t)query->tuples,
+			  "keepalives", (json_int_t)query->keepalives,
+			  "fetches", (int)json_array_size(query->attempts));
+	if (stats == NULL)
+		my_panic(false, "json_pack");
+	for (sum = sums; *sum != NULL; sum++) {
+		double total = 0.0;
+
+		for (i = 0; i < json_array_size(query->attempts); i++) {
+			attempt = json_array_get(query->attempts, i);
+			total += json_real_value(json_object_get(attempt, *sum));
+		}
+		json_object_set_new(stats, *sum, json_real(total));
+	}
+	for (i = 0; i < json_array_size(query->attempts); i++) {
+		attempt = json_array_get(query->attempts, i);
+		reused += json_is_true(json_object_get(attempt, "reused"));
 	}
+	json_object_set_new(stats, "reused", json_integer(reused));
+	if (max_streams < 0)
+		json_object_set_new(stats, "streams",
+				    json_integer(streams_limit()));
+	json_object_set(stats, "attempts", query->attempts);
+
+	json_dumpf(stats, stats_out, JSON_COMPACT
+#ifdef JSON_REAL_PRECISION
+		   | JSON_REAL_PRECISION(6)
+#endif
+		   );
+	putc('\n', stats_out);
+	/* a --serve daemon may run for a long time. */
+	fflush(stats_out);
+	json_decref(stats);
 }
 
 /* writer_fini -- stop a writer's fetch
  */
 void
 writer_fini(writer_t writer) {
+	writer_t *pw;
+
 	/* finish and close any fetches still cooking. */
 	if (writer->query != NULL) {
 		query_t query = writer->query;
 
+		fetch_t fetch;
+
 		/* release any buffered info. */
-		if (query->fetch != NULL) {
-			DESTROY(query->fetch->buf);
-			if (query->fetch->len != 0) {
+		while ((fetch = query->fetches) != NULL) {
+			query->fetches = fetch->next;
+			DESTROY(fetch->buf);
+			if (fetch->len != 0) {
 				my_logf(
 					"warning: stranding %d octets!",
-					(int)query->fetch->len);
-				query->fetch->len = 0;
+					(int)fetch->len);
+				fetch->len = 0;
 			}
 
 			/* tear down any curl infrastructure on the fetch. */
-			fetch_reap(query->fetch);
-
-			query->fetch = NULL;
+			fetch_reap(fetch);
 		}
+		if (writer->descr != NULL)
+			fprintf(writer->out, "-- %s (%s)\n",
+				or_else(query->status, status_noerror),
+				or_else(query->message,
+					saf_cond_name(query->saf_cond)));
 		assert((query->status != NULL) == (query->message != NULL));
 		DESTROY(query->status);
 		DESTROY(query->message);
 		DESTROY(query->command);
+		DESTROY(query->saf_msg);
+		if (query->seen != NULL)
+			tuple_set_free(query->seen);
+		json_decref(query->attempts);
+		DESTROY(query->qd.value);
+		DESTROY(query->qd.exclude);
+		DESTROY(query->qd.rrtype);
 		DESTROY(query);
 	}
 
+	/* emit the output, all of it now if it was held. */
+	writer->held = false;
+	writer_flush(writer);
+	fclose(writer->out);
+	writer->out = NULL;
+	DESTROY(writer->out_buf);
+
+	/* a --serve client can go on to its next request. */
+	if (writer->outq->client != NULL) {
+		writer->outq->client->writer = NULL;
+		client_watch(writer->outq->client);
+	}
+
+	for (pw = &writers; *pw != NULL; pw = &(*pw)->next)
+		if (*pw == writer) {
+			*pw = writer->next;
+			break;
+		}
+	DESTROY(writer->descr);
+	DESTROY(writer->last_printed);
 	DESTROY(writer);
 }
 
+/* writer_flush -- move what has been presented into the output queue,
+ * unless it is being held.
+ */
+static void
+writer_flush(writer_t writer) {
+	if (writer->held)
+		return;
+	fflush(writer->out);
+	if (writer->out_len != 0) {
+		outq_put(writer->outq, writer->out_buf, writer->out_len);
+		fseeko(writer->out, 0, SEEK_SET);
+	}
+}
+
 void
 unmake_writers(void) {
 	while (writers != NULL)
@@ -383,110 +2055,1374 @@ unmake_writers(void) {
 }
 
 /* io_engine -- let libcurl run until there are few enough outstanding jobs.
+ *
+ * libcurl tells us through socket_cb() and timer_cb() which sockets and
+ * which deadline to wait for, and we tell it which ones fired through
+ * curl_multi_socket_action().  nothing here sleeps for a fixed time.
  */
 void
 io_engine(int jobs) {
-	int still, repeats, numfds;
-
 	DEBUG(2, true, "io_engine(%d)\n", jobs);
 
-	/* let libcurl run while there are too many jobs remaining. */
-	still = 0;
-	repeats = 0;
-	while (curl_multi_perform(multi, &still) == CURLM_OK && still > jobs) {
-		DEBUG(3, true, "...waiting (still %d)\n", still);
-		numfds = 0;
-		if (curl_multi_wait(multi, NULL, 0, 0, &numfds) != CURLM_OK)
-			break;
-		if (numfds == 0) {
-			/* curl_multi_wait() can return 0 fds for no reason. */
-			if (++repeats > 1) {
-				struct timespec req, rem;
-
-				req = (struct timespec){
-					.tv_sec = 0,
-					.tv_nsec = 100*1000*1000  // 100ms
-				};
-				while (nanosleep(&req, &rem) == EINTR) {
-					/* as required by nanosleep(3). */
-					req = rem;
-				}
-			}
-		} else {
-			repeats = 0;
-		}
+	/* let libcurl start anything that was added since last time. */
+	curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0,
+				 &multi_running);
+	if (multi_running < multi_inflight)
 		io_drain();
+
+	/* let libcurl run while there are too many jobs remaining.  count
+	 * our own fetches, since finishing one can launch more.
+	 */
+	while (multi_inflight + fetches_waiting > jobs) {
+		DEBUG(3, true, "...waiting (still %d)\n", multi_inflight);
+		io_step();
 	}
-	io_drain();
 }
 
-/* io_drain -- drain the response code reports.
+/* io_step -- wait for whatever comes next, and deal with it.
  */
 static void
-io_drain(void) {
-	struct CURLMsg *cm;
-	int still = 0;
+io_step(void) {
+	long timeout = multi_timeout_ms;
+	client_t client;
 
-	while ((cm = curl_multi_info_read(multi, &still)) != NULL) {
-		fetch_t fetch;
-		query_t query;
-		char *private;
+	/* our own deadlines, for retries, stalls, and hedges, may be
+	 * sooner.
+	 */
+	if (fetches_waiting > 0 || stall_timeout > 0 || hedge_ms != 0) {
+		long timer = fetch_timers();
 
-		curl_easy_getinfo(cm->easy_handle,
-				  CURLINFO_PRIVATE,
-				  &private);
-		fetch = (fetch_t) private;
-		query = fetch->query;
+		if (timer >= 0 && (timeout < 0 || timer < timeout))
+			timeout = timer;
+	}
+	if (multi_timeout_ms == 0) {
+		multi_timeout_ms = -1;
+		curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0,
+					 &multi_running);
+	} else {
+		watch_wait(timeout);
+	}
+	/* a transfer finished iff libcurl is running fewer of
+	 * our fetches than we have given it.
+	 */
+	if (multi_running < multi_inflight)
+		io_drain();
 
-		if (cm->msg == CURLMSG_DONE) {
-			if (fetch->rcode == 0)
-				curl_easy_getinfo(fetch->easy,
-						  CURLINFO_RESPONSE_CODE,
-						  &fetch->rcode);
+	/* hedges decided since, take back the losers. */
+	while (lost_fetches != NULL)
+		lost_reap(lost_fetches);
 
-			DEBUG(2, true, "io_drain(%s) DONE rcode=%d\n",
-			      query->command, fetch->rcode);
-			DEBUG(2, true, "... saf_cond %d saf_msg %s\n",
-			      query->saf_cond,
-			      or_else(query->saf_msg, ""));
+	/* any output may have drained, or its reader gone away. */
+	outq_check(&stdout_q);
+	for (client = clients; client != NULL; client = client->next)
+		outq_check(&client->outq);
+}
 
-			if (cm->data.result == CURLE_COULDNT_RESOLVE_HOST) {
-				my_logf(
-					"warning: libcurl failed since "
-					"could not resolve host");
-				exit_code = 1;
-			} else if (cm->data.result == CURLE_COULDNT_CONNECT) {
-				my_logf(
-					"warning: libcurl failed since "
-					"could not connect");
-				exit_code = 1;
-			} else if (cm->data.result != CURLE_OK &&
-				   !fetch->stopped)
-			{
-				my_logf(
-					"warning: libcurl failed with "
-					"curl error %d (%s)",
-					cm->data.result,
-					curl_easy_strerror(cm->data.result));
-				exit_code = 1;
-			}
+/* socket_cb -- libcurl wants us to change how we watch one of its sockets.
+ */
+static int
+socket_cb(CURL *easy __attribute__ ((unused)),
+	  curl_socket_t s,
+	  int what,
+	  void *userp __attribute__ ((unused)),
+	  void *socketp __attribute__ ((unused)))
+{
+	int events = 0;
 
-			/* record emptiness as status if nothing else. */
-			if (query->writer != NULL &&
-			    query->writer->count == 0 &&
-			    query->status == NULL)
-			{
-				query_status(query,
-					     status_noerror,
-					     "no results found for query.");
-			}
+	if (what == CURL_POLL_IN || what == CURL_POLL_INOUT)
+		events |= WATCH_READ;
+	if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT)
+		events |= WATCH_WRITE;
+	watch_set(s, events, socket_ready, NULL);
+	return 0;
+}
 
-			fetch_done(fetch);
-			fetch_unlink(fetch);
-			fetch_reap(fetch);
-		}
-		DEBUG(3, true, "...info read (still %d)\n", still);
+/* timer_cb -- libcurl wants us to call it back after timeout_ms
+ * (if zero, right away; if -1, never).
+ */
+static int
+timer_cb(CURLM *m __attribute__ ((unused)),
+	 long timeout_ms,
+	 void *userp __attribute__ ((unused)))
+{
+	multi_timeout_ms = timeout_ms;
+	return 0;
+}
+
+/* socket_ready -- one of libcurl's sockets can be read or written.
+ */
+static void
+socket_ready(int fd, int events, void *arg __attribute__ ((unused))) {
+	int flags = 0;
+
+	if ((events & WATCH_READ) != 0)
+		flags |= CURL_CSELECT_IN;
+	if ((events & WATCH_WRITE) != 0)
+		flags |= CURL_CSELECT_OUT;
+	if ((events & WATCH_ERROR) != 0)
+		flags |= CURL_CSELECT_ERR;
+	curl_multi_socket_action(multi, fd, flags, &multi_running);
+}
+
+/* watch_set -- start, change, or (if events is zero) stop watching a
+ * file descriptor.  func will be called from io_engine() when any of
+ * the events occur.
+ */
+static void
+watch_set(int fd, int events, watch_func_t func, void *arg) {
+	assert(fd >= 0);
+	if (fd >= watches_size) {
+		int size = watches_size == 0 ? 64 : watches_size;
+
+		while (size <= fd)
+			size *= 2;
+		watches = realloc(watches, (size_t)size * sizeof *watches);
+		if (watches == NULL)
+			my_panic(true, "realloc");
+		memset(watches + watches_size, 0,
+		       (size_t)(size - watches_size) * sizeof *watches);
+		watches_size = size;
+	}
+#ifdef __linux__
+	struct epoll_event ev = {
+		.events = ((events & WATCH_READ) != 0 ? EPOLLIN : 0U) |
+			((events & WATCH_WRITE) != 0 ? EPOLLOUT : 0U),
+		.data.fd = fd
+	};
+	int op;
+
+	if (events == 0)
+		op = EPOLL_CTL_DEL;
+	else if (watches[fd].events == 0)
+		op = EPOLL_CTL_ADD;
+	else
+		op = EPOLL_CTL_MOD;
+	if (epoll_ctl(epfd, op, fd, &ev) == -1 && op != EPOLL_CTL_DEL)
+		my_panic(true, "epoll_ctl");
+#endif
+	if (events == 0)
+		watches[fd] = (struct watch){ NULL, NULL, 0 };
+	else
+		watches[fd] = (struct watch){ func, arg, events };
+}
+
+/* watch_wait -- wait up to timeout_ms (-1 means forever) for watched
+ * file descriptors to become ready, and dispatch them.  if nothing
+ * became ready, the caller's deadline has arrived, so tell libcurl.
+ */
+static void
+watch_wait(long timeout_ms) {
+	int i, n, timeout = timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms;
+
+#ifdef __linux__
+	struct epoll_event evs[64];
+
+	n = epoll_wait(epfd, evs, (int)(sizeof evs / sizeof evs[0]), timeout);
+	if (n == -1 && errno != EINTR)
+		my_panic(true, "epoll_wait");
+	for (i = 0; i < n; i++) {
+		int fd = evs[i].data.fd, events = 0;
+
+		if ((evs[i].events & EPOLLIN) != 0)
+			events |= WATCH_READ;
+		if ((evs[i].events & EPOLLOUT) != 0)
+			events |= WATCH_WRITE;
+		if ((evs[i].events & (EPOLLERR | EPOLLHUP)) != 0)
+			events |= WATCH_ERROR;
+		if (fd < watches_size && watches[fd].func != NULL)
+			watches[fd].func(fd, events, watches[fd].arg);
+	}
+#else
+	struct pollfd *pfds = NULL;
+	int npfds = 0;
+
+	for (i = 0; i < watches_size; i++)
+		if (watches[i].events != 0)
+			npfds++;
+	CREATE(pfds, (size_t)(npfds + 1) * sizeof *pfds);
+	npfds = 0;
+	for (i = 0; i < watches_size; i++)
+		if (watches[i].events != 0)
+			pfds[npfds++] = (struct pollfd){
+				.fd = i,
+				.events = (short)(
+				    ((watches[i].events & WATCH_READ) != 0
+				     ? POLLIN : 0) |
+				    ((watches[i].events & WATCH_WRITE) != 0
+				     ? POLLOUT : 0))
+			};
+	n = poll(pfds, (nfds_t)npfds, timeout);
+	if (n == -1 && errno != EINTR)
+		my_panic(true, "poll");
+	for (i = 0; n > 0 && i < npfds; i++) {
+		int fd = pfds[i].fd, events = 0;
+
+		if (pfds[i].revents == 0)
+			continue;
+		if ((pfds[i].revents & POLLIN) != 0)
+			events |= WATCH_READ;
+		if ((pfds[i].revents & POLLOUT) != 0)
+			events |= WATCH_WRITE;
+		if ((pfds[i].revents & (POLLERR | POLLHUP | POLLNVAL)) != 0)
+			events |= WATCH_ERROR;
+		/* an earlier callback may have stopped this watch. */
+		if (watches[fd].func != NULL)
+			watches[fd].func(fd, events, watches[fd].arg);
+	}
+	DESTROY(pfds);
+#endif
+	if (n == 0)
+		curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0,
+					 &multi_running);
+}
+
+/* io_drain -- drain the response code reports.
+ */
+static void
+io_drain(void) {
+	struct CURLMsg *cm;
+	int still = 0;
+
+	while ((cm = curl_multi_info_read(multi, &still)) != NULL) {
+		fetch_t fetch;
+		char *private;
+
+		curl_easy_getinfo(cm->easy_handle,
+				  CURLINFO_PRIVATE,
+				  &private);
+		fetch = (fetch_t) private;
+
+		if (cm->msg == CURLMSG_DONE)
+			fetch_end(fetch, cm->data.result);
+		DEBUG(3, true, "...info read (still %d)\n", still);
+	}
+}
+
+/* fetch_end -- libcurl is done with a fetch, one way or another.
+ */
+static void
+fetch_end(fetch_t fetch, CURLcode result) {
+	query_t query = fetch->query;
+	curl_off_t wire = 0;
+	long connects = 0;
+
+	if (fetch->lost) {
+		lost_reap(fetch);
+		return;
+	}
+
+	/* what follows needs all of this fetch's lines to be counted. */
+	work_sync(fetch);
+
+	/* a cache hit does not touch the network, so counts for nothing. */
+	if (fetch->cache == NULL || !cache_hit(fetch->cache)) {
+		/* libcurl counts the body as received, before decoding. */
+		curl_easy_getinfo(fetch->easy, CURLINFO_SIZE_DOWNLOAD_T, &wire);
+		query->wire_bytes += wire;
+
+		/* no new connection means one was reused. */
+		curl_easy_getinfo(fetch->easy, CURLINFO_NUM_CONNECTS,
+				  &connects);
+		if (connects == 0)
+			conns_reused++;
+		else
+			conns_new += (u_long)connects;
+
+		/* zero if there was no response at all. */
+		curl_easy_getinfo(fetch->easy, CURLINFO_HTTP_VERSION,
+				  &fetch->http_version);
+		if (fetch->http_version == CURL_HTTP_VERSION_2_0)
+			fetches_http2++;
+		else if (fetch->http_version != 0)
+			fetches_http1++;
+	}
+
+	if (fetch->rcode == 0)
+		curl_easy_getinfo(fetch->easy,
+				  CURLINFO_RESPONSE_CODE,
+				  &fetch->rcode);
+	query->rcode = fetch->rcode;
+	if (stats_out != NULL)
+		fetch_stats(fetch, result, wire, connects == 0);
+
+	if (fetch->rec != NULL) {
+		record_end(fetch->rec, fetch->rcode,
+			   curl_easy_strerror(result));
+		fetch->rec = NULL;
+	}
+	/* a stream cut short is not cached. */
+	if (fetch->cache != NULL && result != CURLE_OK) {
+		cache_end(fetch->cache, false);
+		fetch->cache = NULL;
+	}
+
+	DEBUG(2, true, "fetch_end(%s) DONE rcode=%d\n",
+	      query->command, fetch->rcode);
+	DEBUG(2, true, "... saf_cond %d saf_msg %s\n",
+	      fetch->saf_cond,
+	      or_else(fetch->saf_msg, ""));
+	multi_inflight--;
+	if (max_streams < 0 && replay_dir == NULL &&
+	    (fetch->cache == NULL || !cache_hit(fetch->cache)))
+		aimd_fetch(fetch, result);
+
+	/* one of a hedged pair which ended before getting any data, while
+	 * the other goes on, is simply dropped.
+	 */
+	if (fetch->twin != NULL && fetch->first_ms == 0) {
+		fetch_unlink(fetch);
+		fetch_reap(fetch);
+		return;
+	}
+
+	if (fetch_retry(fetch, result))
+		return;
+
+	if (result == CURLE_COULDNT_RESOLVE_HOST) {
+		my_logf(
+			"warning: libcurl failed since "
+			"could not resolve host");
+		exit_code = 1;
+	} else if (result == CURLE_COULDNT_CONNECT) {
+		my_logf(
+			"warning: libcurl failed since "
+			"could not connect");
+		exit_code = 1;
+	} else if (result != CURLE_OK && !fetch->stopped) {
+		my_logf(
+			"warning: libcurl failed with "
+			"curl error %d (%s)",
+			result,
+			curl_easy_strerror(result));
+		exit_code = 1;
+	}
+
+	/* a page not yet due for output waits for its turn,
+	 * but libcurl is done with it.
+	 */
+	if (fetch->held) {
+		curl_multi_remove_handle(multi, fetch->easy);
+		easy_put(fetch->easy);
+		fetch->easy = NULL;
+		fetch->done = true;
+		return;
+	}
+	fetch_finish(fetch);
+}
+
+/* fetch_retry -- if a fetch died partway, arrange to try it again later,
+ * resuming after the results already output.  Returns true if so.
+ */
+static bool
+fetch_retry(fetch_t fetch, CURLcode result) {
+	bool throttled = fetch_throttled(fetch);
+	long long delay;
+
+	/* a transport failure, or a stream that ended with no final cond.
+	 * a held page's cond is not known until it is output, so
+	 * fetch_finish() asks again when it releases the page.
+	 */
+	if (result != CURLE_OK && fetch->stopped) {
+		return false;
+	} else if (throttled) {
+		/* the server asked us to slow down, so it is worth waiting. */
+	} else if (result == CURLE_OK) {
+		if (fetch->rcode != HTTP_OK || fetch->held)
+			return false;
+		switch (fetch->saf_cond) {
+		case sc_init:
+		case sc_begin:
+		case sc_ongoing:
+			break;
+		case sc_succeeded:
+		case sc_limited:
+		case sc_failed:
+		case sc_we_limited:
+		case sc_missing:
+			return false;
+		}
+	}
+	if (!throttled && fetch->attempts >= retries)
+		return false;
+	/* --raw output was not counted, so cannot be resumed after. */
+	if (raw_output && fetch->raw_out != 0)
+		return false;
+	if (fetch->query->qd.query_limit > 0 &&
+	    fetch->count >= fetch->query->qd.query_limit)
+		return false;
+
+	/* exponential backoff, with jitter to spread out a herd. */
+	delay = (long long)RETRY_BASE_MS << fetch->attempts;
+	if (delay > RETRY_MAX_MS)
+		delay = RETRY_MAX_MS;
+	delay = delay / 2 + random() % (delay / 2 + 1);
+	fetch->attempts++;
+	if (throttled) {
+#ifdef CURL_AT_LEAST_VERSION
+#if CURL_AT_LEAST_VERSION(7, 66, 0)
+		curl_off_t after = 0;
+
+		/* the server may say how long to wait. */
+		curl_easy_getinfo(fetch->easy, CURLINFO_RETRY_AFTER, &after);
+		if (after > 0)
+			delay = (long long)after * 1000;
+#endif
+#endif /* CURL_AT_LEAST_VERSION */
+		/* everybody backs off, not only this fetch. */
+		if (gate_resume_ms < mono_ms() + delay)
+			gate_resume_ms = mono_ms() + delay;
+		gate_throttled++;
+		DEBUG(1, true, "throttled (%ld), pausing %lld ms\n",
+		      fetch->rcode, delay);
+	} else if (!quiet) {
+		my_logf("warning: %s (%s), retry %d in %lld ms",
+			or_else(fetch->query->writer->descr,
+				fetch->query->command),
+			result == CURLE_OK ? "stream ended early"
+				: curl_easy_strerror(result),
+			fetch->attempts, delay);
+	}
+
+	/* a released page gave its handle back when its stream ended. */
+	if (fetch->easy != NULL) {
+		curl_multi_remove_handle(multi, fetch->easy);
+		easy_put(fetch->easy);
+		fetch->easy = NULL;
+	}
+	if (fetch->hdrs != NULL) {
+		curl_slist_free_all(fetch->hdrs);
+		fetch->hdrs = NULL;
+	}
+
+	if (fetch->cache != NULL) {
+		cache_end(fetch->cache, false);
+		fetch->cache = NULL;
+	}
+
+	/* a held page's buffer is discarded, since none of it was output. */
+	fetch_empty(fetch);
+	fetch->rcode = 0;
+	fetch->first_ms = 0;
+	fetch->stopped = false;
+	fetch->done = false;
+	fetch->saf_cond = sc_init;
+	DESTROY(fetch->saf_msg);
+	DESTROY(fetch->url);
+	fetch->url = fetch_url(fetch);
+	fetch->retry_ms = mono_ms() + delay;
+	fetches_waiting++;
+	return true;
+}
+
+/* fetch_timers -- restart fetches whose backoff is over, end those which
+ * have been silent for too long, and hedge those slow to get any data.
+ * Returns how many milliseconds until this should be called again, or -1
+ * if there is no need.
+ */
+static long
+fetch_timers(void) {
+	long long now = mono_ms(), next = -1, due;
+	long gate = gate_run(), hedge = hedge_after();
+	writer_t writer;
+	fetch_t fetch;
+
+	if (gate >= 0)
+		next = now + gate;
+ again:
+	for (writer = writers; writer != NULL; writer = writer->next) {
+		if (writer->query == NULL)
+			continue;
+		for (fetch = writer->query->fetches;
+		     fetch != NULL;
+		     fetch = fetch->next)
+		{
+			if (fetch->retry_ms != 0) {
+				due = fetch->retry_ms;
+				if (due <= now) {
+					fetch->retry_ms = 0;
+					fetches_waiting--;
+					fetch_start(fetch);
+					continue;
+				}
+			} else if (fetch->easy != NULL && !fetch->paused) {
+				due = -1;
+				if (stall_timeout > 0) {
+					due = fetch->active_ms +
+						stall_timeout * 1000;
+					if (due <= now) {
+						/* this can end the query and
+						 * its writer, so start over
+						 * afterward.
+						 */
+						fetch_end(fetch,
+						    CURLE_OPERATION_TIMEDOUT);
+						goto again;
+					}
+				}
+				if (hedge > 0 && fetch_hedgeable(fetch)) {
+					long long when = fetch->admit_ms + hedge;
+
+					if (when <= now)
+						fetch_hedge(fetch);
+					else if (due == -1 || when < due)
+						due = when;
+				}
+				if (due == -1)
+					continue;
+			} else {
+				continue;
+			}
+			if (next == -1 || due < next)
+				next = due;
+		}
+	}
+	return next == -1 ? -1 : (long)(next - now);
+}
+
+/* fetch_hedgeable -- may this fetch be raced by a hedge, if it has still
+ * had no data once the hedging threshold passes?
+ */
+static bool
+fetch_hedgeable(fetch_t fetch) {
+	if (fetch->is_hedge || fetch->twin != NULL || fetch->held ||
+	    fetch->first_ms != 0 || replay_dir != NULL ||
+	    (fetch->cache != NULL && cache_hit(fetch->cache)))
+		return false;
+	/* hedges may be at most hedge_cap percent of fetches. */
+	return (hedges_issued + 1) * 100 <=
+		(u_long)hedge_cap * fetches_admitted;
+}
+
+/* fetch_hedge -- race a fetch slow to get data with a duplicate of it,
+ * if the rate limiter allows one now.
+ */
+static void
+fetch_hedge(fetch_t fetch) {
+	query_t query = fetch->query;
+	fetch_t hedge = NULL;
+
+	if (gate_head != NULL || !gate_pass())
+		return;
+	DEBUG(1, true, "hedge: no data after %lld ms, racing [%s]\n",
+	      mono_ms() - fetch->admit_ms, fetch->url);
+	CREATE(hedge, sizeof *hedge);
+	hedge->query = query;
+	hedge->url = strdup(fetch->url);
+	hedge->fence = fetch->fence;
+	hedge->offset = fetch->offset;
+	hedge->count = fetch->count;
+	hedge->attempts = fetch->attempts;
+	hedge->splits = fetch->splits;
+	if (fetch->seen != NULL)
+		hedge->seen = tuple_set_new(fetch->seen);
+	hedge->is_hedge = true;
+	hedge->twin = fetch;
+	fetch->twin = hedge;
+	hedge->next = query->fetches;
+	query->fetches = hedge;
+	hedges_issued++;
+	fetch_admit(hedge);
+}
+
+/* hedge_after -- how many milliseconds without data before a fetch is
+ * hedged, or 0 if none are.  --hedge auto uses the 95th percentile of
+ * recent times to first data.
+ */
+static long
+hedge_after(void) {
+	long sorted[TTFB_SAMPLES], t;
+	int i, j;
+
+	if (hedge_ms >= 0)
+		return hedge_ms;
+	if (ttfb_count < TTFB_MIN_SAMPLES)
+		return HEDGE_DEFAULT_MS;
+	if (ttfb_p95 < 0) {
+		/* insertion sort, as there are few samples. */
+		for (i = 0; i < ttfb_count; i++) {
+			t = ttfb_ms[i];
+			for (j = i; j > 0 && sorted[j - 1] > t; j--)
+				sorted[j] = sorted[j - 1];
+			sorted[j] = t;
+		}
+		ttfb_p95 = sorted[(ttfb_count * 95) / 100];
+		if (ttfb_p95 < 1)
+			ttfb_p95 = 1;
+		DEBUG(2, true, "hedge: p95 time to first data %ld ms\n",
+		      ttfb_p95);
+	}
+	return ttfb_p95;
+}
+
+/* ttfb_note -- remember how long a fetch took to get its first data.
+ */
+static void
+ttfb_note(long long ms) {
+	ttfb_ms[ttfb_next] = (long)ms;
+	ttfb_next = (ttfb_next + 1) % TTFB_SAMPLES;
+	if (ttfb_count < TTFB_SAMPLES)
+		ttfb_count++;
+	ttfb_p95 = -1;
+}
+
+/* lost_reap -- take a fetch which lost to its twin back from libcurl.
+ */
+static void
+lost_reap(fetch_t fetch) {
+	fetch_t *pf;
+
+	for (pf = &lost_fetches; *pf != fetch; pf = &(*pf)->next)
+		assert(*pf != NULL);
+	*pf = fetch->next;
+	fetch->next = NULL;
+	multi_inflight--;
+	fetch_reap(fetch);
+}
+
+/* fetch_throttled -- did the server refuse a fetch for now, rather than
+ * for good, with tries left?
+ */
+static bool
+fetch_throttled(fetch_t fetch) {
+	return (fetch->rcode == HTTP_TOO_MANY_REQUESTS ||
+		fetch->rcode == HTTP_SERVICE_UNAVAILABLE) &&
+		fetch->attempts < (retries > THROTTLE_RETRIES
+				   ? retries : THROTTLE_RETRIES);
+}
+
+/* streams_limit -- how many fetches may run at once, or 0 for no limit.
+ */
+static long
+streams_limit(void) {
+	if (max_streams >= 0)
+		return max_streams;
+	return (long)aimd_limit;
+}
+
+/* aimd_fetch -- adapt the limit on running fetches to how one ended.
+ */
+static void
+aimd_fetch(fetch_t fetch, CURLcode result) {
+	long before = streams_limit();
+
+	aimd_adapted = true;
+	if (fetch->rcode == HTTP_TOO_MANY_REQUESTS ||
+	    fetch->rcode == HTTP_SERVICE_UNAVAILABLE)
+	{
+		aimd_cut(fetch, aimd_throttled);
+	} else if (fetch->rcode >= 500) {
+		aimd_cut(fetch, aimd_server);
+	} else if (result == CURLE_OPERATION_TIMEDOUT) {
+		aimd_cut(fetch, aimd_timeout);
+	} else if (result == CURLE_OK && fetch->rcode == HTTP_OK &&
+		   (gate_head != NULL || multi_inflight + 1 >= before))
+	{
+		/* only raise a limit which is holding fetches back. */
+		aimd_limit += 1.0 / aimd_limit;
+		if (aimd_limit > AIMD_MAX)
+			aimd_limit = AIMD_MAX;
+		if (aimd_limit > aimd_peak)
+			aimd_peak = aimd_limit;
+		aimd_raises++;
+		if (streams_limit() != before)
+			DEBUG(2, true, "streams: limit %ld -> %ld\n",
+			      before, streams_limit());
+	}
+}
+
+/* aimd_ttfb -- cut the limit on running fetches if one of them took much
+ * longer than usual to get its first data.
+ */
+static void
+aimd_ttfb(fetch_t fetch, long long ms) {
+	if (aimd_ttfb_seen >= AIMD_TTFB_SAMPLES &&
+	    (double)ms > aimd_ttfb_avg * 2.0 &&
+	    (double)ms > aimd_ttfb_avg + AIMD_TTFB_SLACK_MS)
+		aimd_cut(fetch, aimd_slow);
+	if (aimd_ttfb_seen++ == 0)
+		aimd_ttfb_avg = (double)ms;
+	else
+		aimd_ttfb_avg += ((double)ms - aimd_ttfb_avg) / 8.0;
+}
+
+/* aimd_cut -- halve the limit on running fetches, for some reason, unless
+ * this fetch started before the last cut.
+ */
+static void
+aimd_cut(fetch_t fetch, int reason) {
+	long before = streams_limit();
+
+	if (fetch->admit_ms < aimd_cut_ms)
+		return;
+	aimd_cut_ms = mono_ms();
+	aimd_limit *= AIMD_DECREASE;
+	if (aimd_limit < AIMD_MIN)
+		aimd_limit = AIMD_MIN;
+	aimd_cuts[reason].count++;
+	DEBUG(1, true, "streams: limit %ld -> %ld (%s)\n",
+	      before, streams_limit(), aimd_cuts[reason].name);
+}
+
+/* gate_pass -- may another fetch start now?  takes a token if so.
+ */
+static bool
+gate_pass(void) {
+	long long now;
+
+	if (max_streams != 0 && multi_inflight >= streams_limit())
+		return false;
+	if (rate_limit <= 0.0 && gate_resume_ms == 0)
+		return true;
+	now = mono_ms();
+	if (now < gate_resume_ms)
+		return false;
+	gate_resume_ms = 0;
+	if (rate_limit <= 0.0)
+		return true;
+
+	/* refill the bucket, which holds up to a second's worth. */
+	if (gate_fill_ms == 0)
+		gate_tokens = 1.0;
+	else
+		gate_tokens += (double)(now - gate_fill_ms) * rate_limit / 1000.0;
+	if (gate_tokens > (rate_limit > 1.0 ? rate_limit : 1.0))
+		gate_tokens = rate_limit > 1.0 ? rate_limit : 1.0;
+	gate_fill_ms = now;
+	if (gate_tokens < 1.0)
+		return false;
+	gate_tokens -= 1.0;
+	return true;
+}
+
+/* gate_run -- start what fetches the rate limiter now allows.  Returns
+ * milliseconds until it may allow more, or -1 if that depends only on
+ * fetches ending.
+ */
+static long
+gate_run(void) {
+	fetch_t fetch;
+
+	while (gate_head != NULL && gate_pass()) {
+		fetch = gate_head;
+		gate_head = fetch->gate_next;
+		if (gate_head == NULL)
+			gate_tail = NULL;
+		fetch->gate_next = NULL;
+		fetch->gated = false;
+		fetches_waiting--;
+		fetch_admit(fetch);
+	}
+	if (gate_head == NULL)
+		return -1;
+	if (gate_resume_ms != 0)
+		return (long)(gate_resume_ms - mono_ms()) + 1;
+	if (rate_limit > 0.0 && gate_tokens < 1.0)
+		return (long)((1.0 - gate_tokens) * 1000.0 / rate_limit) + 1;
+	return -1;
+}
+
+/* outq_init -- prepare to write output to stdout.
+ */
+static void
+outq_init(void) {
+	static const int fatal[] = {
+		SIGABRT, SIGBUS, SIGHUP, SIGINT, SIGQUIT, SIGSEGV, SIGTERM
+	};
+	static bool restoring = false;
+	struct stat sb, eb;
+	size_t i;
+
+	/* a closed pipe is noticed through EPIPE instead. */
+	signal(SIGPIPE, SIG_IGN);
+	fflush(stdout);
+
+	/* only pipes and sockets are made non-blocking, and only when stderr
+	 * is not the same one.  the flag is on the open file description, so
+	 * stderr sharing it (as with 2>&1) would lose diagnostics to EAGAIN;
+	 * such output is written blocking instead.  a terminal is left alone
+	 * for the same reason.
+	 */
+	if (fstat(STDOUT_FILENO, &sb) != 0 ||
+	    !(S_ISFIFO(sb.st_mode) || S_ISSOCK(sb.st_mode)))
+		return;
+	if (fstat(STDERR_FILENO, &eb) == 0 &&
+	    eb.st_dev == sb.st_dev && eb.st_ino == sb.st_ino)
+		return;
+	stdout_q.flags = fcntl(STDOUT_FILENO, F_GETFL);
+	if (stdout_q.flags == -1 ||
+	    fcntl(STDOUT_FILENO, F_SETFL, stdout_q.flags | O_NONBLOCK) != 0)
+		return;
+	stdout_q.nonblock = true;
+
+	/* anything else writing through the description sees the flag too,
+	 * so it is put back however we exit, short of SIGKILL.
+	 */
+	if (!restoring) {
+		restoring = true;
+		atexit(outq_restore);
+		for (i = 0; i < sizeof fatal / sizeof fatal[0]; i++)
+			if (signal(fatal[i], outq_signal) == SIG_IGN)
+				signal(fatal[i], SIG_IGN);
+	}
+}
+
+/* outq_restore -- put stdout's file status flags back, if we changed
+ * them.  this is safe in a signal handler.
+ */
+static void
+outq_restore(void) {
+	if (stdout_q.nonblock) {
+		(void) fcntl(STDOUT_FILENO, F_SETFL, stdout_q.flags);
+		stdout_q.nonblock = false;
+	}
+}
+
+/* outq_signal -- dying of a signal, so put stdout back, and then die of
+ * it as we would have.
+ */
+static void
+outq_signal(int sig) {
+	outq_restore();
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/* outq_fini -- write out whatever is left, and put the fd back.
+ */
+static void
+outq_fini(struct outq *q) {
+	outq_flush(q, true);
+	if (q->watched) {
+		q->watched = false;
+		outq_watch(q);
+	}
+	if (q == &stdout_q)
+		outq_restore();
+	DESTROY(q->buf);
+	q->size = q->start = q->len = 0;
+}
+
+/* outq_put -- queue some output, and write as much as can be right now.
+ */
+static void
+outq_put(struct outq *q, const char *ptr, size_t len) {
+	if (q->closed)
+		return;
+	if (q->start + q->len + len > q->size) {
+		if (q->start != 0) {
+			memmove(q->buf, q->buf + q->start, q->len);
+			q->start = 0;
+		}
+		if (q->len + len > q->size) {
+			size_t size = q->size != 0 ? q->size : OUTQ_LOW;
+			char *buf;
+
+			while (size < q->len + len)
+				size *= 2;
+			buf = realloc(q->buf, size);
+			if (buf == NULL)
+				my_panic(true, "realloc");
+			q->buf = buf;
+			q->size = size;
+		}
+	}
+	memcpy(q->buf + q->start + q->len, ptr, len);
+	q->len += len;
+	outq_flush(q, false);
+}
+
+/* outq_direct -- as outq_put(), but when nothing is queued ahead, write
+ * straight from the caller's buffer, queueing only what is not taken.
+ */
+static void
+outq_direct(struct outq *q, const char *ptr, size_t len) {
+	while (q->len == 0 && len > 0 && !q->closed) {
+		ssize_t n = write(q->fd, ptr, len);
+
+		if (n > 0) {
+			ptr += n;
+			len -= (size_t)n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			/* outq_flush() will see to EAGAIN, or worse. */
+			break;
+		}
+	}
+	if (len > 0)
+		outq_put(q, ptr, len);
+}
+
+/* outq_flush -- write queued output.  if it would block, then if wait,
+ * wait for it; else have io_engine() call back when it can.
+ */
+static void
+outq_flush(struct outq *q, bool wait) {
+	while (q->len > 0 && !q->closed) {
+		ssize_t n = write(q->fd, q->buf + q->start, q->len);
+
+		if (n > 0) {
+			q->start += (size_t)n;
+			q->len -= (size_t)n;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd pfd = { q->fd, POLLOUT, 0 };
+
+			if (!wait) {
+				if (!q->watched) {
+					q->watched = true;
+					outq_watch(q);
+				}
+				return;
+			}
+			(void) poll(&pfd, 1, -1);
+		} else if (q->client != NULL) {
+			/* a client may hang up whenever it likes. */
+			DEBUG(1, true, "serve: client %lu gone: %s\n",
+			      q->client->serial, strerror(errno));
+			q->closed = true;
+			q->len = 0;
+		} else {
+			/* EPIPE or worse: nothing more can be output. */
+			if (errno != EPIPE)
+				my_logf("warning: stdout: %s",
+					strerror(errno));
+			DEBUG(1, true, "output closed, stopping\n");
+			q->closed = true;
+			q->len = 0;
+		}
+	}
+	q->start = 0;
+	if (q->watched) {
+		q->watched = false;
+		outq_watch(q);
+	}
+}
+
+/* outq_watch -- start or stop waiting for a queue's fd to be writable,
+ * according to q->watched.  a client's fd is also watched for requests.
+ */
+static void
+outq_watch(struct outq *q) {
+	if (q->client != NULL)
+		client_watch(q->client);
+	else
+		watch_set(q->fd, q->watched ? WATCH_WRITE : 0, outq_ready, q);
+}
+
+/* outq_ready -- stdout can take more output.
+ */
+static void
+outq_ready(int fd __attribute__ ((unused)),
+	   int events __attribute__ ((unused)),
+	   void *arg)
+{
+	outq_flush((struct outq *)arg, false);
+}
+
+/* outq_check -- see whether a queue has drained, or its reader gone away.
+ */
+static void
+outq_check(struct outq *q) {
+	if (q->closed)
+		outq_abort(q);
+	else if (q->paused > 0 && q->len < OUTQ_LOW)
+		outq_resume(q);
+}
+
+/* outq_resume -- let fetches paused for an output queue go on.
+ *
+ * resuming one can call writer_func() and change what is paused, so the
+ * search starts over after each.
+ */
+static void
+outq_resume(struct outq *q) {
+	writer_t writer;
+	fetch_t fetch;
+
+ again:
+	if (q->len >= OUTQ_HIGH || q->closed)
+		return;
+	for (writer = writers; writer != NULL; writer = writer->next) {
+		if (writer->query == NULL || writer->outq != q)
+			continue;
+		for (fetch = writer->query->fetches;
+		     fetch != NULL;
+		     fetch = fetch->next)
+			if (fetch->paused) {
+				fetch->paused = false;
+				fetch->active_ms = mono_ms();
+				q->paused--;
+				curl_easy_pause(fetch->easy, CURLPAUSE_CONT);
+				goto again;
+			}
+	}
+}
+
+/* outq_abort -- nobody reads an output queue, so end every fetch writing
+ * to it right away.
+ */
+static void
+outq_abort(struct outq *q) {
+	writer_t writer;
+	fetch_t fetch;
+
+ again:
+	for (writer = writers; writer != NULL; writer = writer->next) {
+		if (writer->query == NULL || writer->outq != q)
+			continue;
+		for (fetch = writer->query->fetches;
+		     fetch != NULL;
+		     fetch = fetch->next)
+		{
+			if (fetch->gated || fetch->retry_ms != 0) {
+				fetch_cancel(fetch);
+				goto again;
+			}
+			if (fetch->easy != NULL && !fetch->done) {
+				if (fetch->paused) {
+					fetch->paused = false;
+					q->paused--;
+				}
+				fetch->stopped = true;
+				fetch_end(fetch, CURLE_WRITE_ERROR);
+				goto again;
+			}
+		}
+	}
+}
+
+/* output_closed -- has the reader of our output gone away?
+ */
+bool
+output_closed(void) {
+	return stdout_q.closed;
+}
+
+/* serve_init -- listen for --serve clients on a unix socket, and hand
+ * each request line they send to func.  returns NULL or an error message.
+ */
+const char *
+serve_init(const char *path, serve_func_t func) {
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct stat sb;
+	int fd, e;
+
+	if (strlen(path) >= sizeof sun.sun_path)
+		return "socket path is too long";
+	strcpy(sun.sun_path, path);
+
+	/* a socket left behind by a daemon that has gone can be reused. */
+	if (lstat(path, &sb) == 0) {
+		if (!S_ISSOCK(sb.st_mode))
+			return "exists, and is not a socket";
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return strerror(errno);
+		e = connect(fd, (struct sockaddr *)&sun, sizeof sun);
+		close(fd);
+		if (e == 0)
+			return "another daemon is listening there";
+		unlink(path);
+	}
+
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return strerror(errno);
+	if (bind(fd, (struct sockaddr *)&sun, sizeof sun) < 0 ||
+	    listen(fd, SOMAXCONN) < 0 ||
+	    fcntl(fd, F_SETFL, O_NONBLOCK) < 0 ||
+	    fcntl(fd, F_SETFD, FD_CLOEXEC) < 0)
+	{
+		e = errno;
+		close(fd);
+		return strerror(e);
+	}
+	serve_fd = fd;
+	serve_path = strdup(path);
+	serve_func = func;
+	watch_set(serve_fd, WATCH_READ, serve_accept, NULL);
+	signal(SIGINT, serve_signal);
+	signal(SIGTERM, serve_signal);
+	DEBUG(1, true, "serve: listening on %s\n", serve_path);
+	return NULL;
+}
+
+/* serve_loop -- answer clients' requests until told to stop.
+ *
+ * each client's requests are answered in the order it sent them, one at
+ * a time, but all clients' queries share the io engine, and with it the
+ * connections to the server, which stay open between queries.
+ */
+void
+serve_loop(void) {
+	while (!serve_stop) {
+		/* let libcurl start any fetches new requests made. */
+		if (clients_run())
+			curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0,
+						 &multi_running);
+		io_step();
+	}
+	DEBUG(1, true, "serve: stopping, %lu clients seen\n", clients_seen);
+
+	watch_set(serve_fd, 0, NULL, NULL);
+	close(serve_fd);
+	serve_fd = -1;
+	unlink(serve_path);
+	DESTROY(serve_path);
+	while (clients != NULL) {
+		client_t client = clients;
+
+		clients = client->next;
+		client_free(client);
+	}
+}
+
+/* client_writer -- make a writer whose output goes to a --serve client,
+ * for the request it is to be answered next.
+ */
+writer_t
+client_writer(client_t client, long output_limit, const char *descr) {
+	writer_t writer = writer_init(output_limit, descr, false);
+
+	writer->outq = &client->outq;
+	client->writer = writer;
+	return writer;
+}
+
+/* client_reject -- tell a --serve client its request cannot be done.
+ */
+void
+client_reject(client_t client, const char *descr, const char *msg) {
+	char *text = strdup(msg), *nl, *reply;
+	int len;
+
+	/* some messages are two lines, but the reply to a request is one. */
+	while ((nl = strchr(text, '\n')) != NULL)
+		*nl = ' ';
+	len = asprintf(&reply, "++ %s\n-- %s (%s)\n",
+		       descr, status_error, text);
+	if (len < 0)
+		my_panic(true, "asprintf");
+	outq_put(&client->outq, reply, (size_t)len);
+	DESTROY(reply);
+	DESTROY(text);
+}
+
+/* serve_accept -- take on whatever new clients are waiting.
+ */
+static void
+serve_accept(int fd,
+	     int events __attribute__ ((unused)),
+	     void *arg __attribute__ ((unused)))
+{
+	client_t client = NULL;
+	int cfd;
+
+	for (;;) {
+		if ((cfd = accept(fd, NULL, NULL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != ECONNABORTED)
+				my_logf("warning: accept: %s",
+					strerror(errno));
+			return;
+		}
+		(void) fcntl(cfd, F_SETFL, O_NONBLOCK);
+		(void) fcntl(cfd, F_SETFD, FD_CLOEXEC);
+
+		CREATE(client, sizeof(struct client));
+		CREATE(client->in, CLIENT_IN_MAX);
+		client->fd = cfd;
+		client->serial = ++clients_seen;
+		client->outq.fd = cfd;
+		client->outq.client = client;
+		client->next = clients;
+		clients = client;
+		client_watch(client);
+		DEBUG(1, true, "serve: client %lu connected\n", client->serial);
+		client = NULL;
+	}
+}
+
+/* serve_signal -- asked to stop, so do so after whatever is happening.
+ */
+static void
+serve_signal(int sig __attribute__ ((unused))) {
+	serve_stop = 1;
+}
+
+/* clients_run -- start on each idle client's next request, and let go
+ * of those which are done.  returns true if any request was started.
+ */
+static bool
+clients_run(void) {
+	bool started = false;
+	client_t client, *pc;
+
+	for (pc = &clients; (client = *pc) != NULL; ) {
+		char *nl;
+
+		while (client->writer == NULL && !client->outq.closed &&
+		       (nl = memchr(client->in, '\n', client->in_len)) != NULL)
+		{
+			size_t len = (size_t)(nl - client->in);
+			char *line = strndup(client->in, len);
+
+			client->in_len -= len + 1;
+			memmove(client->in, nl + 1, client->in_len);
+			if (line[strspn(line, "\040\t\r")] != '\0') {
+				DEBUG(1, true, "serve: client %lu: %s\n",
+				      client->serial, line);
+				serve_func(client, line);
+				started = true;
+			}
+			DESTROY(line);
+		}
+
+		/* a request must fit in the buffer. */
+		if (client->writer == NULL && client->in_len == CLIENT_IN_MAX)
+		{
+			client_reject(client, "?", "request is too long");
+			client->in_len = 0;
+			client->eof = true;
+		}
+		client_watch(client);
+
+		/* let go of a client once it has hung up, or has been
+		 * answered in full and will send no more.
+		 */
+		if (client->outq.closed ||
+		    (client->eof && client->writer == NULL &&
+		     client->in_len == 0 && client->outq.len == 0))
+		{
+			*pc = client->next;
+			client_free(client);
+			continue;
+		}
+		pc = &client->next;
+	}
+	return started;
+}
+
+/* client_ready -- a client has sent something, can take more output, or
+ * has hung up.
+ */
+static void
+client_ready(int fd __attribute__ ((unused)), int events, void *arg) {
+	client_t client = (client_t) arg;
+
+	if ((events & WATCH_WRITE) != 0)
+		outq_flush(&client->outq, false);
+	if ((events & WATCH_READ) != 0)
+		client_read(client);
+	else if ((events & WATCH_ERROR) != 0)
+		client->outq.closed = true;
+	client_watch(client);
+}
+
+/* client_read -- take in what a client has sent, as far as it fits.
+ */
+static void
+client_read(client_t client) {
+	while (!client->eof && client->in_len < CLIENT_IN_MAX) {
+		ssize_t n = read(client->fd, client->in + client->in_len,
+				 CLIENT_IN_MAX - client->in_len);
+
+		if (n > 0) {
+			client->in_len += (size_t)n;
+		} else if (n == 0) {
+			/* a last request need not end with a newline. */
+			client->eof = true;
+			if (client->in_len > 0 &&
+			    client->in_len < CLIENT_IN_MAX &&
+			    client->in[client->in_len - 1] != '\n')
+				client->in[client->in_len++] = '\n';
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			break;
+		} else {
+			client->eof = true;
+			client->outq.closed = true;
+		}
+	}
+}
+
+/* client_watch -- watch a client's fd for what we want of it now: more
+ * requests if there is room for them, and room for output if its queue
+ * is waiting for that.
+ */
+static void
+client_watch(client_t client) {
+	int events = 0;
+
+	if (client->outq.closed)
+		events = 0;
+	else if (!client->eof && client->in_len < CLIENT_IN_MAX)
+		events |= WATCH_READ;
+	if (client->outq.watched && !client->outq.closed)
+		events |= WATCH_WRITE;
+	if (events != client->events) {
+		watch_set(client->fd, events, client_ready, client);
+		client->events = events;
+	}
+}
+
+/* client_free -- hang up on a client, abandoning any query of its.
+ */
+static void
+client_free(client_t client) {
+	writer_t writer = client->writer;
+
+	if (writer != NULL) {
+		while (writer->query != NULL && writer->query->fetches != NULL)
+			fetch_cancel(writer->query->fetches);
+		client->outq.closed = true;
+		writer_fini(writer);
+	}
+	if (client->events != 0)
+		watch_set(client->fd, 0, NULL, NULL);
+	close(client->fd);
+	DEBUG(1, true, "serve: client %lu done\n", client->serial);
+	DESTROY(client->outq.buf);
+	DESTROY(client->in);
+	DESTROY(client);
+}
+
+/* mono_ms -- milliseconds on a clock that does not jump.
+ */
+static long long
+mono_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* saf_cond_name -- give the printable name of a SAF condition.
+ */
+const char *
+saf_cond_name(saf_cond_e cond) {
+	switch (cond) {
+	case sc_init:
+		return "init";
+	case sc_begin:
+		return saf_begin;
+	case sc_ongoing:
+		return saf_ongoing;
+	case sc_succeeded:
+		return saf_succeeded;
+	case sc_limited:
+		return saf_limited;
+	case sc_failed:
+		return saf_failed;
+	case sc_we_limited:
+		return "output limited";
+	case sc_missing:
+		return "response_missing";
 	}
+	return "unknown";
 }
 
 /* escape -- HTML-encode a string, in place.
@@ -37,6 +37,7 @@ struct qdesc {
 	u_long		  after;
 	u_long		  before;
 	bool		  complete;
+	bool		  force;
 	long		  query_limit;
 	long		  output_limit;
 	long		  offset;
@@ -44,6 +45,13 @@ struct qdesc {
 typedef struct qdesc *qdesc_t;
 typedef const struct qdesc *qdesc_ct;
 
+/* time fence, sent to the server as time_{first,last}_{after,before}. */
+struct pdns_fence {
+	u_long	first_after, first_before, last_after, last_before;
+};
+typedef struct pdns_fence pdns_fence_t;
+typedef const struct pdns_fence *pdns_fence_ct;
+
 /* official SAF condition values, plus sc_init, sc_we_limited, and sc_missing.
  */
 typedef enum {
@@ -56,20 +64,73 @@ typedef enum {
 
 /* API fetch. */
 struct fetch {
+	struct fetch	*next;
 	struct query	*query;
 	CURL		*easy;
 	struct curl_slist  *hdrs;
 	char		*url;
+	/* len bytes received but not yet deblocked are at buf + start,
+	 * and the first scan of them have no newline.  size is buf's.
+	 */
 	char		*buf;
-	size_t		len;
+	size_t		size, start, len, scan;
 	long		rcode;
 	bool		stopped;
+	/* time fence, offset, and SAF condition of this fetch alone. */
+	struct pdns_fence fence;
+	long		offset;
+	saf_cond_e	saf_cond;
+	char		*saf_msg;
+	/* results this fetch has output. */
+	int		count;
+	/* a page buffered until earlier pages are output; done means
+	 * libcurl has finished with it.
+	 */
+	bool		held;
+	bool		done;
+	/* times tried again; when to next, if waiting; last sign of life. */
+	int		attempts;
+	long long	retry_ms;
+	long long	active_ms;
+	/* waiting for the rate limiter, behind gate_next. */
+	bool		gated;
+	struct fetch	*gate_next;
+	/* paused until the output queue drains. */
+	bool		paused;
+	/* this attempt's recording or replay. */
+	struct record	*rec;
+	/* this attempt's cache entry, being read if a hit, else written. */
+	struct cache	*cache;
+	/* the HTTP version this attempt's response came in, or 0. */
+	long		http_version;
+	/* when this attempt was given to libcurl, and when it first got
+	 * data.  a fetch slow to get any can be raced by a hedge, its twin;
+	 * whichever gets data first goes on, and the other has lost.
+	 */
+	long long	admit_ms;
+	long long	first_ms;
+	struct fetch	*twin;
+	bool		is_hedge;
+	bool		lost;
+	/* with --raw: octets output, how many were in lines found to carry
+	 * no results, and whether the first line has been looked at.
+	 */
+	size_t		raw_out, raw_empty;
+	bool		raw_begun;
+	/* with --workers: batches of its lines not yet output. */
+	int		work_batches;
+	/* with --bisect: how many times the query was split to make this
+	 * part, and tuples it output which no part but it and those split
+	 * from it could return again.
+	 */
+	int		splits;
+	struct tuple_set *seen;
 };
 typedef struct fetch *fetch_t;
 
 /* one query. */
 struct query {
-	struct fetch	*fetch;
+	struct fetch	*fetches;
 	struct writer	*writer;
 	struct qdesc	qd;
 	char		*command;
@@ -77,28 +138,79 @@ struct query {
 	char		*status;
 	char		*message;
 	bool		hdr_sent;
+	/* overall SAF condition, gathered from fetches as they end. */
 	saf_cond_e	saf_cond;
 	char		*saf_msg;
+	/* tuples presented so far which more than one part of a bisected
+	 * query could return, and whether a part was split as far as it
+	 * may be and was still limited.
+	 */
+	struct tuple_set *seen;
+	bool		split_out;
+	/* offset of the next page to launch, if paginating. */
+	long		next_offset;
+	/* response octets as received, and as decoded. */
+	curl_off_t	wire_bytes;
+	curl_off_t	body_bytes;
+	/* for --stats: what was seen, and each fetch attempt's timings. */
+	long		lines, tuples, keepalives;
+	long		rcode;
+	long long	start_ms;
+	struct json_t	*attempts;
+	/* with --raw, whether any line not known to be empty was output. */
+	bool		raw_results;
 };
 typedef struct query *query_t;
 
 /* one output stream. */
 struct writer {
+	struct writer	*next;
 	struct query	*query;
+	/* batch line this writer's output is tagged with, if batching. */
+	char		*descr;
+	/* where presenters write, on its way to outq unless held. */
+	FILE		*out;
+	bool		held;
+	struct outq	*outq;
+	char		*out_buf;
+	size_t		out_len;
+	/* previous line emitted by present_batch_dedup_rrtype(). */
+	char		*last_printed;
 	long		output_limit;
 	int		count;
 };
 typedef struct writer *writer_t;
 
+/* events a watched file descriptor can have. */
+#define WATCH_READ	0x1
+#define WATCH_WRITE	0x2
+#define WATCH_ERROR	0x4
+typedef void (*watch_func_t)(int, int, void *);
+
+/* a --serve client, and what is done with each request it sends. */
+typedef struct client *client_t;
+typedef void (*serve_func_t)(client_t, char *);
+
 void make_curl(void);
 void unmake_curl(void);
-void create_fetch(query_t, char *);
-writer_t writer_init(long);
+void prewarm_start(const char *);
+void prewarm_check(const char *);
+void prewarm_finish(void);
+fetch_t create_fetch(query_t, char *);
+fetch_t launch_fetch(query_t, pdns_fence_ct, long);
+writer_t writer_init(long, const char *, bool);
 void query_status(query_t, const char *, const char *);
 size_t writer_func(char *ptr, size_t size, size_t nmemb, void *blob);
 void writer_fini(writer_t);
 void unmake_writers(void);
 void io_engine(int);
+void work_drain(void);
+bool output_closed(void);
+const char *serve_init(const char *, serve_func_t);
+void serve_loop(void);
+writer_t client_writer(client_t, long, const char *);
+void client_reject(client_t, const char *, const char *);
 void escape(CURL *, char **);
+const char *saf_cond_name(saf_cond_e);
 
 #endif /*NETIO_H_INCLUDED*/
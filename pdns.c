@@ -14,12 +14,19 @@
  * limitations under the License.
  */
 
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "defs.h"
 #include "netio.h"
 #include "pdns.h"
+#include "sindex.h"
+#include "arena.h"
 #include "time.h"
 #include "globals.h"
 
@@ -66,63 +73,94 @@ rrtype_ok_to_print_literal(const char *rrtype) {
 
 /* present_json -- render one tuple as newline-separated JSON.
  */
-void
+bool
 present_json(pdns_tuple_ct tup,
 	     const char *jsonbuf __attribute__ ((unused)),
 	     size_t jsonlen __attribute__ ((unused)),
-	     writer_t writer __attribute__ ((unused)))
+	     writer_t writer)
 {
-	json_dumpf(tup->obj.saf_obj, stdout, JSON_INDENT(0) | JSON_COMPACT);
-	putchar('\n');
+	const json_t *obj = tup->obj.saf_obj;
+	json_t *parsed = NULL;
+	json_error_t error;
+
+	/* a plain obj goes out as the server sent it. */
+	if (tup->obj_plain) {
+		fwrite(tup->obj_json, 1, tup->obj_len, writer->out);
+		putc('\n', writer->out);
+		return true;
+	}
+
+	/* a scanned tuple has only the obj's text, so parse just that. */
+	if (obj == NULL) {
+		parsed = json_loadb(tup->obj_json, tup->obj_len, 0, &error);
+		if (parsed == NULL) {
+			my_logf("warning: json_loadb: %d:%d: %s %s",
+				error.line, error.column,
+				error.text, error.source);
+			return false;
+		}
+		obj = parsed;
+	}
+	json_dumpf(obj, writer->out, JSON_INDENT(0) | JSON_COMPACT);
+	putc('\n', writer->out);
+	json_decref(parsed);
+	return true;
 }
 
 /* present_batch -- render one tuple in a dnsdbq batch input file form,
  * don't deduplicate repeated rrtypes.
  */
-void
+bool
 present_batch(pdns_tuple_ct tup,
 	      const char *jsonbuf __attribute__ ((unused)),
 	      size_t jsonlen __attribute__ ((unused)),
-	      writer_t writer __attribute__ ((unused)))
+	      writer_t writer)
 {
 	if (tup->rrname != NULL) {
-		printf("rrset/name/%s/%s\n", tup->rrname, tup->rrtype);
+		fprintf(writer->out, "rrset/name/%s/%s\n",
+			tup->rrname, tup->rrtype);
 	} else if (tup->rdata != NULL) {
 		if (rrtype_ok_to_print_literal(tup->rrtype))
-		    printf("rdata/name/%s/%s\n",
-			   tup->rdata, tup->rrtype);
+		    fprintf(writer->out, "rdata/name/%s/%s\n",
+			    tup->rdata, tup->rrtype);
 		else {
-			printf("rdata/raw/%s/%s\n",
-			       tup->raw_rdata, tup->rrtype);
-			printf("# rdata/name/%s/%s\n",
-			       tup->rdata, tup->rrtype);
+			fprintf(writer->out, "rdata/raw/%s/%s\n",
+				tup->raw_rdata, tup->rrtype);
+			fprintf(writer->out, "# rdata/name/%s/%s\n",
+				tup->rdata, tup->rrtype);
 		}
 	} else
 		my_panic(true, "present_batch");
+	return true;
 }
 
 /* present_batch_dedup_rrtype -- render one tuple in a dnsdbq batch input file
  * form, but deduplicate rrtypes
  */
-void
+bool
 present_batch_dedup_rrtype(pdns_tuple_ct tup,
 	      const char *jsonbuf __attribute__ ((unused)),
 	      size_t jsonlen __attribute__ ((unused)),
-	      writer_t writer __attribute__ ((unused)))
+	      writer_t writer)
 {
-	/* maintain a one-element "cache" of our previous print out */
+	/* maintain a one-element "cache" of our previous print out,
+	 * per writer since batched queries each have their own output.
+	 */
 #define MAX_BATCH_LINE 8192
-	static char last_printed[MAX_BATCH_LINE] = { '\0' };
 	char new_printed[MAX_BATCH_LINE];
 
+	if (writer->last_printed == NULL) {
+		CREATE(writer->last_printed, MAX_BATCH_LINE);
+	}
 	if (tup->rrname != NULL) {
 		snprintf(new_printed, sizeof new_printed,
 			 "rrset/name/%s\n", tup->rrname);
-		if (strcmp(new_printed, last_printed) != 0) {
-			fputs(new_printed, stdout);
-			strcpy(last_printed, new_printed);
+		if (strcmp(new_printed, writer->last_printed) != 0) {
+			fputs(new_printed, writer->out);
+			strcpy(writer->last_printed, new_printed);
 		}
-		printf("# rrset/name/%s/%s\n", tup->rrname, tup->rrtype);
+		fprintf(writer->out, "# rrset/name/%s/%s\n",
+			tup->rrname, tup->rrtype);
 	} else if (tup->rdata != NULL) {
 		if (rrtype_ok_to_print_literal(tup->rrtype))
 			snprintf(new_printed, sizeof new_printed,
@@ -130,26 +168,551 @@ present_batch_dedup_rrtype(pdns_tuple_ct tup,
 		else
 			snprintf(new_printed, sizeof new_printed,
 				 "rdata/raw/%s\n", tup->raw_rdata);
-		if (strcmp(new_printed, last_printed) != 0) {
-			fputs(new_printed, stdout);
-			strcpy(last_printed, new_printed);
+		if (strcmp(new_printed, writer->last_printed) != 0) {
+			fputs(new_printed, writer->out);
+			strcpy(writer->last_printed, new_printed);
 		}
-		printf("# rdata/name/%s/%s\n", tup->rdata, tup->rrtype);
+		fprintf(writer->out, "# rdata/name/%s/%s\n",
+			tup->rdata, tup->rrtype);
 
 	} else
 		my_panic(true, "present_batch_dedup_rrtype");
+	return true;
+}
+
+
+/* a SAF line being scanned, with a structural index covering it, and
+ * where its tuple's strings are going.
+ */
+struct saf_scan {
+	const char	*p, *end;
+	sindex_ct	ix;
+	pdns_tuple_t	tup;
+	size_t		used;
+};
+
+/* how deep into objects and arrays scan_skip() will go. */
+#define SCAN_DEPTH 32
+
+/* a line given to tuple_make() without an index is indexed here. */
+static struct sindex line_ix;
+
+/* scan_ws -- skip JSON whitespace.
+ */
+static void
+scan_ws(struct saf_scan *scan) {
+	while (scan->p < scan->end &&
+	       (*scan->p == ' ' || *scan->p == '\t' ||
+		*scan->p == '\n' || *scan->p == '\r'))
+		scan->p++;
+}
+
+/* scan_char -- skip whitespace and then this character, if it is next.
+ */
+static bool
+scan_char(struct saf_scan *scan, char ch) {
+	scan_ws(scan);
+	if (scan->p == scan->end || *scan->p != ch)
+		return false;
+	scan->p++;
+	return true;
+}
+
+/* scan_at -- where a pointer into the line falls in the index.
+ */
+static size_t
+scan_at(const struct saf_scan *scan, const char *p) {
+	return (size_t)(p - scan->ix->base);
+}
+
+/* scan_close -- find the quote closing a string whose contents begin at
+ * the current position, going from one quote in the index to the next.
+ * a quote is escaped if an odd number of backslashes come just before it.
+ *
+ * returns NULL if the string is not closed in this line.
+ */
+static const char *
+scan_close(const struct saf_scan *scan) {
+	sindex_ct ix = scan->ix;
+	size_t at = scan_at(scan, scan->p), end = scan_at(scan, scan->end),
+		open = at;
+
+	for (;;) {
+		size_t q = sindex_next(ix->quote, at, end), n = 0;
+
+		if (q == end)
+			return NULL;
+		while (q - n > open && ix->base[q - n - 1] == '\\')
+			n++;
+		if (n % 2 == 0)
+			return ix->base + q;
+		at = q + 1;
+	}
+}
+
+/* scan_key -- take a member's name and the colon after it.  names with
+ * escapes, or which are not ASCII, are left to jansson.
+ */
+static bool
+scan_key(struct saf_scan *scan, const char **key, size_t *keylen) {
+	const char *close;
+
+	if (!scan_char(scan, '"'))
+		return false;
+	close = scan_close(scan);
+	if (close == NULL ||
+	    sindex_any(scan->ix->bslash, scan_at(scan, scan->p),
+		       scan_at(scan, close)) ||
+	    sindex_any(scan->ix->odd, scan_at(scan, scan->p),
+		       scan_at(scan, close)))
+		return false;
+	*key = scan->p;
+	*keylen = (size_t)(close - scan->p);
+	scan->p = close + 1;
+	return scan_char(scan, ':');
+}
+
+/* key_is -- is this member name the given one?
+ */
+static bool
+key_is(const char *key, size_t keylen, const char *name) {
+	return strlen(name) == keylen && memcmp(key, name, keylen) == 0;
 }
 
+/* scan_string -- copy a string value into the tuple's scratch space.
+ * only the simple escapes and ASCII are handled; \u escapes and UTF-8,
+ * which jansson would check, are left to it.
+ */
+static bool
+scan_string(struct saf_scan *scan, const char **str) {
+	char *out = scan->tup->scratch + scan->used,
+		*limit = scan->tup->scratch + TUPLE_SCRATCH - 1;
+	const char *close;
+
+	if (!scan_char(scan, '"'))
+		return false;
+	*str = out;
+	/* most strings need no decoding, and are copied whole. */
+	close = scan_close(scan);
+	if (close != NULL) {
+		size_t from = scan_at(scan, scan->p), to = scan_at(scan, close),
+			len = to - from;
+
+		if (!sindex_any(scan->ix->bslash, from, to) &&
+		    !sindex_any(scan->ix->odd, from, to))
+		{
+			if (len >= (size_t)(limit - out))
+				return false;
+			memcpy(out, scan->p, len);
+			out[len] = '\0';
+			scan->used += len + 1;
+			scan->p = close + 1;
+			return true;
+		}
+	}
+	while (scan->p < scan->end && out < limit) {
+		u_char ch = (u_char)*scan->p++;
+
+		if (ch == '"') {
+			*out++ = '\0';
+			scan->used = (size_t)(out - scan->tup->scratch);
+			return true;
+		}
+		if (ch < 0x20 || ch >= 0x80)
+			return false;
+		if (ch == '\\') {
+			if (scan->p == scan->end)
+				return false;
+			switch (*scan->p++) {
+			case '"':  ch = '"'; break;
+			case '\\': ch = '\\'; break;
+			case '/':  ch = '/'; break;
+			case 'b':  ch = '\b'; break;
+			case 'f':  ch = '\f'; break;
+			case 'n':  ch = '\n'; break;
+			case 'r':  ch = '\r'; break;
+			case 't':  ch = '\t'; break;
+			default:
+				return false;
+			}
+		}
+		*out++ = (char)ch;
+	}
+	return false;
+}
+
+/* scan_integer -- take an integer value.  anything else, such as a
+ * fraction, is left to jansson to complain about.
+ */
+static bool
+scan_integer(struct saf_scan *scan, json_int_t *value) {
+	bool neg;
+	uint64_t v = 0;
+
+	scan_ws(scan);
+	neg = scan->p < scan->end && *scan->p == '-';
+	if (neg)
+		scan->p++;
+	if (scan->p == scan->end || !isdigit((u_char)*scan->p))
+		return false;
+	/* JSON has no leading zeros. */
+	if (*scan->p == '0' && scan->p + 1 < scan->end &&
+	    isdigit((u_char)scan->p[1]))
+		return false;
+	while (scan->p < scan->end && isdigit((u_char)*scan->p)) {
+		v = v * 10 + (uint64_t)(*scan->p++ - '0');
+		if (v > INT64_MAX)
+			return false;
+	}
+	if (scan->p < scan->end &&
+	    (*scan->p == '.' || *scan->p == 'e' || *scan->p == 'E'))
+		return false;
+	*value = neg ? -(json_int_t)v : (json_int_t)v;
+	return true;
+}
+
+/* skip_string -- pass over a string value, checking its escapes.  \u
+ * escapes and octets which are not ASCII, which jansson would check, are
+ * left to it.
+ */
+static bool
+skip_string(struct saf_scan *scan) {
+	sindex_ct ix = scan->ix;
+	const char *close;
+	size_t from, to, b;
+
+	if (!scan_char(scan, '"'))
+		return false;
+	if ((close = scan_close(scan)) == NULL)
+		return false;
+	from = scan_at(scan, scan->p);
+	to = scan_at(scan, close);
+	if (sindex_any(ix->odd, from, to))
+		return false;
+	for (b = sindex_next(ix->bslash, from, to);
+	     b < to;
+	     b = sindex_next(ix->bslash, b + 2, to))
+		if (strchr("\"\\/bfnrt", ix->base[b + 1]) == NULL)
+			return false;
+	scan->p = close + 1;
+	return true;
+}
+
+/* skip_word -- pass over a literal, such as true.
+ */
+static bool
+skip_word(struct saf_scan *scan, const char *word) {
+	size_t len = strlen(word);
+
+	if ((size_t)(scan->end - scan->p) < len ||
+	    memcmp(scan->p, word, len) != 0)
+		return false;
+	scan->p += len;
+	return true;
+}
+
+/* skip_value -- pass over a value, going no more than depth levels into
+ * objects and arrays.
+ */
+static bool
+skip_value(struct saf_scan *scan, int depth) {
+	const char *key;
+	size_t keylen;
+	json_int_t value;
+	char close;
+
+	scan_ws(scan);
+	if (scan->p == scan->end)
+		return false;
+	switch (*scan->p) {
+	case '"':
+		return skip_string(scan);
+	case 't':
+		return skip_word(scan, "true");
+	case 'f':
+		return skip_word(scan, "false");
+	case 'n':
+		return skip_word(scan, "null");
+	case '{':
+	case '[':
+		if (depth == 0)
+			return false;
+		close = *scan->p++ == '{' ? '}' : ']';
+		if (scan_char(scan, close))
+			return true;
+		do {
+			if (close == '}' && !scan_key(scan, &key, &keylen))
+				return false;
+			if (!skip_value(scan, depth - 1))
+				return false;
+		} while (scan_char(scan, ','));
+		return scan_char(scan, close);
+	default:
+		return scan_integer(scan, &value);
+	}
+}
+
+/* scan_skip -- pass over a value we have no use for, checking it as
+ * jansson would.  what is not checked here, such as a fraction or a
+ * value nested too deeply, is left to jansson.
+ */
+static bool
+scan_skip(struct saf_scan *scan) {
+	return skip_value(scan, SCAN_DEPTH);
+}
+
+/* scan_obj -- take the fields we use from a SAF obj, skipping the rest.
+ */
+static bool
+scan_obj(struct saf_scan *scan) {
+	pdns_tuple_t tup = scan->tup;
+	const char *key;
+	size_t keylen;
+	json_int_t value;
+
+	if (!scan_char(scan, '{'))
+		return false;
+	if (scan_char(scan, '}'))
+		return true;
+	do {
+		if (!scan_key(scan, &key, &keylen))
+			return false;
+		if (key_is(key, keylen, "rrname")) {
+			if (!scan_string(scan, &tup->rrname))
+				return false;
+		} else if (key_is(key, keylen, "rrtype")) {
+			if (!scan_string(scan, &tup->rrtype))
+				return false;
+		} else if (key_is(key, keylen, "rdata")) {
+			if (!scan_string(scan, &tup->rdata))
+				return false;
+		} else if (key_is(key, keylen, "raw_rdata")) {
+			if (!scan_string(scan, &tup->raw_rdata))
+				return false;
+		} else if (key_is(key, keylen, "count")) {
+			if (!scan_integer(scan, &tup->count))
+				return false;
+		} else if (key_is(key, keylen, "time_first")) {
+			if (!scan_integer(scan, &value))
+				return false;
+			tup->time_first = (u_long)value;
+		} else if (key_is(key, keylen, "time_last")) {
+			if (!scan_integer(scan, &value))
+				return false;
+			tup->time_last = (u_long)value;
+		} else if (!scan_skip(scan)) {
+			return false;
+		}
+	} while (scan_char(scan, ','));
+	return scan_char(scan, '}');
+}
+
+/* plain_string -- pass over a string whose escapes are all ones jansson
+ * would write the same way.
+ *
+ * returns where the string ends, or NULL if it is not so plain.
+ */
+static const char *
+plain_string(struct saf_scan *scan, const char *p) {
+	const char *close;
+	size_t b, to;
+
+	scan->p = p + 1;
+	if ((close = scan_close(scan)) == NULL)
+		return NULL;
+	to = scan_at(scan, close);
+	for (b = sindex_next(scan->ix->bslash, scan_at(scan, scan->p), to);
+	     b < to;
+	     b = sindex_next(scan->ix->bslash, b + 2, to))
+		if (strchr("\"\\bfnrt", scan->ix->base[b + 1]) == NULL)
+			return NULL;
+	return close + 1;
+}
+
+/* plain_integer -- pass over an integer as jansson would write it.
+ *
+ * returns where it ends, or NULL if it is not one, or might not fit.
+ */
+static const char *
+plain_integer(const char *p, const char *end) {
+	const char *digits;
+
+	if (*p == '-')
+		p++;
+	digits = p;
+	while (p < end && isdigit((u_char)*p))
+		p++;
+	if (p == digits || p - digits > 18 ||
+	    (*digits == '0' && (p - digits > 1 || digits[-1] == '-')))
+		return NULL;
+	return p;
+}
+
+/* plain_word -- pass over true, false, or null.
+ *
+ * returns where it ends, or NULL if it is none of them.
+ */
+static const char *
+plain_word(const char *p, const char *end) {
+	static const char *words[] = { "true", "false", "null", NULL };
+	const char **word;
+
+	for (word = words; *word != NULL; word++) {
+		size_t len = strlen(*word);
+
+		if ((size_t)(end - p) >= len && memcmp(p, *word, len) == 0)
+			return p + len;
+	}
+	return NULL;
+}
+
+/* obj_plain -- would jansson write a SAF obj back out, compactly, as
+ * the very octets it came in?  it would if they hold no whitespace, no
+ * numbers but integers, no escapes but the ones it writes, and nothing
+ * but ASCII.  nested objects, and names given twice, which it could
+ * reorder or fold, are not looked into and count as not plain.
+ */
+static bool
+obj_plain(const struct saf_scan *scan, const char *p, const char *end) {
+	enum { want_key, want_colon, want_value, want_more } want = want_key;
+	struct saf_scan walk = *scan;
+	const char *keys[16];
+	size_t keylens[16];
+	int nkeys = 0, depth = 1, i;
+	bool closable = true;
+
+	if (sindex_any(scan->ix->odd, scan_at(scan, p), scan_at(scan, end)) ||
+	    p == end || *p++ != '{')
+		return false;
+	while (p < end && depth > 0) {
+		const char *q = NULL;
+
+		if ((*p == '}' || *p == ']') &&
+		    (want == want_more || closable))
+		{
+			if ((*p == '}') != (depth == 1))
+				return false;
+			depth--;
+			want = want_more;
+			closable = false;
+			p++;
+			continue;
+		}
+		closable = false;
+		switch (want) {
+		case want_key:
+			if (*p != '"' || (q = plain_string(&walk, p)) == NULL ||
+			    nkeys == 16)
+				return false;
+			for (i = 0; i < nkeys; i++)
+				if (keylens[i] == (size_t)(q - p) &&
+				    memcmp(keys[i], p, keylens[i]) == 0)
+					return false;
+			keys[nkeys] = p;
+			keylens[nkeys++] = (size_t)(q - p);
+			want = want_colon;
+			break;
+		case want_colon:
+			if (*p != ':')
+				return false;
+			q = p + 1;
+			want = want_value;
+			break;
+		case want_value:
+			want = want_more;
+			if (*p == '"') {
+				q = plain_string(&walk, p);
+			} else if (*p == '-' || isdigit((u_char)*p)) {
+				q = plain_integer(p, end);
+			} else if (*p == '[') {
+				q = p + 1;
+				depth++;
+				closable = true;
+				want = want_value;
+			} else {
+				q = plain_word(p, end);
+			}
+			break;
+		case want_more:
+			if (*p != ',')
+				return false;
+			q = p + 1;
+			want = depth == 1 ? want_key : want_value;
+			break;
+		}
+		if (q == NULL)
+			return false;
+		p = q;
+	}
+	return p == end && depth == 0;
+}
+
+/* tuple_scan -- fill in a tuple from a SAF line without building any
+ * JSON objects, as tuple_make() would using jansson.
+ *
+ * returns false if the line is not the usual shape, or is malformed, in
+ * which case jansson should be asked.
+ */
+static bool
+tuple_scan(pdns_tuple_t tup, const char *buf, size_t len, sindex_ct ix) {
+	struct saf_scan scan = { buf, buf + len, ix, tup, 0 };
+	const char *key;
+	size_t keylen;
+
+	if (!scan_char(&scan, '{'))
+		return false;
+	if (!scan_char(&scan, '}')) {
+		do {
+			if (!scan_key(&scan, &key, &keylen))
+				return false;
+			if (key_is(key, keylen, "cond")) {
+				if (!scan_string(&scan, &tup->cond))
+					return false;
+			} else if (key_is(key, keylen, "msg")) {
+				if (!scan_string(&scan, &tup->msg))
+					return false;
+			} else if (key_is(key, keylen, "obj")) {
+				scan_ws(&scan);
+				tup->obj_json = scan.p;
+				if (!scan_obj(&scan))
+					return false;
+				tup->obj_len = (size_t)(scan.p -
+							tup->obj_json);
+				if (presenter == present_json)
+					tup->obj_plain = obj_plain(&scan,
+						tup->obj_json, scan.p);
+			} else if (!scan_skip(&scan)) {
+				return false;
+			}
+		} while (scan_char(&scan, ','));
+		if (!scan_char(&scan, '}'))
+			return false;
+	}
+	scan_ws(&scan);
+	return scan.p == scan.end;
+}
 
 /* tuple_make -- create one DNSDB tuple object out of a JSON object.
+ *
+ * the line may come with a structural index covering it, or NULL.
  */
 const char *
-tuple_make(pdns_tuple_t tup, const char *buf, size_t len) {
+tuple_make(pdns_tuple_t tup, const char *buf, size_t len, sindex_ct ix) {
 	const char *msg = NULL;
 	json_error_t error;
 
-	memset(tup, 0, sizeof *tup);
+	memset(tup, 0, offsetof(struct pdns_tuple, scratch));
 	DEBUG(4, true, "[%d] '%-*.*s'\n", (int)len, (int)len, (int)len, buf);
+	/* jansson is still used for -dddd, to show the line as it sees it. */
+	if (debug_level < 4) {
+		if (ix == NULL) {
+			sindex_build(&line_ix, buf, len);
+			ix = &line_ix;
+		}
+		if (tuple_scan(tup, buf, len, ix))
+			return (NULL);
+	}
+	memset(tup, 0, offsetof(struct pdns_tuple, scratch));
 	tup->obj.main = json_loadb(buf, len, 0, &error);
 	if (tup->obj.main == NULL) {
 		my_logf("warning: json_loadb: %d:%d: %s %s",
@@ -160,7 +723,7 @@ tuple_make(pdns_tuple_t tup, const char *buf, size_t len) {
 	if (debug_level >= 4) {
 		char *pretty = json_dumps(tup->obj.main, JSON_INDENT(2));
 		debug(false, "%s\n", pretty);
-		free(pretty);
+		arena_free(pretty);
 	}
 
 	tup->obj.saf_cond = json_object_get(tup->obj.main, "cond");
@@ -270,68 +833,275 @@ tuple_unmake(pdns_tuple_t tup) {
 	json_decref(tup->obj.main);
 }
 
-/* data_blob -- process one deblocked json blob as a counted string.
+/* tuple_saf -- take note of a tuple's SAF cond and msg for its fetch.
+ *
+ * returns true if the tuple carries no results, being a SAF begin or
+ * end, or a COF keepalive.
+ */
+static bool
+tuple_saf(fetch_t fetch, pdns_tuple_ct tup) {
+	/* a msg is kept past the chunk it came in, so is copied, but only
+	 * when it changes.
+	 */
+	if (tup->msg != NULL) {
+		DEBUG(5, true, "data_blob tup.msg = %s\n", tup->msg);
+		if (fetch->saf_msg == NULL ||
+		    strcmp(fetch->saf_msg, tup->msg) != 0)
+		{
+			DESTROY(fetch->saf_msg);
+			fetch->saf_msg = strdup(tup->msg);
+		}
+	}
+
+	if (tup->cond != NULL) {
+		DEBUG(5, true, "data_blob tup.cond = %s\n", tup->cond);
+		/* if we return true now, this line will not be counted */
+		if (strcmp(tup->cond, "begin") == 0) {
+			fetch->saf_cond = sc_begin;
+			return true;
+		} else if (strcmp(tup->cond, "ongoing") == 0) {
+			/* "cond":"ongoing" key vals should
+			 * be ignored but the rest of line used. */
+			fetch->saf_cond = sc_ongoing;
+		} else if (strcmp(tup->cond, "succeeded") == 0) {
+			fetch->saf_cond = sc_succeeded;
+			return true;
+		} else if (strcmp(tup->cond, "limited") == 0) {
+			fetch->saf_cond = sc_limited;
+			return true;
+		} else if (strcmp(tup->cond, "failed") == 0) {
+			fetch->saf_cond = sc_failed;
+			return true;
+		} else {
+			/* use sc_missing for an invalid cond value  */
+			fetch->saf_cond = sc_missing;
+			my_logf(
+				"Unknown value for \"cond\": %s",
+				tup->cond);
+		}
+	}
+
+	/* A COF keepalive will have no "obj" but may have a "cond" or "msg". */
+	if (tup->obj.saf_obj == NULL && tup->obj_json == NULL) {
+		DEBUG(4, true, "COF object is empty, i.e. a keepalive\n");
+		fetch->query->keepalives++;
+		return true;
+	}
+	return false;
+}
+
+/* a set of tuples, each kept as two 64-bit hashes of the fields that
+ * identify it rather than as a copy of them.  a set made for one part of
+ * a bisected query also answers for the sets of the parts it was split
+ * from, which are kept as long as any part split from them is.
+ */
+struct tuple_key {
+	uint64_t	a, b;
+};
+struct tuple_set {
+	struct tuple_set *up;
+	int		refs;
+	struct tuple_key *slots;
+	size_t		size, used;
+};
+
+/* tuple_key -- hash the fields that identify a tuple, each with its NUL,
+ * FNV-1a one way and multiply-xorshift the other.  the all-zero key marks
+ * an empty slot, so is never made.
+ */
+static void
+tuple_key(pdns_tuple_ct tup, struct tuple_key *key) {
+	const char *fields[4], *p;
+	size_t i;
+
+	fields[0] = or_else(tup->rrname, "");
+	fields[1] = or_else(tup->rrtype, "");
+	fields[2] = or_else(tup->rdata, "");
+	fields[3] = or_else(tup->raw_rdata, "");
+	key->a = 14695981039346656037ULL;
+	key->b = 0;
+	for (i = 0; i < 4; i++) {
+		p = fields[i];
+		do {
+			key->a = (key->a ^ (u_char)*p) * 1099511628211ULL;
+			key->b = (key->b ^ (u_char)*p) * 0x9e3779b97f4a7c15ULL;
+			key->b ^= key->b >> 29;
+		} while (*p++ != '\0');
+	}
+	if (key->a == 0 && key->b == 0)
+		key->b = 1;
+}
+
+/* tuple_set_slot -- find where a key is, or would be, in a tuple set.
+ */
+static struct tuple_key *
+tuple_set_slot(struct tuple_set *set, const struct tuple_key *key) {
+	size_t i = (size_t)key->a & (set->size - 1);
+
+	while ((set->slots[i].a != 0 || set->slots[i].b != 0) &&
+	       (set->slots[i].a != key->a || set->slots[i].b != key->b))
+		i = (i + 1) & (set->size - 1);
+	return &set->slots[i];
+}
+
+/* tuple_set_has -- is a key in a tuple set, or in any set above it?
+ */
+static bool
+tuple_set_has(struct tuple_set *set, const struct tuple_key *key) {
+	const struct tuple_key *slot;
+
+	for (; set != NULL; set = set->up) {
+		slot = tuple_set_slot(set, key);
+		if (slot->a != 0 || slot->b != 0)
+			return (true);
+	}
+	return (false);
+}
+
+/* tuple_set_put -- add a key, not already there, to a tuple set.
+ */
+static void
+tuple_set_put(struct tuple_set *set, const struct tuple_key *key) {
+	*tuple_set_slot(set, key) = *key;
+
+	/* keep the set at most half full, so probes stay short. */
+	if (++set->used * 2 > set->size) {
+		struct tuple_key *old = set->slots;
+		size_t i, size = set->size;
+
+		set->size *= 2;
+		set->slots = NULL;
+		CREATE(set->slots, set->size * sizeof *set->slots);
+		for (i = 0; i < size; i++)
+			if (old[i].a != 0 || old[i].b != 0)
+				*tuple_set_slot(set, &old[i]) = old[i];
+		DESTROY(old);
+	}
+}
+
+/* tuple_within -- can a tuple be returned only for this fetch's part of
+ * a bisected query, and the parts it may be split into?  so it is when
+ * the time range the server gave for it, which spans all its records,
+ * lies inside the part's range of time_first.  one with no time range
+ * may be returned for any part.
+ */
+static bool
+tuple_within(fetch_t fetch, pdns_tuple_ct tup) {
+	return tup->time_first != 0 && tup->time_last != 0 &&
+		tup->time_first > fetch->fence.first_after &&
+		(fetch->fence.first_before == 0 ||
+		 tup->time_last < fetch->fence.first_before);
+}
+
+/* tuple_fresh -- is this tuple new to a bisected query?  if so, it is
+ * remembered by the fetch if no other part of the query could return it
+ * again, or else by the query.
+ */
+static bool
+tuple_fresh(fetch_t fetch, pdns_tuple_ct tup) {
+	query_t query = fetch->query;
+	struct tuple_key key;
+
+	tuple_key(tup, &key);
+	if (tuple_set_has(query->seen, &key) ||
+	    tuple_set_has(fetch->seen, &key))
+		return (false);
+	if (tuple_within(fetch, tup)) {
+		if (fetch->seen == NULL)
+			fetch->seen = tuple_set_new(NULL);
+		tuple_set_put(fetch->seen, &key);
+	} else {
+		tuple_set_put(query->seen, &key);
+	}
+	return (true);
+}
+
+/* tuple_set_new -- create an empty tuple set, below another or NULL.
+ */
+struct tuple_set *
+tuple_set_new(struct tuple_set *up) {
+	struct tuple_set *set = NULL;
+
+	CREATE(set, sizeof *set);
+	set->up = up;
+	if (up != NULL)
+		up->refs++;
+	set->refs = 1;
+	set->size = 1024;
+	CREATE(set->slots, set->size * sizeof *set->slots);
+	return (set);
+}
+
+/* tuple_set_free -- let go of a tuple set, destroying it when nothing
+ * else holds it, and then perhaps the sets above it.
+ */
+void
+tuple_set_free(struct tuple_set *set) {
+	struct tuple_set *up;
+
+	for (; set != NULL && --set->refs == 0; set = up) {
+		up = set->up;
+		DESTROY(set->slots);
+		DESTROY(set);
+	}
+}
+
+/* data_blob -- process one deblocked json blob as a counted string,
+ * with a structural index covering it, or NULL.
  *
  * presents each blob and then frees it.
- * returns number of tuples processed (for now, 1 or 0).
+ * returns number of tuples presented (for now, 1 or 0).
  */
 int
-data_blob(query_t query, const char *buf, size_t len) {
+data_blob(fetch_t fetch, const char *buf, size_t len, sindex_ct ix) {
+	query_t query = fetch->query;
 	writer_t writer = query->writer;
 	const char *msg;
 	struct pdns_tuple tup;
 	int ret = 0;
 
-	msg = tuple_make(&tup, buf, len);
+	msg = tuple_make(&tup, buf, len, ix);
 	if (msg != NULL) {
 		fputs(msg, stderr);
 		fputc('\n', stderr);
 		goto more;
 	}
 
-	if (tup.msg != NULL) {
-		DEBUG(5, true, "data_blob tup.msg = %s\n", tup.msg);
-		query->saf_msg = strdup(tup.msg);
-	}
-
-	if (tup.cond != NULL) {
-		DEBUG(5, true, "data_blob tup.cond = %s\n", tup.cond);
-		/* if we goto next now, this line will not be counted */
-		if (strcmp(tup.cond, "begin") == 0) {
-			query->saf_cond = sc_begin;
-			goto next;
-		} else if (strcmp(tup.cond, "ongoing") == 0) {
-			/* "cond":"ongoing" key vals should
-			 * be ignored but the rest of line used. */
-			query->saf_cond = sc_ongoing;
-		} else if (strcmp(tup.cond, "succeeded") == 0) {
-			query->saf_cond = sc_succeeded;
-			goto next;
-		} else if (strcmp(tup.cond, "limited") == 0) {
-			query->saf_cond = sc_limited;
-			goto next;
-		} else if (strcmp(tup.cond, "failed") == 0) {
-			query->saf_cond = sc_failed;
-			goto next;
-		} else {
-			/* use sc_missing for an invalid cond value  */
-			query->saf_cond = sc_missing;
-			my_logf(
-				"Unknown value for \"cond\": %s",
-				tup.cond);
-		}
-	}
+	if (tuple_saf(fetch, &tup))
+		goto next;
 
-	/* A COF keepalive will have no "obj" but may have a "cond" or "msg". */
-	if (tup.obj.saf_obj == NULL) {
-		DEBUG(4, true, "COF object is empty, i.e. a keepalive\n");
+	/* the parts of a bisected query can return the same tuple. */
+	if (query->seen != NULL && !tuple_fresh(fetch, &tup)) {
+		DEBUG(4, true, "dropping duplicate tuple\n");
 		goto next;
 	}
 
-	(*presenter)(&tup, buf, len, writer);
-	ret = 1;
+	if ((*presenter)(&tup, buf, len, writer))
+		ret = 1;
  next:
 	tuple_unmake(&tup);
  more:
 	return (ret);
 }
+
+/* saf_line -- take note of a --raw line's SAF cond and msg, as
+ * data_blob() would, without presenting it.
+ *
+ * returns true if the line carries no results.
+ */
+bool
+saf_line(fetch_t fetch, const char *buf, size_t len) {
+	const char *msg;
+	struct pdns_tuple tup;
+	bool empty;
+
+	msg = tuple_make(&tup, buf, len, NULL);
+	if (msg != NULL) {
+		fputs(msg, stderr);
+		fputc('\n', stderr);
+		return false;
+	}
+	empty = tuple_saf(fetch, &tup);
+	tuple_unmake(&tup);
+	return empty;
+}
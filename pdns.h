@@ -19,6 +19,7 @@
 
 #include <jansson.h>
 #include "netio.h"
+#include "sindex.h"
 
 /* main is the primary jansson library object from a json_loadb().
  * all the other fields in this structure will point inside main, as
@@ -36,6 +37,15 @@ struct pdns_json {
 		*rdata, *raw_rdata;
 };
 
+/* most octets of string fields a tuple can hold without jansson. */
+#define TUPLE_SCRATCH 4096
+
+/* most lines are scanned without jansson.  then obj.main is NULL, the
+ * string fields point into scratch, and obj_json and obj_len give the
+ * text of the obj member, borrowed from the line.  obj_plain says that
+ * text is just what present_json() would write, and is only worked out
+ * when that is the presenter.
+ */
 struct pdns_tuple {
 	struct pdns_json  obj;
 	const char	 *cond, *msg;
@@ -43,16 +53,15 @@ struct pdns_tuple {
 	json_int_t	  count;
 	u_long		  time_first, time_last;
 	const char	 *rdata, *raw_rdata;
+	const char	 *obj_json;
+	size_t		  obj_len;
+	bool		  obj_plain;
+	/* must be last; tuple_make() does not clear it. */
+	char		  scratch[TUPLE_SCRATCH];
 };
 typedef struct pdns_tuple *pdns_tuple_t;
 typedef const struct pdns_tuple *pdns_tuple_ct;
 
-struct pdns_fence {
-	u_long	first_after, first_before, last_after, last_before;
-};
-typedef struct pdns_fence pdns_fence_t;
-typedef const struct pdns_fence *pdns_fence_ct;
-
 struct pdns_system {
 	/* name of this pdns system, as specifiable by the user. */
 	const char	*name;
@@ -87,12 +96,20 @@ struct pdns_system {
 	 */
 	const char *	(*ready)(void);
 
+	/* guess which server URL will be used, before configuration is
+	 * complete, so that a connection to it can be prewarmed.  Returns
+	 * a string that must be freed, or NULL.  May be NULL if this pDNS
+	 * system cannot guess.
+	 */
+	char *		(*server)(void);
+
 	/* drop heap storage. */
 	void		(*destroy)(void);
 };
 typedef const struct pdns_system *pdns_system_ct;
 
-typedef void (*present_t)(pdns_tuple_ct, const char *, size_t, writer_t);
+/* a presenter returns false if it could not present the tuple. */
+typedef bool (*present_t)(pdns_tuple_ct, const char *, size_t, writer_t);
 
 /*
  * Possible variations of output:
@@ -106,14 +123,19 @@ typedef void (*present_t)(pdns_tuple_ct, const char *, size_t, writer_t);
  */
 typedef enum { pres_json, pres_batch, pres_batch_dedup_rrtype } present_e;
 
-void present_json(pdns_tuple_ct, const char *, size_t, writer_t);
-void present_batch(pdns_tuple_ct, const char *, size_t, writer_t);
-void present_batch_dedup_rrtype(pdns_tuple_ct, const char *, size_t, writer_t);
-const char *tuple_make(pdns_tuple_t, const char *, size_t);
+bool present_json(pdns_tuple_ct, const char *, size_t, writer_t);
+bool present_batch(pdns_tuple_ct, const char *, size_t, writer_t);
+bool present_batch_dedup_rrtype(pdns_tuple_ct, const char *, size_t, writer_t);
+const char *tuple_make(pdns_tuple_t, const char *, size_t, sindex_ct);
 void tuple_unmake(pdns_tuple_t);
-int data_blob(query_t, const char *, size_t);
+int data_blob(fetch_t, const char *, size_t, sindex_ct);
+bool saf_line(fetch_t, const char *, size_t);
+struct tuple_set *tuple_set_new(struct tuple_set *);
+void tuple_set_free(struct tuple_set *);
 
 /* Any HTTP status codes we handle specifically */
 #define HTTP_OK		   200
+#define HTTP_TOO_MANY_REQUESTS	429
+#define HTTP_SERVICE_UNAVAILABLE 503
 
 #endif /*PDNS_H_INCLUDED*/
@@ -32,6 +32,7 @@
 
 static const char *dnsdb_setval(const char *, const char *);
 static const char *dnsdb_ready(void);
+static char *dnsdb_server(void);
 static void dnsdb_destroy(void);
 static char *dnsdb_url(const char *, char *, qdesc_ct, pdns_fence_ct);
 static void dnsdb_auth(fetch_t);
@@ -61,7 +62,7 @@ static const char *blocked_api_key_prefixes[] = {
 static const struct pdns_system dnsdb2 = {
 	"dnsdb2", "https://api.dnsdb.info/dnsdb/v2",
 	dnsdb_url, dnsdb_auth, dnsdb_status, dnsdb_setval,
-	dnsdb_ready, dnsdb_destroy
+	dnsdb_ready, dnsdb_server, dnsdb_destroy
 };
 
 pdns_system_ct
@@ -143,6 +144,28 @@ dnsdb_ready(void) {
 	return NULL;
 }
 
+/* dnsdb_server() -- guess the server URL, before dnsdb_ready() has run
+ */
+static char *
+dnsdb_server(void) {
+	const char *server;
+	char *ret;
+
+	server = getenv(env_dnsdb_base_url);
+	if (server == NULL)
+		server = or_else(dnsdb_base_url, dnsdb2.base_url);
+
+	/* supply a scheme if the server string did not. */
+	if (asprintf(&ret, "%s%s",
+		     strstr(server, "://") == NULL ? "https://" : "",
+		     server) < 0)
+	{
+		perror("asprintf");
+		return NULL;
+	}
+	return ret;
+}
+
 /* dnsdb_destroy() -- drop heap storage
  */
 static void
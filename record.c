@@ -0,0 +1,414 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* asprintf() does not appear on linux without this */
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "defs.h"
+#include "netio.h"
+#include "pdns.h"
+#include "record.h"
+#include "globals.h"
+
+/* a recording directory holds, for each fetch attempt, NNNNNN.body with
+ * the response body exactly as libcurl delivered it, and NNNNNN.meta:
+ *
+ *	url URL
+ *	chunk MS OCTETS		(one per delivery, MS since the start)
+ *	status RCODE
+ *	result TEXT
+ *
+ * the status line is written last, so a recording without one is not
+ * complete and is not replayed.
+ */
+
+struct chunk {
+	long long	ms;
+	size_t		end;	/* body offset just past this chunk */
+};
+
+struct record {
+	/* recording: where it goes. */
+	FILE		*body;
+	FILE		*meta;
+	/* replaying: which recording, and how far it has been delivered. */
+	struct replay	*replay;
+	struct chunk	*chunks;
+	size_t		nchunks, next, pos;
+	long long	start_ms;
+};
+
+/* one recording found in the replay directory. */
+struct replay {
+	char		*key;
+	char		*meta;
+	char		*file_url;
+	long		rcode;
+	bool		used;
+};
+
+static long long record_ms(void);
+static const char *url_key(const char *);
+static bool replay_load(struct replay *, const char *, const char *);
+static void replay_chunks(record_t);
+static int rec_filter(const struct dirent *);
+
+static char *rec_dir = NULL;
+static unsigned rec_serial = 0;
+static struct replay *replays = NULL;
+static size_t nreplays = 0;
+
+/*---------------------------------------------------------------- public
+ */
+
+/* record_init -- get ready to record fetches into this directory, after
+ * any recordings already there.  returns NULL or an error message.
+ */
+const char *
+record_init(const char *dir) {
+	struct dirent **names;
+	int n, i;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		return strerror(errno);
+	n = scandir(dir, &names, rec_filter, alphasort);
+	if (n < 0)
+		return strerror(errno);
+	for (i = 0; i < n; i++) {
+		unsigned serial = (unsigned)strtoul(names[i]->d_name, NULL, 10);
+
+		if (serial >= rec_serial)
+			rec_serial = serial + 1;
+		free(names[i]);
+	}
+	free(names);
+	rec_dir = strdup(dir);
+	return NULL;
+}
+
+/* replay_init -- index the complete recordings in this directory.
+ * returns NULL or an error message.
+ */
+const char *
+replay_init(const char *dir) {
+	struct dirent **names;
+	char *path;
+	int n, i;
+
+	if ((path = realpath(dir, NULL)) == NULL)
+		return strerror(errno);
+	n = scandir(path, &names, rec_filter, alphasort);
+	if (n < 0) {
+		DESTROY(path);
+		return strerror(errno);
+	}
+	CREATE(replays, (size_t)n * sizeof(struct replay) + 1);
+	for (i = 0; i < n; i++) {
+		if (replay_load(&replays[nreplays], path, names[i]->d_name))
+			nreplays++;
+		free(names[i]);
+	}
+	free(names);
+	DEBUG(1, true, "replay: %zu recordings in %s\n", nreplays, path);
+	DESTROY(path);
+	if (nreplays == 0)
+		return "no complete recordings found";
+	return NULL;
+}
+
+/* record_fini -- forget the recording or replay directory.
+ */
+void
+record_fini(void) {
+	size_t i;
+
+	for (i = 0; i < nreplays; i++) {
+		DESTROY(replays[i].key);
+		DESTROY(replays[i].meta);
+		DESTROY(replays[i].file_url);
+	}
+	DESTROY(replays);
+	nreplays = 0;
+	DESTROY(rec_dir);
+}
+
+/* record_start -- begin recording one fetch attempt of this url.
+ */
+record_t
+record_start(const char *url) {
+	record_t rec = NULL;
+	char *path;
+
+	CREATE(rec, sizeof(struct record));
+	rec->start_ms = record_ms();
+	if (asprintf(&path, "%s/%06u.body", rec_dir, rec_serial) < 0)
+		my_panic(true, "asprintf");
+	rec->body = fopen(path, "w");
+	if (rec->body == NULL)
+		my_logf("warning: cannot record to %s: %s",
+			path, strerror(errno));
+	DESTROY(path);
+	if (asprintf(&path, "%s/%06u.meta", rec_dir, rec_serial) < 0)
+		my_panic(true, "asprintf");
+	rec->meta = fopen(path, "w");
+	if (rec->meta == NULL)
+		my_logf("warning: cannot record to %s: %s",
+			path, strerror(errno));
+	DESTROY(path);
+	rec_serial++;
+
+	if (rec->meta != NULL)
+		fprintf(rec->meta, "url %s\n", url);
+	return rec;
+}
+
+/* record_chunk -- record some of a fetch's response body, and when.
+ */
+void
+record_chunk(record_t rec, const char *ptr, size_t len) {
+	if (rec->body != NULL)
+		fwrite(ptr, 1, len, rec->body);
+	if (rec->meta != NULL)
+		fprintf(rec->meta, "chunk %lld %zu\n",
+			record_ms() - rec->start_ms, len);
+}
+
+/* record_end -- a recorded or replayed fetch attempt is over.
+ */
+void
+record_end(record_t rec, long rcode, const char *result) {
+	if (rec->body != NULL)
+		fclose(rec->body);
+	if (rec->meta != NULL) {
+		fprintf(rec->meta, "status %ld\nresult %s\n", rcode, result);
+		fclose(rec->meta);
+	}
+	DESTROY(rec->chunks);
+	DESTROY(rec);
+}
+
+/* replay_start -- find a recording of this url not yet replayed, or the
+ * last one if all have been, and set *rcode to its HTTP status.  returns
+ * NULL if there is none.
+ */
+record_t
+replay_start(const char *url, long *rcode) {
+	struct replay *found = NULL;
+	const char *key = url_key(url);
+	record_t rec = NULL;
+	size_t i;
+
+	for (i = 0; i < nreplays; i++)
+		if (strcmp(replays[i].key, key) == 0) {
+			found = &replays[i];
+			if (!found->used)
+				break;
+		}
+	if (found == NULL)
+		return NULL;
+	found->used = true;
+
+	CREATE(rec, sizeof(struct record));
+	rec->replay = found;
+	rec->start_ms = record_ms();
+	if (replay_paced)
+		replay_chunks(rec);
+	*rcode = found->rcode;
+	return rec;
+}
+
+/* replay_url -- the file:// url of a replay's recorded body.
+ */
+const char *
+replay_url(record_t rec) {
+	return rec->replay->file_url;
+}
+
+/* replay_wait -- how many milliseconds until the recording had received
+ * the next len octets, or 0 if it already had, in which case they count
+ * as delivered.
+ */
+long
+replay_wait(record_t rec, size_t len) {
+	size_t end = rec->pos + len;
+	long long due;
+
+	while (rec->next < rec->nchunks && rec->chunks[rec->next].end < end)
+		rec->next++;
+	if (rec->next == rec->nchunks)
+		due = rec->nchunks == 0 ? 0 : rec->chunks[rec->nchunks - 1].ms;
+	else
+		due = rec->chunks[rec->next].ms;
+	due -= record_ms() - rec->start_ms;
+	if (due > 0)
+		return (long)due;
+	rec->pos = end;
+	return 0;
+}
+
+/* file_url -- make a file:// url for an absolute path.
+ */
+char *
+file_url(const char *path) {
+	static const char hex[] = "0123456789ABCDEF";
+	char *ret = NULL, *q;
+	const char *p;
+
+	CREATE(ret, sizeof "file://" + strlen(path) * 3);
+	q = stpcpy(ret, "file://");
+	for (p = path; *p != '\0'; p++) {
+		unsigned char ch = (unsigned char)*p;
+
+		if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+		    (ch >= '0' && ch <= '9') || strchr("/-._~", ch) != NULL)
+		{
+			*q++ = (char)ch;
+		} else {
+			*q++ = '%';
+			*q++ = hex[ch >> 4];
+			*q++ = hex[ch & 0xf];
+		}
+	}
+	*q = '\0';
+	return ret;
+}
+
+/*---------------------------------------------------------------- private
+ */
+
+/* record_ms -- milliseconds on a clock that does not jump.
+ */
+static long long
+record_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* url_key -- the part of a url that identifies a fetch: everything after
+ * the server, so that a replay need not name the same one.
+ */
+static const char *
+url_key(const char *url) {
+	const char *p = strstr(url, "://");
+
+	if (p == NULL)
+		return url;
+	p = strchr(p + 3, '/');
+	return p != NULL ? p : "";
+}
+
+/* replay_load -- read the url and status of one recording.  returns
+ * false if it is not complete.
+ */
+static bool
+replay_load(struct replay *rp, const char *dir, const char *name) {
+	char *line = NULL, *path, *url = NULL;
+	size_t n = 0;
+	ssize_t len;
+	long rcode = -1;
+	FILE *f;
+
+	if (asprintf(&path, "%s/%s", dir, name) < 0)
+		my_panic(true, "asprintf");
+	if ((f = fopen(path, "r")) == NULL) {
+		my_logf("warning: cannot replay %s: %s",
+			path, strerror(errno));
+		DESTROY(path);
+		return false;
+	}
+	while ((len = getline(&line, &n, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (strncmp(line, "url ", 4) == 0 && url == NULL)
+			url = strdup(line + 4);
+		else if (strncmp(line, "status ", 7) == 0)
+			rcode = strtol(line + 7, NULL, 10);
+	}
+	DESTROY(line);
+	fclose(f);
+	if (url == NULL || rcode < 0) {
+		DEBUG(1, true, "replay: %s is not complete\n", path);
+		DESTROY(url);
+		DESTROY(path);
+		return false;
+	}
+
+	rp->key = strdup(url_key(url));
+	DESTROY(url);
+	rp->rcode = rcode;
+	rp->meta = path;
+	/* NNNNNN.meta -> NNNNNN.body */
+	path = strdup(rp->meta);
+	strcpy(path + strlen(path) - 4, "body");
+	rp->file_url = file_url(path);
+	DESTROY(path);
+	return true;
+}
+
+/* replay_chunks -- read a recording's chunk timings, to replay it at the
+ * pace it was recorded.
+ */
+static void
+replay_chunks(record_t rec) {
+	char *line = NULL;
+	size_t n = 0, end = 0, size = 0;
+	ssize_t len;
+	FILE *f;
+
+	if ((f = fopen(rec->replay->meta, "r")) == NULL)
+		return;
+	while ((len = getline(&line, &n, f)) > 0) {
+		long long ms;
+		size_t octets;
+
+		if (sscanf(line, "chunk %lld %zu", &ms, &octets) != 2)
+			continue;
+		if (rec->nchunks == size) {
+			size = size == 0 ? 64 : size * 2;
+			rec->chunks = realloc(rec->chunks,
+					      size * sizeof(struct chunk));
+			if (rec->chunks == NULL)
+				my_panic(true, "realloc");
+		}
+		end += octets;
+		rec->chunks[rec->nchunks].ms = ms;
+		rec->chunks[rec->nchunks].end = end;
+		rec->nchunks++;
+	}
+	DESTROY(line);
+	fclose(f);
+}
+
+/* rec_filter -- scandir() filter for NNNNNN.meta names.
+ */
+static int
+rec_filter(const struct dirent *d) {
+	size_t len = strlen(d->d_name);
+
+	return len > 5 && strcmp(d->d_name + len - 5, ".meta") == 0 &&
+		strspn(d->d_name, "0123456789") == len - 5;
+}
@@ -0,0 +1,37 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef RECORD_H_INCLUDED
+#define RECORD_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* one fetch attempt, being recorded or replayed. */
+typedef struct record *record_t;
+
+const char *record_init(const char *);
+const char *replay_init(const char *);
+void record_fini(void);
+record_t record_start(const char *);
+void record_chunk(record_t, const char *, size_t);
+void record_end(record_t, long, const char *);
+record_t replay_start(const char *, long *);
+const char *replay_url(record_t);
+long replay_wait(record_t, size_t);
+char *file_url(const char *);
+
+#endif /*RECORD_H_INCLUDED*/
@@ -0,0 +1,289 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SINDEX_X86 1
+#include <immintrin.h>
+#endif
+
+#include "defs.h"
+#include "netio.h"
+#include "pdns.h"
+#include "sindex.h"
+#include "globals.h"
+
+/* the index is built 64 octets, one word of each bitmap, at a time.  a
+ * builder is handed whole blocks only; a short last block is copied out
+ * and padded with spaces, which none of the bitmaps mark.
+ */
+#define BLOCK 64
+
+typedef void (*builder_t)(const char *, size_t,
+			  uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+
+static void build_scalar(const char *, size_t,
+			 uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+#ifdef SINDEX_X86
+static void build_sse2(const char *, size_t,
+		       uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+static void build_avx2(const char *, size_t,
+		       uint64_t *, uint64_t *, uint64_t *, uint64_t *);
+#endif
+static bool usable(const char *);
+static builder_t builder_for(const char *);
+
+const char * const sindex_impls[] = {
+	"scalar",
+#ifdef SINDEX_X86
+	"sse2",
+	"avx2",
+#endif
+	NULL
+};
+
+static builder_t builder = NULL;
+static const char *builder_name = NULL;
+
+/* sindex_build -- index a buffer, reusing the index's bitmaps if they
+ * are large enough.  the buffer is not copied, and must outlive its use.
+ */
+void
+sindex_build(struct sindex *ix, const char *buf, size_t len) {
+	size_t words = (len + BLOCK - 1) / BLOCK, whole = len / BLOCK;
+
+	if (builder == NULL) {
+		int i;
+
+		/* use the last, and so fastest, builder this CPU has. */
+		for (i = 0; sindex_impls[i] != NULL; i++)
+			if (usable(sindex_impls[i]))
+				builder_name = sindex_impls[i];
+		builder = builder_for(builder_name);
+		DEBUG(2, true, "sindex: using %s\n", builder_name);
+	}
+	if (words > ix->words) {
+		uint64_t *bits;
+		size_t size = words > ix->words * 2 ? words : ix->words * 2;
+
+		bits = realloc(ix->nl, size * 4 * sizeof *bits);
+		if (bits == NULL)
+			my_panic(true, "realloc");
+		ix->nl = bits;
+		ix->quote = bits + size;
+		ix->bslash = bits + size * 2;
+		ix->odd = bits + size * 3;
+		ix->words = size;
+	}
+	ix->base = buf;
+	ix->len = len;
+	builder(buf, whole, ix->nl, ix->quote, ix->bslash, ix->odd);
+	if (whole < words) {
+		char pad[BLOCK];
+
+		memset(pad, ' ', sizeof pad);
+		memcpy(pad, buf + whole * BLOCK, len - whole * BLOCK);
+		builder(pad, 1, ix->nl + whole, ix->quote + whole,
+			ix->bslash + whole, ix->odd + whole);
+	}
+}
+
+/* sindex_free -- release an index's bitmaps.
+ */
+void
+sindex_free(struct sindex *ix) {
+	free(ix->nl);
+	memset(ix, 0, sizeof *ix);
+}
+
+/* sindex_next -- find the first bit set in [from, to) of a bitmap.
+ *
+ * returns its offset, or to if there is none.
+ */
+size_t
+sindex_next(const uint64_t *bits, size_t from, size_t to) {
+	size_t w = from / BLOCK;
+	uint64_t word;
+
+	if (from >= to)
+		return to;
+	word = bits[w] & (~(uint64_t)0 << (from % BLOCK));
+	while (word == 0) {
+		if (++w * BLOCK >= to)
+			return to;
+		word = bits[w];
+	}
+	from = w * BLOCK + (size_t)__builtin_ctzll(word);
+	return from < to ? from : to;
+}
+
+/* sindex_any -- is any bit set in [from, to) of a bitmap?
+ */
+bool
+sindex_any(const uint64_t *bits, size_t from, size_t to) {
+	return sindex_next(bits, from, to) < to;
+}
+
+/* sindex_select -- use the named builder from now on, for benchmarks.
+ *
+ * returns false if there is no such builder or this CPU lacks it.
+ */
+bool
+sindex_select(const char *name) {
+	builder_t b = builder_for(name);
+
+	if (b == NULL || !usable(name))
+		return false;
+	builder = b;
+	builder_name = name;
+	return true;
+}
+
+/* sindex_impl -- the name of the builder in use, if one has been chosen.
+ */
+const char *
+sindex_impl(void) {
+	return builder_name;
+}
+
+/* usable -- can this CPU run the named builder?
+ */
+static bool
+usable(const char *name) {
+#ifdef SINDEX_X86
+	__builtin_cpu_init();
+	if (strcmp(name, "sse2") == 0)
+		return __builtin_cpu_supports("sse2");
+	if (strcmp(name, "avx2") == 0)
+		return __builtin_cpu_supports("avx2");
+#endif
+	return strcmp(name, "scalar") == 0;
+}
+
+/* builder_for -- map a builder's name to its function.
+ */
+static builder_t
+builder_for(const char *name) {
+	if (strcmp(name, "scalar") == 0)
+		return build_scalar;
+#ifdef SINDEX_X86
+	if (strcmp(name, "sse2") == 0)
+		return build_sse2;
+	if (strcmp(name, "avx2") == 0)
+		return build_avx2;
+#endif
+	return NULL;
+}
+
+/* build_scalar -- the portable builder, one octet at a time.
+ */
+static void
+build_scalar(const char *p, size_t blocks, uint64_t *nl, uint64_t *quote,
+	     uint64_t *bslash, uint64_t *odd)
+{
+	size_t w;
+
+	for (w = 0; w < blocks; w++, p += BLOCK) {
+		uint64_t n = 0, q = 0, b = 0, o = 0;
+		unsigned i;
+
+		for (i = 0; i < BLOCK; i++) {
+			u_char ch = (u_char)p[i];
+
+			n |= (uint64_t)(ch == '\n') << i;
+			q |= (uint64_t)(ch == '"') << i;
+			b |= (uint64_t)(ch == '\\') << i;
+			o |= (uint64_t)(ch < 0x20 || ch >= 0x80) << i;
+		}
+		nl[w] = n;
+		quote[w] = q;
+		bslash[w] = b;
+		odd[w] = o;
+	}
+}
+
+#ifdef SINDEX_X86
+/* build_sse2 -- four 16-octet compares per block.  a signed compare
+ * against 0x20 catches both the control characters and, being negative,
+ * the octets which are not ASCII.
+ */
+__attribute__((target("sse2")))
+static void
+build_sse2(const char *p, size_t blocks, uint64_t *nl, uint64_t *quote,
+	   uint64_t *bslash, uint64_t *odd)
+{
+	const __m128i c_nl = _mm_set1_epi8('\n'), c_quote = _mm_set1_epi8('"'),
+		c_bslash = _mm_set1_epi8('\\'), c_space = _mm_set1_epi8(' ');
+	size_t w;
+
+	for (w = 0; w < blocks; w++, p += BLOCK) {
+		uint64_t n = 0, q = 0, b = 0, o = 0;
+		unsigned i;
+
+		for (i = 0; i < BLOCK; i += 16) {
+			__m128i x = _mm_loadu_si128((const __m128i *)
+						    (const void *)(p + i));
+
+			n |= (uint64_t)(uint32_t)_mm_movemask_epi8(
+				_mm_cmpeq_epi8(x, c_nl)) << i;
+			q |= (uint64_t)(uint32_t)_mm_movemask_epi8(
+				_mm_cmpeq_epi8(x, c_quote)) << i;
+			b |= (uint64_t)(uint32_t)_mm_movemask_epi8(
+				_mm_cmpeq_epi8(x, c_bslash)) << i;
+			o |= (uint64_t)(uint32_t)_mm_movemask_epi8(
+				_mm_cmplt_epi8(x, c_space)) << i;
+		}
+		nl[w] = n;
+		quote[w] = q;
+		bslash[w] = b;
+		odd[w] = o;
+	}
+}
+
+/* build_avx2 -- as build_sse2(), with two 32-octet compares per block.
+ */
+__attribute__((target("avx2")))
+static void
+build_avx2(const char *p, size_t blocks, uint64_t *nl, uint64_t *quote,
+	   uint64_t *bslash, uint64_t *odd)
+{
+	const __m256i c_nl = _mm256_set1_epi8('\n'),
+		c_quote = _mm256_set1_epi8('"'),
+		c_bslash = _mm256_set1_epi8('\\'),
+		c_space = _mm256_set1_epi8(' ');
+	size_t w;
+
+	for (w = 0; w < blocks; w++, p += BLOCK) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)
+						(const void *)p),
+			hi = _mm256_loadu_si256((const __m256i *)
+						(const void *)(p + 32));
+
+#define MASK(v, c) ((uint64_t)(uint32_t)_mm256_movemask_epi8(v(lo, c)) | \
+		    (uint64_t)(uint32_t)_mm256_movemask_epi8(v(hi, c)) << 32)
+#define LT(x, c) _mm256_cmpgt_epi8(c, x)
+		nl[w] = MASK(_mm256_cmpeq_epi8, c_nl);
+		quote[w] = MASK(_mm256_cmpeq_epi8, c_quote);
+		bslash[w] = MASK(_mm256_cmpeq_epi8, c_bslash);
+		odd[w] = MASK(LT, c_space);
+#undef LT
+#undef MASK
+	}
+}
+#endif /*SINDEX_X86*/
@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2014-2020 by Farsight Security, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef SINDEX_H_INCLUDED
+#define SINDEX_H_INCLUDED 1
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a structural index of a buffer: for each of newlines, double quotes,
+ * backslashes, and octets which are control characters or not ASCII, a
+ * bitmap holding one bit per octet of the buffer.
+ */
+struct sindex {
+	const char	*base;
+	size_t		len;
+	uint64_t	*nl, *quote, *bslash, *odd;
+	size_t		words;
+};
+typedef const struct sindex *sindex_ct;
+
+void sindex_build(struct sindex *, const char *, size_t);
+void sindex_free(struct sindex *);
+size_t sindex_next(const uint64_t *, size_t, size_t);
+bool sindex_any(const uint64_t *, size_t, size_t);
+bool sindex_select(const char *);
+const char *sindex_impl(void);
+
+/* every builder, fastest last; not all are usable on every CPU. */
+extern const char * const sindex_impls[];
+
+#endif /*SINDEX_H_INCLUDED*/
@@ -61,13 +61,13 @@ time_str(u_long x) {
 
 /* timeval_str -- format one timeval (NULL means current time)
  *
- * returns static string. always uses GMT.
+ * returns static string, one per thread. always uses GMT.
  *
  * output format: yyyy-mm-dd hh:mm:ss.fff[fff]
  */
 const char *
 timeval_str(const struct timeval *src, bool milliseconds) {
-	static char ret[sizeof "yyyy-mm-dd hh:mm:ss.ffffff"];
+	static _Thread_local char ret[sizeof "yyyy-mm-dd hh:mm:ss.ffffff"];
 	char *dst;
 
 	struct timeval now;